@@ -16,6 +16,9 @@
 #include <pwd.h>
 #include <ctype.h>
 #include <pthread.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 #ifdef WANT_SYSLOGS
 #include <syslog.h>
 #endif
@@ -32,10 +35,16 @@
 #include "trackerlogic.h"
 #include "ot_mutex.h"
 #include "ot_http.h"
+#include "ot_iovec.h"
 #include "ot_udp.h"
+#include "ot_tcp.h"
 #include "ot_accesslist.h"
 #include "ot_stats.h"
 #include "ot_livesync.h"
+#include "ot_fullscrape.h"
+#include "ot_clean.h"
+#include "ot_snapshot.h"
+#include "ot_journal.h"
 
 /* Globals */
 time_t       g_now_seconds;
@@ -47,6 +56,17 @@ int          g_self_pipe[2];
 static char * g_serverdir;
 static char * g_serveruser;
 static unsigned int g_udp_workers;
+static unsigned int g_udp_batch;
+static unsigned int g_udp_reuseport;
+static unsigned int g_udp_reuseport_bpf;
+static unsigned int g_tcp_workers;
+
+/* UDP sockets served by worker threads. Those threads may only start
+   after all sub systems, including the torrent buckets, are set up.
+   Workers on sharded SO_REUSEPORT sockets are pinned to cpu, else -1 */
+#define OT_MAX_UDP_WORKER_SOCKETS 256
+static struct { int64 sock; unsigned int workers; unsigned int batch; int cpu; } g_udp_worker_sockets[OT_MAX_UDP_WORKER_SOCKETS];
+static int          g_udp_worker_socket_count;
 
 static void panic( const char *routine ) {
   fprintf( stderr, "%s: %s\n", routine, strerror(errno) );
@@ -73,6 +93,8 @@ static void signal_handler( int s ) {
     /* Maintain our copy of the clock. time() on BSDs is very expensive. */
     g_now_seconds = time(NULL);
     alarm(5);
+  } else if( s == SIGUSR1 ) {
+    snapshot_request( );
   }
 }
 
@@ -81,6 +103,7 @@ static void defaul_signal_handlers( void ) {
   sigemptyset(&signal_mask);
   sigaddset (&signal_mask, SIGPIPE);
   sigaddset (&signal_mask, SIGHUP);
+  sigaddset (&signal_mask, SIGUSR1);
   sigaddset (&signal_mask, SIGINT);
   sigaddset (&signal_mask, SIGALRM);
   pthread_sigmask (SIG_BLOCK, &signal_mask, NULL);
@@ -94,11 +117,13 @@ static void install_signal_handlers( void ) {
   sa.sa_handler = signal_handler;
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = SA_RESTART;
-  if ((sigaction(SIGINT, &sa, NULL) == -1) || (sigaction(SIGALRM, &sa, NULL) == -1) )
+  if ((sigaction(SIGINT, &sa, NULL) == -1) || (sigaction(SIGALRM, &sa, NULL) == -1) ||
+      (sigaction(SIGUSR1, &sa, NULL) == -1) )
     panic( "install_signal_handlers" );
 
   sigaddset (&signal_mask, SIGINT);
   sigaddset (&signal_mask, SIGALRM);
+  sigaddset (&signal_mask, SIGUSR1);
   pthread_sigmask (SIG_UNBLOCK, &signal_mask, NULL);
 }
 
@@ -123,7 +148,7 @@ static void help( char *name ) {
   HELPLINE("-r redirecturl","specify url where / should be redirected to (default none)");
   HELPLINE("-d dir","specify directory to try to chroot to (default: \".\")");
   HELPLINE("-u user","specify user under whose priviliges opentracker should run (default: \"nobody\")");
-  HELPLINE("-A ip","bless an ip address as admin address (e.g. to allow syncs from this address)");
+  HELPLINE("-A ip","bless an ip address or net, like 10.0.0.0/8, as admin address (e.g. to allow syncs from this address)");
 #ifdef WANT_ACCESSLIST_BLACK
   HELPLINE("-b file","specify blacklist file.");
 #elif defined( WANT_ACCESSLIST_WHITE )
@@ -134,79 +159,6 @@ static void help( char *name ) {
 }
 #undef HELPLINE
 
-static size_t header_complete( char * request, ssize_t byte_count ) {
-  int i = 0, state = 0;
-
-  for( i=1; i < byte_count; i+=2 )
-    if( request[i] <= 13 ) {
-      i--;
-      for( state = 0 ; i < byte_count; ++i ) {
-        char c = request[i];
-        if( c == '\r' || c == '\n' )
-          state = ( state >> 2 ) | ( ( c << 6 ) & 0xc0 );
-        else
-          break;
-        if( state >= 0xa0 || state == 0x99 ) return i + 1;
-      }
-  }
-  return 0;
-}
-
-static void handle_dead( const int64 sock ) {
-  struct http_data* cookie=io_getcookie( sock );
-  if( cookie ) {
-    iob_reset( &cookie->batch );
-    array_reset( &cookie->request );
-    if( cookie->flag & STRUCT_HTTP_FLAG_WAITINGFORTASK )
-      mutex_workqueue_canceltask( sock );
-    free( cookie );
-  }
-  io_close( sock );
-}
-
-static void handle_read( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data* cookie = io_getcookie( sock );
-  ssize_t byte_count;
-
-  if( ( byte_count = io_tryread( sock, ws->inbuf, G_INBUF_SIZE ) ) <= 0 ) {
-    handle_dead( sock );
-    return;
-  }
-
-  /* If we get the whole request in one packet, handle it without copying */
-  if( !array_start( &cookie->request ) ) {
-    if( ( ws->header_size = header_complete( ws->inbuf, byte_count ) ) ) {
-      ws->request = ws->inbuf;
-      ws->request_size = byte_count;
-      http_handle_request( sock, ws );
-    } else
-      array_catb( &cookie->request, ws->inbuf, byte_count );
-    return;
-  }
-
-  array_catb( &cookie->request, ws->inbuf, byte_count );
-  if( array_failed( &cookie->request ) || array_bytes( &cookie->request ) > 8192 ) {
-    http_issue_error( sock, ws, CODE_HTTPERROR_500 );
-    return;
-  }
-
-  while( ( ws->header_size = header_complete( array_start( &cookie->request ), array_bytes( &cookie->request ) ) ) ) {
-    ws->request      = array_start( &cookie->request );
-    ws->request_size = array_bytes( &cookie->request );
-    http_handle_request( sock, ws );
-#ifdef WANT_KEEPALIVE
-    if( !ws->keep_alive )
-#endif
-      return;
-  }
-}
-
-static void handle_write( const int64 sock ) {
-  struct http_data* cookie=io_getcookie( sock );
-  if( !cookie || ( iob_send( sock, &cookie->batch ) <= 0 ) )
-    handle_dead( sock );
-}
-
 static void handle_accept( const int64 serversocket ) {
   struct http_data *cookie;
   int64 sock;
@@ -219,13 +171,10 @@ static void handle_accept( const int64 serversocket ) {
     /* Put fd into a non-blocking mode */
     io_nonblock( sock );
 
-    if( !io_fd( sock ) ||
-        !( cookie = (struct http_data*)malloc( sizeof(struct http_data) ) ) ) {
+    if( !io_fd( sock ) || !( cookie = http_newcookie( ip ) ) ) {
       io_close( sock );
       continue;
     }
-    memset(cookie, 0, sizeof( struct http_data ) );
-    memcpy(cookie->ip,ip,sizeof(ot_ip6));
 
     io_setcookie( sock, cookie );
     io_wantread( sock );
@@ -245,10 +194,13 @@ static void * server_mainloop( void * args ) {
   time_t next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
   struct iovec *iovector;
   int    iovec_entries;
+  ot_shared_iovec *shared;
+  ot_time          since;
 
   (void)args;
 
   /* Initialize our "thread local storage" */
+  memset( &ws, 0, sizeof(ws) );
   ws.inbuf   = malloc( G_INBUF_SIZE );
   ws.outbuf  = malloc( G_OUTBUF_SIZE );
 #ifdef _DEBUG_HTTPERROR
@@ -256,6 +208,7 @@ static void * server_mainloop( void * args ) {
 #endif
   if( !ws.inbuf || !ws.outbuf )
     panic( "Initializing worker failed" );
+  ot_random_seed( &ws );
 
   for( ; ; ) {
     int64 sock;
@@ -271,18 +224,18 @@ static void * server_mainloop( void * args ) {
       else if( (intptr_t)cookie == FLAG_SELFPIPE )
         io_tryread( sock, ws.inbuf, G_INBUF_SIZE );
       else
-        handle_read( sock, &ws );
+        http_handle_read( sock, &ws, io_tryread( sock, ws.inbuf, G_INBUF_SIZE ) );
     }
 
-    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector ) ) != -1 )
-      http_sendiovecdata( sock, &ws, iovec_entries, iovector );
+    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector, &shared, &since ) ) != -1 )
+      http_sendiovecdata( sock, &ws, iovec_entries, iovector, shared, since );
 
     while( ( sock = io_canwrite( ) ) != -1 )
-      handle_write( sock );
+      http_handle_write( sock, &ws );
 
     if( g_now_seconds > next_timeout_check ) {
       while( ( sock = io_timeouted() ) != -1 )
-        handle_dead( sock );
+        http_handle_dead( sock, &ws );
       next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
     }
 
@@ -294,7 +247,10 @@ static void * server_mainloop( void * args ) {
   return 0;
 }
 
-static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
+/* A shard >= 0 opens one of several SO_REUSEPORT sockets on the same
+   address. For udp it is the cpu to pin the worker to, for tcp the
+   worker loop to hand the listening socket to */
+static int64_t ot_bind_socket( ot_ip6 ip, uint16_t port, PROTO_FLAG proto, int shard ) {
   int64 sock = proto == FLAG_TCP ? socket_tcp6( ) : socket_udp6( );
 
 #ifndef WANT_V6
@@ -318,20 +274,42 @@ static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   }
 #endif
 
+#ifdef SO_REUSEPORT
+  if( shard >= 0 ) {
+    int one = 1;
+    if( setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one) ) == -1 )
+      panic( "setsockopt SO_REUSEPORT" );
+  }
+#endif
+
   if( socket_bind6_reuse( sock, ip, port, 0 ) == -1 )
     panic( "socket_bind6_reuse" );
 
   if( ( proto == FLAG_TCP ) && ( socket_listen( sock, SOMAXCONN) == -1 ) )
     panic( "socket_listen" );
 
+  if( ( proto == FLAG_TCP ) && ( shard >= 0 ) ) {
+    if( tcp_add_listener( sock, shard ) == -1 )
+      panic( "tcp_add_listener" );
+#ifdef _DEBUG
+    fputs( " success.\n", stderr);
+#endif
+    return sock;
+  }
+
   if( !io_fd( sock ) )
     panic( "io_fd" );
 
   io_setcookie( sock, (void*)proto );
 
   if( (proto == FLAG_UDP) && g_udp_workers ) {
+    if( g_udp_worker_socket_count == OT_MAX_UDP_WORKER_SOCKETS )
+      exerr( "Too many udp sockets with workers." );
     io_block( sock );
-    udp_init( sock, g_udp_workers );
+    g_udp_worker_sockets[g_udp_worker_socket_count].sock    = sock;
+    g_udp_worker_sockets[g_udp_worker_socket_count].batch   = g_udp_batch;
+    g_udp_worker_sockets[g_udp_worker_socket_count].cpu     = shard;
+    g_udp_worker_sockets[g_udp_worker_socket_count++].workers = shard >= 0 ? 1 : g_udp_workers;
   } else
     io_wantread( sock );
 
@@ -342,6 +320,72 @@ static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   return sock;
 }
 
+#ifdef SO_REUSEPORT
+/* The cpu the worker of the shard-th udp socket is pinned to. With one
+   shard per cpu, the steering program's cpu % shards is its inverse */
+static int ot_udp_shard_cpu( unsigned int shard, unsigned int cpus ) {
+  return (int)( shard % cpus );
+}
+#endif
+
+#if defined( SO_REUSEPORT ) && defined( SO_ATTACH_REUSEPORT_CBPF )
+/* Let the kernel hand each packet received on cpu c to the socket with
+   index c % sockets. With one socket per online cpu that is the socket
+   whose worker ot_udp_shard_cpu pinned to cpu c */
+static void ot_attach_cpu_steering( int64 sock, unsigned int sockets ) {
+  struct sock_filter code[] = {
+    { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, sockets },
+    { BPF_RET | BPF_A, 0, 0, 0 }
+  };
+  struct sock_fprog prog = { sizeof(code) / sizeof(*code), code };
+  if( setsockopt( sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog) ) == -1 )
+    fprintf( stderr, "Warning: Could not attach cpu steering program to udp sockets: %s\n", strerror(errno) );
+}
+#endif
+
+static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
+#ifdef SO_REUSEPORT
+  /* One socket per worker, so the kernel spreads flows among them
+     instead of all workers contending for a single socket queue */
+  if( ( proto == FLAG_UDP ) && g_udp_workers && g_udp_reuseport ) {
+    long online = sysconf( _SC_NPROCESSORS_ONLN );
+    unsigned int i, cpus = online < 1 ? 1 : (unsigned int)online, shards = g_udp_workers;
+    int64 sock = -1;
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    /* Steering only keeps packets on their cpu if every cpu has exactly
+       one socket, so the shards are sized to the online cpus instead */
+    if( g_udp_reuseport_bpf && shards != cpus ) {
+      fprintf( stderr, "listen.udp.reuseport_bpf: using %u udp workers, one per online cpu, instead of %u.\n", cpus, shards );
+      shards = cpus;
+    }
+#endif
+    for( i=0; i<shards; ++i ) {
+      int64 shard = ot_bind_socket( ip, port, proto, ot_udp_shard_cpu( i, cpus ) );
+      if( !i ) sock = shard;
+    }
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    if( g_udp_reuseport_bpf )
+      ot_attach_cpu_steering( sock, shards );
+#endif
+    return sock;
+  }
+#ifdef __linux__
+  /* Every tcp worker loop accepts on a listening socket of its own */
+  if( ( proto == FLAG_TCP ) && g_tcp_workers ) {
+    int64 sock = -1;
+    unsigned int i;
+    for( i=0; i<g_tcp_workers; ++i ) {
+      int64 shard = ot_bind_socket( ip, port, proto, (int)i );
+      if( !i ) sock = shard;
+    }
+    return sock;
+  }
+#endif
+#endif
+  return ot_bind_socket( ip, port, proto, -1 );
+}
+
 char * set_config_option( char **option, char *value ) {
 #ifdef _DEBUG
   fprintf( stderr, "Setting config option: %s\n", value );
@@ -373,6 +417,31 @@ static int scan_ip6_port( const char *src, ot_ip6 ip, uint16 *port ) {
   return off+s-src;
 }
 
+/* Scans an address with an optional /prefix length, v4 style prefixes for
+   v4 addresses */
+static int scan_ip6_net( const char *src, ot_net *net ) {
+  const char *s = src;
+  int off;
+  while( isspace(*s) ) ++s;
+  if( !(off = scan_ip6( s, net->address ) ) )
+    return 0;
+  s += off;
+  net->bits = 128;
+  if( *s == '/' ) {
+    int v4 = ip6_isv4mapped( net->address );
+    if( !(off = scan_int( ++s, &net->bits ) ) )
+      return 0;
+    s += off;
+    if( net->bits < 0 || net->bits > ( v4 ? 32 : 128 ) )
+      return 0;
+    if( v4 )
+      net->bits += 96;
+  }
+  if( *s && !isspace(*s) )
+    return 0;
+  return s-src;
+}
+
 int parse_configfile( char * config_filename ) {
   FILE *  accesslist_filehandle;
   char    inbuf[512];
@@ -425,6 +494,79 @@ int parse_configfile( char * config_filename ) {
       char *value = p + 18;
       while( isspace(*value) ) ++value;
       scan_uint( value, &g_udp_workers );
+    } else if(!byte_diff(p,16,"listen.udp.batch" ) && isspace(p[16])) {
+      char *value = p + 16;
+      while( isspace(*value) ) ++value;
+      scan_uint( value, &g_udp_batch );
+      if( g_udp_batch > OT_UDP_BATCH_MAX ) {
+        fprintf( stderr, "listen.udp.batch %u exceeds %d, using %d.\n", g_udp_batch, OT_UDP_BATCH_MAX, OT_UDP_BATCH_MAX );
+        g_udp_batch = OT_UDP_BATCH_MAX;
+      }
+    } else if(!byte_diff(p,18,"listen.tcp.workers" ) && isspace(p[18])) {
+      char *value = p + 18;
+      while( isspace(*value) ) ++value;
+      scan_uint( value, &g_tcp_workers );
+#if !defined( __linux__ ) || !defined( SO_REUSEPORT )
+      if( g_tcp_workers )
+        fprintf( stderr, "listen.tcp.workers is not supported on this platform, ignoring.\n" );
+#endif
+      if( g_tcp_workers > OT_TCP_WORKERS_MAX ) {
+        fprintf( stderr, "listen.tcp.workers %u exceeds %d, using %d.\n", g_tcp_workers, OT_TCP_WORKERS_MAX, OT_TCP_WORKERS_MAX );
+        g_tcp_workers = OT_TCP_WORKERS_MAX;
+      }
+    } else if(!byte_diff(p,20,"listen.udp.reuseport" ) && isspace(p[20])) {
+      char *value = p + 20;
+      while( isspace(*value) ) ++value;
+      scan_uint( value, &g_udp_reuseport );
+#ifndef SO_REUSEPORT
+      if( g_udp_reuseport )
+        fprintf( stderr, "listen.udp.reuseport is not supported on this platform, ignoring.\n" );
+#endif
+    } else if(!byte_diff(p,24,"listen.udp.reuseport_bpf" ) && isspace(p[24])) {
+      char *value = p + 24;
+      while( isspace(*value) ) ++value;
+      scan_uint( value, &g_udp_reuseport_bpf );
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+      if( g_udp_reuseport_bpf )
+        fprintf( stderr, "listen.udp.reuseport_bpf is not supported on this platform, ignoring.\n" );
+#endif
+#ifdef WANT_FULLSCRAPE
+    } else if(!byte_diff(p,25,"tracker.fullscrape_maxage" ) && isspace(p[25])) {
+      char *value = p + 25;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_maxage ) ) goto parse_error;
+    } else if(!byte_diff(p,26,"tracker.fullscrape_threads" ) && isspace(p[26])) {
+      char *value = p + 26;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_threads ) ) goto parse_error;
+#ifdef WANT_COMPRESSION_ZSTD
+    } else if(!byte_diff(p,18,"tracker.zstd_level" ) && isspace(p[18])) {
+      char *value = p + 18;
+      while( isspace(*value) ) ++value;
+      if( !scan_int( value, &g_fullscrape_zstd_level ) ) goto parse_error;
+#endif
+#endif
+    } else if(!byte_diff(p,21,"tracker.clean_threads" ) && isspace(p[21])) {
+      char *value = p + 21;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_clean_threads ) ) goto parse_error;
+    } else if(!byte_diff(p,22,"tracker.clean_interval" ) && isspace(p[22])) {
+      char *value = p + 22;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_clean_interval ) ) goto parse_error;
+    } else if(!byte_diff(p,15,"tracker.buckets" ) && isspace(p[15])) {
+      char *value = p + 15;
+      unsigned int buckets = 0;
+      int bits = 0;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &buckets ) ) goto parse_error;
+      while( bits < OT_BUCKET_COUNT_BITS_MAX && ( 1U << bits ) < buckets ) ++bits;
+      if( ( 1U << bits ) != buckets || bits < OT_BUCKET_COUNT_BITS_MIN ) {
+        fprintf( stderr, "tracker.buckets must be a power of two between %d and %d: %s\n",
+          1 << OT_BUCKET_COUNT_BITS_MIN, 1 << OT_BUCKET_COUNT_BITS_MAX, inbuf );
+        continue;
+      }
+      g_bucket_count_bits = bits;
 #ifdef WANT_ACCESSLIST_WHITE
     } else if(!byte_diff(p, 16, "access.whitelist" ) && isspace(p[16])) {
       set_config_option( &g_accesslist_filename, p+17 );
@@ -432,24 +574,43 @@ int parse_configfile( char * config_filename ) {
     } else if(!byte_diff(p, 16, "access.blacklist" ) && isspace(p[16])) {
       set_config_option( &g_accesslist_filename, p+17 );
 #endif
-#ifdef WANT_RESTRICT_STATS
-    } else if(!byte_diff(p, 12, "access.stats" ) && isspace(p[12])) {
-      if( !scan_ip6( p+13, tmpip )) goto parse_error;
-      accesslist_blessip( tmpip, OT_PERMISSION_MAY_STAT );
+#ifdef WANT_ACCESSLIST
+    } else if(!byte_diff(p, 24, "access.accesslist_update" ) && isspace(p[24])) {
+      ot_net tmpnet;
+      if( !scan_ip6_net( p+25, &tmpnet )) goto parse_error;
+      accesslist_blessnet( &tmpnet, OT_PERMISSION_MAY_ACCESSLIST );
 #endif
+    } else if(!byte_diff(p, 12, "access.stats" ) && isspace(p[12])) {
+      ot_net tmpnet;
+      if( !scan_ip6_net( p+13, &tmpnet )) goto parse_error;
+      accesslist_blessnet( &tmpnet, OT_PERMISSION_MAY_STAT );
     } else if(!byte_diff(p, 17, "access.stats_path" ) && isspace(p[17])) {
       set_config_option( &g_stats_path, p+18 );
 #ifdef WANT_IP_FROM_PROXY
     } else if(!byte_diff(p, 12, "access.proxy" ) && isspace(p[12])) {
-      if( !scan_ip6( p+13, tmpip )) goto parse_error;
-      accesslist_blessip( tmpip, OT_PERMISSION_MAY_PROXY );
+      ot_net tmpnet;
+      if( !scan_ip6_net( p+13, &tmpnet )) goto parse_error;
+      accesslist_blessnet( &tmpnet, OT_PERMISSION_MAY_PROXY );
 #endif
+    } else if(!byte_diff(p, 16, "tracker.snapshot" ) && isspace(p[16])) {
+      set_config_option( &g_snapshot_filename, p+17 );
+    } else if(!byte_diff(p,25,"tracker.snapshot_interval" ) && isspace(p[25])) {
+      char *value = p + 25;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_snapshot_interval ) ) goto parse_error;
+    } else if(!byte_diff(p,21,"tracker.snapshot_rate" ) && isspace(p[21])) {
+      char *value = p + 21;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_snapshot_rate ) ) goto parse_error;
+    } else if(!byte_diff(p, 15, "tracker.journal" ) && isspace(p[15])) {
+      set_config_option( &g_journal_filename, p+16 );
     } else if(!byte_diff(p, 20, "tracker.redirect_url" ) && isspace(p[20])) {
       set_config_option( &g_redirecturl, p+21 );
 #ifdef WANT_SYNC_LIVE
     } else if(!byte_diff(p, 24, "livesync.cluster.node_ip" ) && isspace(p[24])) {
-      if( !scan_ip6( p+25, tmpip )) goto parse_error;
-      accesslist_blessip( tmpip, OT_PERMISSION_MAY_LIVESYNC );
+      ot_net tmpnet;
+      if( !scan_ip6_net( p+25, &tmpnet )) goto parse_error;
+      accesslist_blessnet( &tmpnet, OT_PERMISSION_MAY_LIVESYNC );
     } else if(!byte_diff(p, 23, "livesync.cluster.listen" ) && isspace(p[23])) {
       uint16_t tmpport = LIVESYNC_PORT;
       if( !scan_ip6_port( p+24, tmpip, &tmpport )) goto parse_error;
@@ -472,6 +633,10 @@ void load_state(const char * const state_filename ) {
   unsigned long long base, downcount;
   int consumed;
 
+  /* Binary snapshots load in bulk, anything else is a text statedump */
+  if( snapshot_load( state_filename ) <= 0 )
+    return;
+
   state_filehandle = fopen( state_filename, "r" );
 
   if( state_filehandle == NULL ) {
@@ -551,7 +716,8 @@ int drop_privileges ( const char * const serveruser, const char * const serverdi
 }
 
 int main( int argc, char **argv ) {
-  ot_ip6 serverip, tmpip;
+  ot_ip6 serverip;
+  ot_net tmpnet;
   int bound = 0, scanon = 1;
   uint16_t tmpport;
   char * statefile = 0;
@@ -601,8 +767,8 @@ int main( int argc, char **argv ) {
       case 'r': set_config_option( &g_redirecturl, optarg ); break;
       case 'l': statefile = optarg; break;
       case 'A':
-        if( !scan_ip6( optarg, tmpip )) { usage( argv[0] ); exit( 1 ); }
-        accesslist_blessip( tmpip, 0xffff ); /* Allow everything for now */
+        if( !scan_ip6_net( optarg, &tmpnet )) { usage( argv[0] ); exit( 1 ); }
+        accesslist_blessnet( &tmpnet, 0xffff ); /* Allow everything for now */
         break;
       case 'f': bound += parse_configfile( optarg ); break;
       case 'h': help( argv[0] ); exit( 0 );
@@ -624,7 +790,7 @@ int main( int argc, char **argv ) {
   }
 
   if( !g_udp_workers )
-    udp_init( -1, 0 );
+    udp_init( -1, 0, 0, -1 );
 
 #ifdef WANT_SYSLOGS
   openlog( "opentracker", 0, LOG_USER );
@@ -649,9 +815,20 @@ int main( int argc, char **argv ) {
   /* Init all sub systems. This call may fail with an exit() */
   trackerlogic_init( );
 
+  /* Now that the buckets exist, udp workers may start */
+  while( g_udp_worker_socket_count-- )
+    udp_init( g_udp_worker_sockets[g_udp_worker_socket_count].sock, g_udp_worker_sockets[g_udp_worker_socket_count].workers,
+              g_udp_worker_sockets[g_udp_worker_socket_count].batch, g_udp_worker_sockets[g_udp_worker_socket_count].cpu );
+
+  /* Same for tcp worker loops */
+  tcp_init( );
+
   if( statefile )
     load_state( statefile );
 
+  /* Download counts logged after that state was saved */
+  journal_replay( );
+
   install_signal_handlers( );
 
   /* Kick off our initial clock setting alarm */
@@ -10,6 +10,11 @@
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Libowfat */
 #include "byte.h"
@@ -25,19 +30,201 @@
 /* GLOBAL VARIABLES */
 #ifdef WANT_ACCESSLIST
        char    *g_accesslist_filename;
-static ot_hash *g_accesslist;
-static size_t   g_accesslist_size;
-static pthread_mutex_t g_accesslist_mutex;
 
-static int vector_compare_hash(const void *hash1, const void *hash2 ) {
-  return memcmp( hash1, hash2, OT_HASH_COMPARE_SIZE );
+/* Announces look up info hashes without taking any lock. A reloaded list
+   is built off to the side and published by swapping the head pointer.
+   Replaced lists stay chained behind it, until no reader can still be
+   inside them, see accesslist_cleanup
+
+   Info hashes are uniformly random, so their leading index_bits bits
+   directly address a slot in index. Slot p holds the offset of the first
+   hash in the sorted list with prefix p, index[p+1] ends that range. With
+   about one hash per slot, a lookup costs the index read and one compare
+   instead of a cache miss for each step of a binary search
+
+   Single hashes added or removed through accesslist_update land in the
+   small sorted added and removed sets, which take precedence over the
+   list. Each update publishes a new node sharing the list and its index
+   with its predecessor, which hands over base_owner. The cleaner merges
+   the sets into a new list once per cycle */
+typedef struct ot_accesslist ot_accesslist;
+struct ot_accesslist {
+  ot_hash       *list;
+  size_t         size;
+  uint32_t      *index;
+  unsigned int   index_bits;
+  int            base_owner;
+  unsigned long long load_usec;
+  ot_hash       *added;
+  size_t         added_size;
+  ot_hash       *removed;
+  size_t         removed_size;
+  ot_time        replaced;
+  ot_accesslist *next;
+};
+/* Readers load the head with acquire semantics, pairing with the release
+   store in accesslist_publish, so they see a fully built list */
+static ot_accesslist *g_accesslist;
+
+/* Serializes everyone publishing a new head, readers never take it */
+static pthread_mutex_t g_accesslist_update_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* One in OT_ACCESSLIST_SAMPLE lookups per thread is timed */
+static __thread unsigned int accesslist_lookups;
+static unsigned long long    accesslist_sampled;
+static unsigned long long    accesslist_sampled_nsec;
+
+static unsigned long long accesslist_nsec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t accesslist_prefix( const ot_hash hash, unsigned int index_bits ) {
+  return ( ( (uint32_t)hash[0] << 24 ) | ( (uint32_t)hash[1] << 16 ) | ( (uint32_t)hash[2] << 8 ) | hash[3] ) >> ( 32 - index_bits );
+}
+
+static void accesslist_free( ot_accesslist *accesslist ) {
+  if( accesslist->base_owner ) {
+    free( accesslist->index );
+    free( accesslist->list );
+  }
+  free( accesslist->added );
+  free( accesslist->removed );
+  free( accesslist );
+}
+
+/* Call with g_accesslist_update_mutex held. Only the new head may still be
+   modified, the old one is marked replaced before readers can see its
+   successor */
+static void accesslist_publish( ot_accesslist *accesslist ) {
+  ot_accesslist *accesslist_old = g_accesslist;
+
+  accesslist->replaced = 0;
+  accesslist->next     = accesslist_old;
+  if( accesslist_old )
+    accesslist_old->replaced = g_now_seconds;
+  __atomic_store_n( &g_accesslist, accesslist, __ATOMIC_RELEASE );
+}
+
+/* Returns the position of hash in list[lo..hi[ or -1 */
+static inline ssize_t accesslist_find( const ot_hash *list, size_t lo, size_t hi, const ot_hash hash ) {
+  while( lo < hi ) {
+    size_t mid = lo + ( hi - lo ) / 2;
+    int    cmp = memcmp( hash, list[mid], OT_HASH_COMPARE_SIZE );
+    if( !cmp )
+      return mid;
+    if( cmp < 0 )
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return -1;
+}
+
+static int accesslist_inlist( const ot_accesslist *accesslist, const ot_hash hash ) {
+  uint32_t prefix = accesslist_prefix( hash, accesslist->index_bits );
+  return accesslist_find( accesslist->list, accesslist->index[prefix], accesslist->index[prefix+1], hash ) >= 0;
+}
+
+/* Whether hash is on the list, updates included */
+static int accesslist_listed( const ot_accesslist *accesslist, const ot_hash hash ) {
+  if( accesslist->added_size && accesslist_find( accesslist->added, 0, accesslist->added_size, hash ) >= 0 )
+    return 1;
+  if( accesslist->removed_size && accesslist_find( accesslist->removed, 0, accesslist->removed_size, hash ) >= 0 )
+    return 0;
+  return accesslist_inlist( accesslist, hash );
+}
+
+/* Points each slot of a fresh index to the start of its range in the
+   sorted list */
+static uint32_t *accesslist_make_index( const ot_hash *list, size_t count, unsigned int *index_bits ) {
+  unsigned int bits = OT_ACCESSLIST_INDEX_BITS_MIN;
+  uint32_t    *index;
+  size_t       i, slot = 0;
+
+  while( bits < OT_ACCESSLIST_INDEX_BITS_MAX && ( (size_t)1 << bits ) < count )
+    ++bits;
+  if( count > UINT32_MAX || !( index = malloc( ( ( (size_t)1 << bits ) + 1 ) * sizeof( uint32_t ) ) ) )
+    return NULL;
+  for( i = 0; i < count; ++i )
+    while( slot <= accesslist_prefix( list[i], bits ) )
+      index[slot++] = i;
+  while( slot <= ( (size_t)1 << bits ) )
+    index[slot++] = count;
+  *index_bits = bits;
+  return index;
+}
+
+#ifdef __SSE2__
+/* Decodes 16 hex digits into 8 bytes, returns 0 if any of them is none */
+static inline int accesslist_fromhex16( const char *hex, uint8_t *out ) {
+  const __m128i in    = _mm_loadu_si128( (const __m128i *)hex );
+  const __m128i lower = _mm_or_si128( in, _mm_set1_epi8( 0x20 ) );
+  const __m128i digit = _mm_and_si128( _mm_cmpgt_epi8( in, _mm_set1_epi8( '0' - 1 ) ), _mm_cmplt_epi8( in, _mm_set1_epi8( '9' + 1 ) ) );
+  const __m128i alpha = _mm_and_si128( _mm_cmpgt_epi8( lower, _mm_set1_epi8( 'a' - 1 ) ), _mm_cmplt_epi8( lower, _mm_set1_epi8( 'f' + 1 ) ) );
+  __m128i nibbles, bytes;
+
+  if( _mm_movemask_epi8( _mm_or_si128( digit, alpha ) ) != 0xffff )
+    return 0;
+
+  nibbles = _mm_or_si128( _mm_and_si128( digit, _mm_sub_epi8( in, _mm_set1_epi8( '0' ) ) ),
+                          _mm_and_si128( alpha, _mm_sub_epi8( lower, _mm_set1_epi8( 'a' - 10 ) ) ) );
+  /* Every 16 bit lane holds the high nibble in its low byte */
+  bytes = _mm_or_si128( _mm_slli_epi16( _mm_and_si128( nibbles, _mm_set1_epi16( 0x00ff ) ), 4 ), _mm_srli_epi16( nibbles, 8 ) );
+  _mm_storel_epi64( (__m128i *)out, _mm_packus_epi16( bytes, bytes ) );
+  return 1;
+}
+#endif
+
+/* Decodes the 40 hex digits at hex, returns 0 if any of them is none */
+static int accesslist_fromhex( const char *hex, ot_hash *hash ) {
+#ifdef __SSE2__
+  /* The last 16 digits overlap the middle ones, never read beyond hex[39] */
+  return accesslist_fromhex16( hex, *hash ) && accesslist_fromhex16( hex + 16, *hash + 8 ) && accesslist_fromhex16( hex + 24, *hash + 12 );
+#else
+  int i;
+  for( i=0; i<(int)sizeof(ot_hash); ++i ) {
+    int eger1 = scan_fromhex( hex[ 2*i ] );
+    int eger2 = scan_fromhex( hex[ 1 + 2*i ] );
+    if( eger1 < 0 || eger2 < 0 )
+      return 0;
+    (*hash)[i] = eger1 * 16 + eger2;
+  }
+  return 1;
+#endif
+}
+
+/* Finds the next line starting with an info_hash. We do ignore anything that
+   is not of the form "^[:xdigit:]{40}[^:xdigit:].*" */
+static int accesslist_nexthash( const char **read_offs, const char *map_end, ot_hash *hash ) {
+  while( *read_offs <= map_end ) {
+    const char *line = *read_offs;
+    int found = 0;
+
+    if( accesslist_fromhex( line, hash ) ) {
+      line += 40;
+      found = line == map_end || scan_fromhex( *line ) < 0;
+    }
+
+    /* Find start of next line */
+    while( line <= map_end && *(line++) != '\n' );
+    *read_offs = line;
+    if( found )
+      return 1;
+  }
+  return 0;
 }
 
 /* Read initial access list */
 static void accesslist_readfile( void ) {
-  ot_hash *info_hash, *accesslist_new = NULL;
-  char    *map, *map_end, *read_offs;
-  size_t   maplen;
+  ot_hash       *accesslist_new = NULL, *decoded, info_hash;
+  ot_accesslist *accesslist;
+  const char    *map, *map_end, *read_offs;
+  size_t         maplen, count = 0, i, slots;
+  uint32_t      *index = NULL, offset;
+  unsigned int   index_bits = OT_ACCESSLIST_INDEX_BITS_MIN;
+  unsigned long long start = accesslist_nsec();
 
   if( ( map = mmap_read( g_accesslist_filename, &maplen ) ) == NULL ) {
     char *wd = getcwd( NULL, 0 );
@@ -48,69 +235,258 @@ static void accesslist_readfile( void ) {
 
   /* You need at least 41 bytes to pass an info_hash, make enough room
      for the maximum amount of them */
-  info_hash = accesslist_new = malloc( ( maplen / 41 ) * 20 );
-  if( !accesslist_new ) {
-    fprintf( stderr, "Warning: Not enough memory to allocate %zd bytes for accesslist buffer. May succeed later.\n", ( maplen / 41 ) * 20 );
+  if( !( decoded = malloc( ( maplen / 41 + 1 ) * sizeof( ot_hash ) ) ) ) {
+    fprintf( stderr, "Warning: Not enough memory to allocate %zd bytes for accesslist buffer. May succeed later.\n", ( maplen / 41 + 1 ) * sizeof( ot_hash ) );
+    mmap_unmap( map, maplen );
     return;
   }
 
-  /* No use to scan if there's not enough room for another full info_hash */
+  /* No use to scan if there's not enough room for another full info_hash.
+     The file is decoded only once, it may change under the shared map */
   map_end = map + maplen - 40;
-  read_offs = map;
-
-  /* We do ignore anything that is not of the form "^[:xdigit:]{40}[^:xdigit:].*" */
-  while( read_offs <= map_end ) {
-    int i;
-    for( i=0; i<(int)sizeof(ot_hash); ++i ) {
-      int eger1 = scan_fromhex( read_offs[ 2*i ] );
-      int eger2 = scan_fromhex( read_offs[ 1 + 2*i ] );
-      if( eger1 < 0 || eger2 < 0 )
-        break;
-      (*info_hash)[i] = eger1 * 16 + eger2;
-    }
+  if( maplen >= 40 )
+    for( read_offs = map; count <= maplen / 41 && accesslist_nexthash( &read_offs, map_end, decoded + count ); ++count );
+  mmap_unmap( map, maplen );
+
+  while( index_bits < OT_ACCESSLIST_INDEX_BITS_MAX && ( (size_t)1 << index_bits ) < count )
+    ++index_bits;
+  slots = (size_t)1 << index_bits;
+
+  accesslist     = calloc( 1, sizeof( ot_accesslist ) );
+  index          = calloc( slots + 1, sizeof( uint32_t ) );
+  accesslist_new = malloc( ( count ? count : 1 ) * sizeof( ot_hash ) );
+  if( !accesslist || !index || !accesslist_new || count > UINT32_MAX ) {
+    fprintf( stderr, "Warning: Not enough memory to allocate %zd bytes for accesslist buffer. May succeed later.\n", count * sizeof( ot_hash ) );
+    free( accesslist_new );
+    free( index );
+    free( accesslist );
+    free( decoded );
+    return;
+  }
 
-    if( i == sizeof(ot_hash) ) {
-      read_offs += 40;
+  /* Count hashes per prefix, their running sum makes each slot point past
+     its own range ... */
+  for( i = 0; i < count; ++i )
+    ++index[ accesslist_prefix( decoded[i], index_bits ) ];
+  for( offset = 0, i = 0; i < slots; ++i )
+    index[i] = offset += index[i];
+  index[slots] = offset;
+
+  /* ... and move them back to the start of their ranges while storing
+     each hash in its slot */
+  for( i = 0; i < count; ++i )
+    memcpy( accesslist_new + --index[ accesslist_prefix( decoded[i], index_bits ) ], decoded[i], sizeof( ot_hash ) );
+  free( decoded );
+#ifdef _DEBUG
+  fprintf( stderr, "Added %zd info_hashes to accesslist\n", count );
+#endif
 
-      /* Append accesslist to accesslist vector */
-      if( read_offs == map_end || scan_fromhex( *read_offs ) < 0 )
-        ++info_hash;
+  /* Ranges hold about one hash each, insertion sort is all they need */
+  for( i = 0; i < slots; ++i ) {
+    size_t j, k;
+    for( j = index[i] + 1; j < index[i+1]; ++j ) {
+      memcpy( info_hash, accesslist_new[j], sizeof( ot_hash ) );
+      for( k = j; k > index[i] && memcmp( accesslist_new[k-1], info_hash, OT_HASH_COMPARE_SIZE ) > 0; --k )
+        memcpy( accesslist_new[k], accesslist_new[k-1], sizeof( ot_hash ) );
+      memcpy( accesslist_new[k], info_hash, sizeof( ot_hash ) );
     }
+  }
 
-    /* Find start of next line */
-    while( read_offs <= map_end && *(read_offs++) != '\n' );
+  /* The file is authoritative, updates made since the last load are gone */
+  accesslist->list       = accesslist_new;
+  accesslist->size       = count;
+  accesslist->index      = index;
+  accesslist->index_bits = index_bits;
+  accesslist->base_owner = 1;
+  accesslist->load_usec  = ( accesslist_nsec() - start ) / 1000;
+  pthread_mutex_lock( &g_accesslist_update_mutex );
+  accesslist_publish( accesslist );
+  pthread_mutex_unlock( &g_accesslist_update_mutex );
+}
+
+/* Inserts hash into or deletes it from a sorted set with room for one more */
+static void accesslist_set_change( ot_hash *set, size_t *size, const ot_hash hash, int insert ) {
+  size_t lo = 0, hi = *size;
+  while( lo < hi ) {
+    size_t mid = lo + ( hi - lo ) / 2;
+    if( memcmp( hash, set[mid], OT_HASH_COMPARE_SIZE ) > 0 )
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-#ifdef _DEBUG
-  fprintf( stderr, "Added %zd info_hashes to accesslist\n", (size_t)(info_hash - accesslist_new) );
-#endif
+  if( lo < *size && !memcmp( hash, set[lo], OT_HASH_COMPARE_SIZE ) ) {
+    if( !insert )
+      memmove( set + lo, set + lo + 1, ( --*size - lo ) * sizeof( ot_hash ) );
+  } else if( insert ) {
+    memmove( set + lo + 1, set + lo, ( *size - lo ) * sizeof( ot_hash ) );
+    memcpy( set[lo], hash, sizeof( ot_hash ) );
+    ++*size;
+  }
+}
 
-  mmap_unmap( map, maplen);
+ssize_t accesslist_update( const ot_hash *hashes, const uint8_t *remove, size_t count, size_t *removed ) {
+  ot_accesslist *accesslist, *accesslist_old;
+  size_t         i;
+  ssize_t        changed = 0;
 
-  qsort( accesslist_new, info_hash - accesslist_new, sizeof( *info_hash ), vector_compare_hash );
+  *removed = 0;
 
-  /* Now exchange the accesslist vector in the least race condition prone way */
-  pthread_mutex_lock(&g_accesslist_mutex);
-  free( g_accesslist );
-  g_accesslist      = accesslist_new;
-  g_accesslist_size = info_hash - accesslist_new;
-  pthread_mutex_unlock(&g_accesslist_mutex);
+  if( !( accesslist = calloc( 1, sizeof( ot_accesslist ) ) ) )
+    return -1;
+
+  pthread_mutex_lock( &g_accesslist_update_mutex );
+  accesslist_old = g_accesslist;
+
+  /* Without a file loaded so far, updates go on top of an empty list */
+  if( accesslist_old ) {
+    accesslist->list       = accesslist_old->list;
+    accesslist->size       = accesslist_old->size;
+    accesslist->index      = accesslist_old->index;
+    accesslist->index_bits = accesslist_old->index_bits;
+    accesslist->load_usec  = accesslist_old->load_usec;
+  } else
+    accesslist->index = accesslist_make_index( NULL, 0, &accesslist->index_bits );
+
+  accesslist->added   = malloc( ( ( accesslist_old ? accesslist_old->added_size   : 0 ) + count ) * sizeof( ot_hash ) + 1 );
+  accesslist->removed = malloc( ( ( accesslist_old ? accesslist_old->removed_size : 0 ) + count ) * sizeof( ot_hash ) + 1 );
+  if( !accesslist->index || !accesslist->added || !accesslist->removed ) {
+    pthread_mutex_unlock( &g_accesslist_update_mutex );
+    if( !accesslist_old )
+      free( accesslist->index );
+    free( accesslist->added );
+    free( accesslist->removed );
+    free( accesslist );
+    return -1;
+  }
+  if( accesslist_old ) {
+    accesslist->added_size   = accesslist_old->added_size;
+    accesslist->removed_size = accesslist_old->removed_size;
+    /* Loaded and merged lists have no delta sets allocated */
+    if( accesslist->added_size )
+      memcpy( accesslist->added,   accesslist_old->added,   accesslist->added_size   * sizeof( ot_hash ) );
+    if( accesslist->removed_size )
+      memcpy( accesslist->removed, accesslist_old->removed, accesslist->removed_size * sizeof( ot_hash ) );
+  }
+
+  /* A hash is in the added set only if the list lacks it and in the
+     removed set only if the list has it */
+  for( i = 0; i < count; ++i ) {
+    int inlist = accesslist_inlist( accesslist, hashes[i] );
+
+    /* Only count hashes that were not already where they are meant to be */
+    if( accesslist_listed( accesslist, hashes[i] ) == !remove[i] )
+      continue;
+    ++changed;
+    *removed += remove[i];
+    accesslist_set_change( accesslist->added,   &accesslist->added_size,   hashes[i], !remove[i] && !inlist );
+    accesslist_set_change( accesslist->removed, &accesslist->removed_size, hashes[i],  remove[i] &&  inlist );
+  }
+
+  accesslist->base_owner = 1;
+  if( accesslist_old )
+    accesslist_old->base_owner = 0;
+  accesslist_publish( accesslist );
+  pthread_mutex_unlock( &g_accesslist_update_mutex );
+  return changed;
+}
+
+/* Merges the added and removed sets of accesslist into a new list */
+static ot_accesslist *accesslist_merge( const ot_accesslist *accesslist ) {
+  ot_accesslist *merged = calloc( 1, sizeof( ot_accesslist ) );
+  size_t         i = 0, j = 0, k = 0, count = 0;
+
+  if( !merged || !( merged->list = malloc( ( accesslist->size + accesslist->added_size ) * sizeof( ot_hash ) + 1 ) ) ) {
+    free( merged );
+    return NULL;
+  }
+
+  /* All three are sorted, added and list share no hash */
+  while( i < accesslist->size || j < accesslist->added_size ) {
+    if( j == accesslist->added_size || ( i < accesslist->size && memcmp( accesslist->list[i], accesslist->added[j], OT_HASH_COMPARE_SIZE ) < 0 ) ) {
+      while( k < accesslist->removed_size && memcmp( accesslist->removed[k], accesslist->list[i], OT_HASH_COMPARE_SIZE ) < 0 )
+        ++k;
+      if( k == accesslist->removed_size || memcmp( accesslist->removed[k], accesslist->list[i], OT_HASH_COMPARE_SIZE ) )
+        memcpy( merged->list[count++], accesslist->list[i], sizeof( ot_hash ) );
+      ++i;
+    } else
+      memcpy( merged->list[count++], accesslist->added[j++], sizeof( ot_hash ) );
+  }
+
+  if( !( merged->index = accesslist_make_index( merged->list, count, &merged->index_bits ) ) ) {
+    free( merged->list );
+    free( merged );
+    return NULL;
+  }
+  merged->size       = count;
+  merged->base_owner = 1;
+  merged->load_usec  = accesslist->load_usec;
+  return merged;
 }
 
 int accesslist_hashisvalid( ot_hash hash ) {
-  void *exactmatch;
+  const ot_accesslist *accesslist = __atomic_load_n( &g_accesslist, __ATOMIC_ACQUIRE );
+  unsigned long long   start = 0;
+  int                  exactmatch = 0;
+
+  if( !( ++accesslist_lookups % OT_ACCESSLIST_SAMPLE ) )
+    start = accesslist_nsec();
 
-  /* Lock should hardly ever be contended */
-  pthread_mutex_lock(&g_accesslist_mutex);
-  exactmatch = bsearch( hash, g_accesslist, g_accesslist_size, OT_HASH_COMPARE_SIZE, vector_compare_hash );
-  pthread_mutex_unlock(&g_accesslist_mutex);
+  if( accesslist )
+    exactmatch = accesslist_listed( accesslist, hash );
+
+  if( start ) {
+    __sync_fetch_and_add( &accesslist_sampled_nsec, accesslist_nsec() - start );
+    __sync_fetch_and_add( &accesslist_sampled, 1 );
+  }
 
 #ifdef WANT_ACCESSLIST_BLACK
-  return exactmatch == NULL;
+  return !exactmatch;
 #else
-  return exactmatch != NULL;
+  return exactmatch;
 #endif
 }
 
+size_t accesslist_stats( char *reply ) {
+  const ot_accesslist *accesslist = __atomic_load_n( &g_accesslist, __ATOMIC_ACQUIRE );
+  unsigned long long   sampled = accesslist_sampled, average = sampled ? accesslist_sampled_nsec / sampled : 0;
+
+  if( !accesslist )
+    return sprintf( reply, "No accesslist loaded so far.\n" );
+  return sprintf( reply, "Accesslist holds %zd info_hashes indexed by their first %u bits, loading took %llu usec.\n"
+                         "Updates added %zd and removed %zd info_hashes since.\n"
+                         "Lookups took %llu nsec on average over %llu sampled.\n",
+                  accesslist->size, accesslist->index_bits, accesslist->load_usec,
+                  accesslist->added_size, accesslist->removed_size, average, sampled );
+}
+
+/* Readers hold on to a list only for one lookup, so lists replaced more
+   than OT_ACCESSLIST_GRACE seconds ago are free to go */
+void accesslist_cleanup( void ) {
+  ot_accesslist *accesslist = __atomic_load_n( &g_accesslist, __ATOMIC_ACQUIRE ), *merged, *next;
+
+  if( !accesslist )
+    return;
+
+  /* Merging large lists takes a while, updates must not wait for it. If
+     one came in meanwhile, the next cycle tries again */
+  if( ( accesslist->added_size || accesslist->removed_size ) && ( merged = accesslist_merge( accesslist ) ) ) {
+    pthread_mutex_lock( &g_accesslist_update_mutex );
+    if( g_accesslist == accesslist ) {
+      accesslist_publish( merged );
+      accesslist = merged;
+    } else
+      accesslist_free( merged );
+    pthread_mutex_unlock( &g_accesslist_update_mutex );
+  }
+  while( ( next = accesslist->next ) ) {
+    if( next->replaced + OT_ACCESSLIST_GRACE < g_now_seconds ) {
+      accesslist->next = next->next;
+      accesslist_free( next );
+    } else
+      accesslist = next;
+  }
+}
+
 static void * accesslist_worker( void * args ) {
   int sig;
   sigset_t   signal_mask;
@@ -133,16 +509,18 @@ static void * accesslist_worker( void * args ) {
 
 static pthread_t thread_id;
 void accesslist_init( ) {
-  pthread_mutex_init(&g_accesslist_mutex, NULL);
   pthread_create( &thread_id, NULL, accesslist_worker, NULL );
 }
 
 void accesslist_deinit( void ) {
+  ot_accesslist *accesslist = g_accesslist;
   pthread_cancel( thread_id );
-  pthread_mutex_destroy(&g_accesslist_mutex);
-  free( g_accesslist );
-  g_accesslist = 0;
-  g_accesslist_size = 0;
+  __atomic_store_n( &g_accesslist, NULL, __ATOMIC_RELEASE );
+  while( accesslist ) {
+    ot_accesslist *next = accesslist->next;
+    accesslist_free( accesslist );
+    accesslist = next;
+  }
 }
 #endif
 
@@ -150,7 +528,7 @@ int address_in_net( const ot_ip6 address, const ot_net *net ) {
   int bits = net->bits;
   int result = memcmp( address, &net->address, bits >> 3 );
   if( !result && ( bits & 7 ) )
-    result = ( ( 0x7f00 >> ( bits & 7 ) ) & address[bits>>3] ) - net->address[bits>>3];
+    result = ( 0xff00 >> ( bits & 7 ) ) & ( (uint8_t)address[bits>>3] ^ (uint8_t)net->address[bits>>3] );
   return result == 0;
 }
 
@@ -174,7 +552,8 @@ void *set_value_for_net( const ot_net *net, ot_vector *vector, const void *value
   member = vector_find_or_insert( vector, (void*)net, member_size, sizeof(ot_net), &exactmatch );
   if( member ) {
     memcpy( member, net, sizeof(ot_net));
-    memcpy( member + sizeof(ot_net), value, member_size - sizeof(ot_net));
+    if( member_size > sizeof(ot_net) )
+      memcpy( member + sizeof(ot_net), value, member_size - sizeof(ot_net));
   }
 
   return member;
@@ -224,18 +603,175 @@ int loglist_check_address( const ot_ip6 address ) {
 }
 #endif
 
+/* Blessed ips and proxies are looked up in immutable prefix tries, one
+   nibble of the address per level. A net covers the slots of all
+   addresses it contains in the node of its last nibble, a lookup walks
+   at most 32 levels and returns the value of the longest covering net.
+   Nets are inserted shortest first, each also carrying the values of all
+   nets covering it, so with overlapping nets that value is the union */
+typedef struct {
+  uint32_t child[16];
+  uint32_t value[16];
+} ot_nettrie;
+
+typedef struct {
+  ot_net   net;
+  uint32_t value;
+} ot_nettrie_entry;
+
+static inline int nettrie_nibble( const ot_ip6 address, int level ) {
+  uint8_t byte = address[level>>1];
+  return level & 1 ? byte & 15 : byte >> 4;
+}
+
+static int nettrie_compare_bits( const void *entry1, const void *entry2 ) {
+  return ((const ot_nettrie_entry*)entry1)->net.bits - ((const ot_nettrie_entry*)entry2)->net.bits;
+}
+
+static ot_nettrie *nettrie_build( const ot_nettrie_entry *entries, size_t count ) {
+  ot_nettrie_entry *sorted = malloc( count * sizeof(ot_nettrie_entry) + 1 );
+  ot_nettrie       *trie = calloc( 1, sizeof(ot_nettrie) );
+  size_t            i, nodes = 1, space = 1;
+
+  if( !sorted || !trie ) {
+    free( sorted );
+    free( trie );
+    return NULL;
+  }
+  memcpy( sorted, entries, count * sizeof(ot_nettrie_entry) );
+  qsort( sorted, count, sizeof(ot_nettrie_entry), nettrie_compare_bits );
+
+  for( i=0; i<count; ++i ) {
+    const ot_net *net = &sorted[i].net;
+    int           level, last = net->bits > 4 ? ( net->bits - 1 ) / 4 : 0;
+    int           slot, slots = 1 << ( 4 * ( last + 1 ) - net->bits );
+    uint32_t      node = 0, inherited = 0;
+
+    /* Walk down to the node holding the net's last nibble */
+    for( level=0; level<last; ++level ) {
+      int nibble = nettrie_nibble( net->address, level );
+      if( trie[node].value[nibble] )
+        inherited = trie[node].value[nibble];
+      if( !trie[node].child[nibble] ) {
+        if( nodes == space ) {
+          ot_nettrie *new_trie = realloc( trie, 2 * space * sizeof(ot_nettrie) );
+          if( !new_trie ) {
+            free( sorted );
+            free( trie );
+            return NULL;
+          }
+          trie   = new_trie;
+          space *= 2;
+        }
+        byte_zero( trie + nodes, sizeof(ot_nettrie) );
+        trie[node].child[nibble] = nodes++;
+      }
+      node = trie[node].child[nibble];
+    }
+
+    for( slot = nettrie_nibble( net->address, last ) & ~( slots - 1 ); slots--; ++slot )
+      trie[node].value[slot] = ( trie[node].value[slot] ? trie[node].value[slot] : inherited ) | sorted[i].value;
+  }
+
+  free( sorted );
+  return trie;
+}
+
+static uint32_t nettrie_lookup( const ot_nettrie *trie, const ot_ip6 address ) {
+  uint32_t node = 0, value = 0;
+  int      level;
+
+  for( level=0; level<32; ++level ) {
+    int nibble = nettrie_nibble( address, level );
+    if( trie[node].value[nibble] )
+      value = trie[node].value[nibble];
+    if( !( node = trie[node].child[nibble] ) )
+      break;
+  }
+  return value;
+}
+
+/* Blessing only happens while the config is parsed, before any other
+   thread looks up addresses, replaced tries can be freed right away.
+   The release store pairs with the acquire load of readers */
+static void nettrie_publish( ot_nettrie **head, ot_nettrie *trie ) {
+  ot_nettrie *old = *head;
+  __atomic_store_n( head, trie, __ATOMIC_RELEASE );
+  free( old );
+}
+
 #ifdef WANT_IP_FROM_PROXY
 typedef struct {
-  ot_net    *proxy;
+  ot_net     proxy;
   ot_vector  networks;
 } ot_proxymap;
 
+/* Proxies map to 1 + their offset in networks */
+typedef struct {
+  ot_nettrie  *proxies;
+  size_t       count;
+  ot_nettrie  *networks[];
+} ot_proxytrie;
+
 static ot_vector g_proxies_list;
 static pthread_mutex_t g_proxies_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ot_proxytrie *g_proxies_trie;
+
+static void proxytrie_free( ot_proxytrie *proxytrie ) {
+  size_t i;
+  if( !proxytrie )
+    return;
+  for( i=0; i<proxytrie->count; ++i )
+    free( proxytrie->networks[i] );
+  free( proxytrie->proxies );
+  free( proxytrie );
+}
+
+static ot_proxytrie *proxytrie_build( void ) {
+  ot_proxymap      *map = (ot_proxymap*)g_proxies_list.data;
+  ot_proxytrie     *proxytrie = calloc( 1, sizeof(ot_proxytrie) + g_proxies_list.size * sizeof(ot_nettrie*) );
+  ot_nettrie_entry *entries = malloc( g_proxies_list.size * sizeof(ot_nettrie_entry) + 1 );
+  size_t            i, j;
+
+  if( !proxytrie || !entries ) {
+    free( proxytrie );
+    free( entries );
+    return NULL;
+  }
+
+  for( i=0; i<g_proxies_list.size; ++i ) {
+    ot_nettrie_entry *networks = malloc( map[i].networks.size * sizeof(ot_nettrie_entry) + 1 );
+    if( networks ) {
+      for( j=0; j<map[i].networks.size; ++j ) {
+        networks[j].net   = ((ot_net*)map[i].networks.data)[j];
+        networks[j].value = 1;
+      }
+      proxytrie->networks[i] = nettrie_build( networks, map[i].networks.size );
+      free( networks );
+    }
+    proxytrie->count = i + 1;
+    if( !proxytrie->networks[i] ) {
+      free( entries );
+      proxytrie_free( proxytrie );
+      return NULL;
+    }
+    entries[i].net   = map[i].proxy;
+    entries[i].value = i + 1;
+  }
+
+  proxytrie->proxies = nettrie_build( entries, g_proxies_list.size );
+  free( entries );
+  if( !proxytrie->proxies ) {
+    proxytrie_free( proxytrie );
+    return NULL;
+  }
+  return proxytrie;
+}
 
 int proxylist_add_network( const ot_net *proxy, const ot_net *net ) {
-  ot_proxymap *map;
-  int exactmatch, result = 1;
+  ot_proxymap  *map;
+  ot_proxytrie *proxytrie = NULL, *old;
+  int exactmatch, result = 0;
   pthread_mutex_lock(&g_proxies_list_mutex);
 
   /* If we have a direct hit, use and extend the vector there */
@@ -243,56 +779,68 @@ int proxylist_add_network( const ot_net *proxy, const ot_net *net ) {
 
   if( !map || !exactmatch ) {
     /* else see, if we've got overlapping networks
-       and get a new empty vector if not */
-    ot_vector empty;
-    memset( &empty, 0, sizeof( ot_vector ) );
-    map = set_value_for_net( proxy, &g_proxies_list, &empty, sizeof(ot_proxymap));
+       and get a new empty vector if not. The value starts right behind
+       the ot_net, padding included */
+    ot_proxymap empty;
+    memset( &empty, 0, sizeof( ot_proxymap ) );
+    map = set_value_for_net( proxy, &g_proxies_list, (uint8_t*)&empty + sizeof(ot_net), sizeof(ot_proxymap));
   }
 
-  if( map && set_value_for_net( net, &map->networks, NULL, sizeof(ot_net) ) )
-       result = 1;
+  if( map && set_value_for_net( net, &map->networks, NULL, sizeof(ot_net) ) && ( proxytrie = proxytrie_build( ) ) ) {
+    old = g_proxies_trie;
+    __atomic_store_n( &g_proxies_trie, proxytrie, __ATOMIC_RELEASE );
+    proxytrie_free( old );
+    result = 1;
+  }
 
   pthread_mutex_unlock(&g_proxies_list_mutex);
   return result;
 }
 
 int proxylist_check_proxy( const ot_ip6 proxy, const ot_ip6 address ) {
-  int result = 0;
-  ot_proxymap *map;
-
-  pthread_mutex_lock(&g_proxies_list_mutex);
-
-  if( ( map = get_value_for_net( proxy, &g_proxies_list, sizeof(ot_proxymap) ) ) )
-    if( !address || get_value_for_net( address, &map->networks, sizeof(ot_net) ) ) 
-      result = 1;
+  const ot_proxytrie *proxytrie = __atomic_load_n( &g_proxies_trie, __ATOMIC_ACQUIRE );
+  uint32_t            offset;
 
-  pthread_mutex_unlock(&g_proxies_list_mutex);
-  return result;
+  if( !proxytrie || !( offset = nettrie_lookup( proxytrie->proxies, proxy ) ) )
+    return 0;
+  return !address || nettrie_lookup( proxytrie->networks[offset-1], address );
 }
 
 #endif
 
-static ot_ip6         g_adminip_addresses[OT_ADMINIP_MAX];
-static ot_permissions g_adminip_permissions[OT_ADMINIP_MAX];
-static unsigned int   g_adminip_count = 0;
+static ot_nettrie_entry         *g_adminip_entries;
+static size_t                    g_adminip_count;
+static ot_nettrie               *g_adminip_trie;
 
-int accesslist_blessip( ot_ip6 ip, ot_permissions permissions ) {
-  if( g_adminip_count >= OT_ADMINIP_MAX )
+int accesslist_blessnet( const ot_net *net, ot_permissions permissions ) {
+  ot_nettrie_entry *entries;
+  ot_nettrie       *trie;
+
+  if( net->bits < 0 || net->bits > 128 )
+    return -1;
+  if( !( entries = realloc( g_adminip_entries, ( g_adminip_count + 1 ) * sizeof(ot_nettrie_entry) ) ) )
     return -1;
+  g_adminip_entries = entries;
+  g_adminip_entries[g_adminip_count].net   = *net;
+  g_adminip_entries[g_adminip_count].value = permissions;
 
-  memcpy(g_adminip_addresses + g_adminip_count,ip,sizeof(ot_ip6));
-  g_adminip_permissions[ g_adminip_count++ ] = permissions;
+  if( !( trie = nettrie_build( g_adminip_entries, g_adminip_count + 1 ) ) )
+    return -1;
+  ++g_adminip_count;
+  nettrie_publish( &g_adminip_trie, trie );
 
 #ifdef _DEBUG
   {
     char _debug[512];
     int off = snprintf( _debug, sizeof(_debug), "Blessing ip address " );
-    off += fmt_ip6c(_debug+off, ip );
+    off += fmt_ip6c(_debug+off, net->address );
+    off += snprintf( _debug+off, 512-off, "/%d", net->bits );
 
     if( permissions & OT_PERMISSION_MAY_STAT       ) off += snprintf( _debug+off, 512-off, " may_fetch_stats" );
     if( permissions & OT_PERMISSION_MAY_LIVESYNC   ) off += snprintf( _debug+off, 512-off, " may_sync_live" );
     if( permissions & OT_PERMISSION_MAY_FULLSCRAPE ) off += snprintf( _debug+off, 512-off, " may_fetch_fullscrapes" );
     if( permissions & OT_PERMISSION_MAY_PROXY      ) off += snprintf( _debug+off, 512-off, " may_proxy" );
+    if( permissions & OT_PERMISSION_MAY_ACCESSLIST ) off += snprintf( _debug+off, 512-off, " may_update_accesslist" );
     if( !permissions ) off += snprintf( _debug+off, sizeof(_debug)-off, " nothing\n" );
     _debug[off++] = '.';
     write( 2, _debug, off );
@@ -302,12 +850,16 @@ int accesslist_blessip( ot_ip6 ip, ot_permissions permissions ) {
   return 0;
 }
 
+int accesslist_blessip( ot_ip6 ip, ot_permissions permissions ) {
+  ot_net net;
+  memcpy( net.address, ip, sizeof(ot_ip6) );
+  net.bits = 128;
+  return accesslist_blessnet( &net, permissions );
+}
+
 int accesslist_isblessed( ot_ip6 ip, ot_permissions permissions ) {
-  unsigned int i;
-  for( i=0; i<g_adminip_count; ++i )
-    if( !memcmp( g_adminip_addresses + i, ip, sizeof(ot_ip6)) && ( g_adminip_permissions[ i ] & permissions ) )
-      return 1;
-  return 0;
+  const ot_nettrie *trie = __atomic_load_n( &g_adminip_trie, __ATOMIC_ACQUIRE );
+  return trie && ( nettrie_lookup( trie, ip ) & permissions );
 }
 
 const char *g_version_accesslist_c = "$Source$: $Revision$\n";
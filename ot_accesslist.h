@@ -16,12 +16,42 @@ void accesslist_init( );
 void accesslist_deinit( );
 int  accesslist_hashisvalid( ot_hash hash );
 
+/* Seconds a replaced accesslist is kept for readers still looking at it */
+#define OT_ACCESSLIST_GRACE 60
+void accesslist_cleanup( void );
+
+/* The accesslist index addresses hashes by their leading bits, enough
+   bits for about one hash per slot, within these bounds */
+#define OT_ACCESSLIST_INDEX_BITS_MIN 8
+#define OT_ACCESSLIST_INDEX_BITS_MAX 24
+
+/* Every thread times one in this many lookups for the stats */
+#define OT_ACCESSLIST_SAMPLE 1024
+size_t accesslist_stats( char *reply );
+
+/* Adds hashes[i] to the accesslist or, if remove[i] is set, removes it,
+   until the file is loaded again. Returns how many hashes actually were
+   added or removed, removed receives how many of them were removed. -1 if
+   memory was short */
+ssize_t accesslist_update( const ot_hash *hashes, const uint8_t *remove, size_t count, size_t *removed );
+
+/* Blessed ips may update the accesslist under this path, with up to
+   OT_ACCESSLIST_UPDATE_MAX add and remove parameters per request */
+#ifdef WANT_ACCESSLIST_WHITE
+#define OT_ACCESSLIST_PATH "whitelist"
+#else
+#define OT_ACCESSLIST_PATH "blacklist"
+#endif
+#define OT_ACCESSLIST_UPDATE_MAX 64
+
 extern char *g_accesslist_filename;
 
 #else
 #define accesslist_init( accesslist_filename )
 #define accesslist_deinit( )
 #define accesslist_hashisvalid( hash ) 1
+#define accesslist_cleanup( )
+#define accesslist_stats( reply ) sprintf( reply, "Compiled without accesslist.\n" )
 #endif
 
 /* Test if an address is subset of an ot_net, return value is considered a bool */
@@ -47,7 +77,7 @@ void *get_value_for_net( const ot_ip6 address, const ot_vector *vector, const si
 
 #ifdef WANT_IP_FROM_PROXY
 int proxylist_add_network( const ot_net *proxy, const ot_net *net );
-int proxylist_check_network( const ot_ip6 *proxy, const ot_ip6 address /* can be NULL to only check proxy */ );
+int proxylist_check_proxy( const ot_ip6 proxy, const ot_ip6 address /* can be NULL to only check proxy */ );
 #endif
 
 #ifdef WANT_FULLLOG_NETWORKS
@@ -70,9 +100,13 @@ typedef enum {
   OT_PERMISSION_MAY_FULLSCRAPE = 0x1,
   OT_PERMISSION_MAY_STAT       = 0x2,
   OT_PERMISSION_MAY_LIVESYNC   = 0x4,
-  OT_PERMISSION_MAY_PROXY      = 0x8
+  OT_PERMISSION_MAY_PROXY      = 0x8,
+  OT_PERMISSION_MAY_ACCESSLIST = 0x10
 } ot_permissions;
 
+/* Grants permissions to all addresses in net, an address is granted the
+   permissions of all nets containing it */
+int  accesslist_blessnet( const ot_net *net, ot_permissions permissions );
 int  accesslist_blessip( ot_ip6 ip, ot_permissions permissions );
 int  accesslist_isblessed( ot_ip6 ip, ot_permissions permissions );
 
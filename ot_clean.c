@@ -7,8 +7,13 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Libowfat */
+#include "byte.h"
 #include "io.h"
 
 /* Opentracker */
@@ -17,40 +22,77 @@
 #include "ot_vector.h"
 #include "ot_clean.h"
 #include "ot_stats.h"
+#include "ot_accesslist.h"
 
-/* Returns amount of removed peers */
-static ssize_t clean_single_bucket( ot_peer *peers, size_t peer_count, time_t timedout, int *removed_seeders ) {
-  ot_peer *last_peer = peers + peer_count, *insert_point;
-  time_t timediff;
+/* Returns amount of removed peers, raises *oldest to the highest
+   surviving peer age */
+static ssize_t clean_single_bucket( ot_vector *vector, time_t timedout, int *removed_seeders, uint8_t *oldest ) {
+  uint8_t *flags = OT_VECTOR_PEER_FLAGS( vector );
+  uint8_t *times = OT_VECTOR_PEER_TIMES( vector );
+  size_t   peer_count = vector->size, peer = 0, insert_point;
+  time_t   timediff;
+  uint8_t  max_age = *oldest;
 
-  /* Two scan modes: unless there is one peer removed, just increase ot_peertime */
-  while( peers < last_peer ) {
-    if( ( timediff = timedout + OT_PEERTIME( peers ) ) >= OT_PEER_TIMEOUT )
+  /* Two scan modes: unless there is one peer removed, just increase peer times.
+     Ages are kept apart from addresses, so look at 16 of them at once */
+#ifdef __SSE2__
+  {
+    const __m128i delta = _mm_set1_epi8( (char)timedout );
+    const __m128i limit = _mm_set1_epi8( OT_PEER_TIMEOUT - 1 );
+    __m128i       ages  = _mm_setzero_si128();
+    uint8_t       lanes[16];
+    int           lane;
+    for( ; peer + 16 <= peer_count; peer += 16 ) {
+      __m128i aged = _mm_adds_epu8( _mm_loadu_si128( (__m128i*)( times + peer ) ), delta );
+      if( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_max_epu8( aged, limit ), limit ) ) != 0xffff )
+        break;
+      _mm_storeu_si128( (__m128i*)( times + peer ), aged );
+      ages = _mm_max_epu8( ages, aged );
+    }
+    _mm_storeu_si128( (__m128i*)lanes, ages );
+    for( lane = 0; lane < 16; ++lane )
+      if( lanes[lane] > max_age )
+        max_age = lanes[lane];
+  }
+#endif
+  for( ; peer < peer_count; ++peer ) {
+    if( ( timediff = timedout + times[peer] ) >= OT_PEER_TIMEOUT )
       break;
-    OT_PEERTIME( peers++ ) = timediff;
+    times[peer] = timediff;
+    if( timediff > max_age )
+      max_age = timediff;
   }
 
   /* If we at least remove one peer, we have to copy  */
-  insert_point = peers;
-  while( peers < last_peer )
-    if( ( timediff = timedout + OT_PEERTIME( peers ) ) < OT_PEER_TIMEOUT ) {
-      OT_PEERTIME( peers ) = timediff;
-      memcpy( insert_point++, peers++, sizeof(ot_peer));
+  for( insert_point = peer; peer < peer_count; ++peer )
+    if( ( timediff = timedout + times[peer] ) < OT_PEER_TIMEOUT ) {
+      memcpy( OT_VECTOR_PEER_ADDR( vector, insert_point ), OT_VECTOR_PEER_ADDR( vector, peer ), OT_PEER_COMPARE_SIZE );
+      flags[insert_point]   = flags[peer];
+      times[insert_point++] = timediff;
+      if( timediff > max_age )
+        max_age = timediff;
     } else
-      if( OT_PEERFLAG( peers++ ) & PEER_FLAG_SEEDING )
+      if( flags[peer] & PEER_FLAG_SEEDING )
         (*removed_seeders)++;
 
-  return peers - insert_point;
+  *oldest = max_age;
+  return peer_count - insert_point;
 }
 
 /* Clean a single torrent
    return 1 if torrent timed out
+   Afterwards peer_list->next_clean holds the minute in which the next peer
+   will time out, until then clean_worker can leave the torrent alone: peer
+   ages are relative to peer_list->base and age correctly whenever the
+   torrent is cleaned next, be it by the worker or by an announce.
 */
 int clean_single_torrent( ot_torrent *torrent ) {
   ot_peerlist *peer_list = torrent->peer_list;
   ot_vector *bucket_list = &peer_list->peers;
   time_t timedout = (time_t)( g_now_minutes - peer_list->base );
   int num_buckets = 1, removed_seeders = 0;
+  size_t peer_count = peer_list->peer_count;
+  uint8_t oldest = 0;
 
   /* No need to clean empty torrent */
   if( !timedout )
@@ -62,8 +104,12 @@ int clean_single_torrent( ot_torrent *torrent ) {
 
   /* Nothing to be cleaned here? Test if torrent is worth keeping */
   if( timedout > OT_PEER_TIMEOUT ) {
-    if( !peer_list->peer_count )
-      return peer_list->down_count ? 0 : 1;
+    if( !peer_list->peer_count ) {
+      if( !peer_list->down_count )
+        return 1;
+      peer_list->next_clean = peer_list->base + OT_TORRENT_TIMEOUT + 1;
+      return 0;
+    }
     timedout = OT_PEER_TIMEOUT;
   }
 
@@ -73,7 +119,7 @@ int clean_single_torrent( ot_torrent *torrent ) {
   }
 
   while( num_buckets-- ) {
-    size_t removed_peers = clean_single_bucket( bucket_list->data, bucket_list->size, timedout, &removed_seeders );
+    size_t removed_peers = clean_single_bucket( bucket_list, timedout, &removed_seeders, &oldest );
     peer_list->peer_count -= removed_peers;
     bucket_list->size     -= removed_peers;
     if( bucket_list->size < removed_peers )
@@ -82,58 +128,202 @@ int clean_single_torrent( ot_torrent *torrent ) {
   }
 
   peer_list->seed_count -= removed_seeders;
+  if( peer_list->peer_count != peer_count )
+    peer_list->changed = g_now_seconds;
 
   /* See, if we need to convert a torrent from simple vector to bucket list */
   if( ( peer_list->peer_count > OT_PEER_BUCKET_MINCOUNT ) || OT_PEERLIST_HASBUCKETS(peer_list) )
     vector_redistribute_buckets( peer_list );
 
-  if( peer_list->peer_count )
-    peer_list->base = g_now_minutes;
-  else {
+  if( peer_list->peer_count ) {
+    peer_list->base       = g_now_minutes;
+    peer_list->next_clean = g_now_minutes + OT_PEER_TIMEOUT - oldest;
+  } else {
     /* When we got here, the last time that torrent
      has been touched is OT_PEER_TIMEOUT Minutes before */
-    peer_list->base = g_now_minutes - OT_PEER_TIMEOUT;
+    peer_list->base       = g_now_minutes - OT_PEER_TIMEOUT;
+    peer_list->next_clean = g_now_minutes + 1;
   }
   return 0;
 
 }
 
-/* Clean up all peers in current bucket, remove timedout pools and
- torrents */
+unsigned int g_clean_threads  = 1;
+unsigned int g_clean_interval = OT_CLEAN_INTERVAL_MINUTES * 60;
+
+static pthread_t       clean_thread_ids[OT_CLEAN_THREADS_MAX];
+static unsigned int    clean_threads_running;
+
+/* Threads meet after each sweep over their stripes, so that the last one
+   to finish can report the whole cycle */
+static pthread_mutex_t clean_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  clean_cond  = PTHREAD_COND_INITIALIZER;
+static unsigned int    clean_finished;
+static unsigned int    clean_generation;
+static ot_clean_cycle  clean_sum;
+static unsigned long long clean_cycle_start;
+
+static unsigned long long clean_cpu_usec( void ) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if( !clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts ) )
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+  return 0;
+}
+
+static unsigned long long clean_wall_usec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Spread the time left until the deadline over the buckets left to clean,
+   that way slow buckets eat up their own pause. While requests stall on
+   bucket locks, the pause grows by up to OT_CLEAN_BACKOFF_MAX - 1 evenly
+   spread slices and the deadline moves by as much, so the cycle overruns
+   instead of leaving no pause for the buckets still to come */
+static unsigned long long clean_pause( unsigned long long *deadline, int buckets_left, unsigned long long slice, unsigned int backoff ) {
+  unsigned long long now = clean_wall_usec(), pause = 0, extra;
+  if( buckets_left <= 0 )
+    return 0;
+  if( now < *deadline )
+    pause = ( *deadline - now ) / buckets_left;
+  if( backoff > 1 ) {
+    extra      = ( backoff - 1 ) * slice;
+    *deadline += extra;
+    pause     += extra;
+  }
+  return pause;
+}
+
+static void clean_cycle_done( ot_clean_cycle *cycle ) {
+  unsigned int generation;
+
+  pthread_mutex_lock( &clean_mutex );
+  clean_sum.cpu_usec      += cycle->cpu_usec;
+  clean_sum.buckets       += cycle->buckets;
+  clean_sum.cleaned       += cycle->cleaned;
+  clean_sum.skipped       += cycle->skipped;
+  clean_sum.peers_removed += cycle->peers_removed;
+
+  if( ++clean_finished == clean_threads_running ) {
+    unsigned long long now = clean_wall_usec();
+    clean_sum.wall_usec = now - clean_cycle_start;
+    stats_issue_event( EVENT_CLEAN_CYCLE, 0, (uintptr_t)&clean_sum );
+    stats_cleanup();
+    accesslist_cleanup();
+    byte_zero( &clean_sum, sizeof(clean_sum) );
+    clean_cycle_start = now;
+    clean_finished    = 0;
+    ++clean_generation;
+    pthread_cond_broadcast( &clean_cond );
+  } else {
+    generation = clean_generation;
+    while( generation == clean_generation )
+      pthread_cond_wait( &clean_cond, &clean_mutex );
+  }
+  pthread_mutex_unlock( &clean_mutex );
+}
+
+/* Clean up all peers in the worker's stripe of buckets, remove timedout
+ pools and torrents. Torrents without peers about to time out are skipped */
 static void * clean_worker( void * args ) {
-  (void) args;
+  unsigned int stripe = (unsigned int)(uintptr_t)args;
+  int first_bucket = (int)( ( (uint64_t)OT_BUCKET_COUNT * stripe ) / clean_threads_running );
+  int last_bucket  = (int)( ( (uint64_t)OT_BUCKET_COUNT * ( stripe + 1 ) ) / clean_threads_running );
+  unsigned int backoff = 1;
+  unsigned long long slice = (unsigned long long)g_clean_interval * 1000000ULL / ( last_bucket - first_bucket );
+
+  /* Only count stalls of requests, not the ones we cause ourselves */
+  mutex_bucket_stalls_background( );
+
   while( 1 ) {
-    int bucket = OT_BUCKET_COUNT;
-    while( bucket-- ) {
+    int bucket = last_bucket;
+    ot_clean_cycle cycle;
+    unsigned long long cpu_start = clean_cpu_usec();
+    unsigned long long deadline  = clean_wall_usec() + (unsigned long long)g_clean_interval * 1000000ULL;
+    unsigned long      stalls    = mutex_get_stall_count();
+
+    byte_zero( &cycle, sizeof(cycle) );
+    while( bucket-- > first_bucket ) {
       ot_vector *torrents_list = mutex_bucket_lock( bucket );
       size_t     toffs;
       int        delta_torrentcount = 0;
+      unsigned long long pause;
 
-      for( toffs=0; toffs<torrents_list->size; ++toffs ) {
+      for( toffs=0; toffs<OT_TORRENT_SLOTS( torrents_list ); ++toffs ) {
         ot_torrent *torrent = ((ot_torrent*)(torrents_list->data)) + toffs;
+        size_t      peer_count;
+        if( !OT_TORRENT_SLOT_USED( torrent ) )
+          continue;
+        if( g_now_minutes < torrent->peer_list->next_clean ) {
+          ++cycle.skipped;
+          continue;
+        }
+        ++cycle.cleaned;
+        peer_count = torrent->peer_list->peer_count;
         if( clean_single_torrent( torrent ) ) {
+          cycle.peers_removed += peer_count;
           vector_remove_torrent( torrents_list, torrent );
           --delta_torrentcount;
           --toffs;
-        }
+        } else
+          cycle.peers_removed += peer_count - torrent->peer_list->peer_count;
       }
+      vector_fixup_torrents( torrents_list );
       mutex_bucket_unlock( bucket, delta_torrentcount );
+      ++cycle.buckets;
       if( !g_opentracker_running )
         return NULL;
-      usleep( OT_CLEAN_SLEEP );
+
+      /* Back off while requests queue up behind bucket locks, recover
+         slowly once they don't */
+      if( mutex_get_stall_count() != stalls ) {
+        stalls = mutex_get_stall_count();
+        if( backoff < OT_CLEAN_BACKOFF_MAX )
+          backoff *= 2;
+      } else if( backoff > 1 )
+        backoff /= 2;
+
+      pause = clean_pause( &deadline, bucket - first_bucket, slice, backoff );
+      for( ; pause >= 1000000ULL && g_opentracker_running; pause -= 1000000ULL )
+        sleep( 1 );
+      if( pause )
+        usleep( (useconds_t)pause );
     }
-    stats_cleanup();
+
+    /* Nothing left to do until the cycle's end */
+    while( clean_wall_usec() < deadline && g_opentracker_running )
+      sleep( 1 );
+
+    cycle.cpu_usec = clean_cpu_usec() - cpu_start;
+    clean_cycle_done( &cycle );
   }
   return NULL;
 }
 
-static pthread_t thread_id;
 void clean_init( void ) {
-  pthread_create( &thread_id, NULL, clean_worker, NULL );
+  unsigned int i;
+  if( !g_clean_threads )
+    g_clean_threads = 1;
+  if( g_clean_threads > OT_CLEAN_THREADS_MAX )
+    g_clean_threads = OT_CLEAN_THREADS_MAX;
+  if( g_clean_threads > (unsigned int)OT_BUCKET_COUNT )
+    g_clean_threads = OT_BUCKET_COUNT;
+  if( !g_clean_interval )
+    g_clean_interval = 1;
+
+  clean_threads_running = g_clean_threads;
+  clean_cycle_start     = clean_wall_usec();
+  for( i=0; i<clean_threads_running; ++i )
+    pthread_create( clean_thread_ids + i, NULL, clean_worker, (void*)(uintptr_t)i );
 }
 
 void clean_deinit( void ) {
-  pthread_cancel( thread_id );
+  unsigned int i;
+  for( i=0; i<clean_threads_running; ++i )
+    pthread_cancel( clean_thread_ids[i] );
 }
 
 const char *g_version_clean_c = "$Source$: $Revision$\n";
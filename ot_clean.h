@@ -6,11 +6,31 @@
 #ifndef __OT_CLEAN_H__
 #define __OT_CLEAN_H__
 
-/* The amount of time a clean cycle should take */
+/* The amount of time a clean cycle should take by default,
+   see tracker.clean_interval */
 #define OT_CLEAN_INTERVAL_MINUTES       2
 
-/* So after each bucket wait 1 / OT_BUCKET_COUNT intervals */
-#define OT_CLEAN_SLEEP ( ( ( OT_CLEAN_INTERVAL_MINUTES ) * 60 * 1000000 ) / ( OT_BUCKET_COUNT ) )
+/* Each cleaner thread sweeps its own stripe of buckets, see
+   tracker.clean_threads */
+#define OT_CLEAN_THREADS_MAX           16
+
+/* How many evenly spread slices of the clean interval a cleaner pauses
+   between buckets at most, while requests stall on bucket locks. The
+   cycle takes longer by the extra pauses */
+#define OT_CLEAN_BACKOFF_MAX            8
+
+extern unsigned int g_clean_threads;
+extern unsigned int g_clean_interval;
+
+/* What one sweep over all buckets did, reported as EVENT_CLEAN_CYCLE */
+typedef struct {
+  unsigned long long cpu_usec;
+  unsigned long long wall_usec;
+  unsigned long long buckets;
+  unsigned long long cleaned;
+  unsigned long long skipped;
+  unsigned long long peers_removed;
+} ot_clean_cycle;
 
 void clean_init( void );
 void clean_deinit( void );
@@ -0,0 +1,84 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdint.h>
+#include <string.h>
+
+/* Opentracker */
+#include "ot_format.h"
+
+static const char g_digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* First value with as many digits as the index, 0 stands in for 1 so
+   that 0 and 1 both come out as a single digit */
+static const uint64_t g_digit_thresholds[20] = {
+  0ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+  1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL };
+
+size_t format_u64_length( uint64_t value ) {
+  /* 1233/4096 approximates log10(2), so this undershoots by at most one */
+  size_t bits   = 64 - __builtin_clzll( value | 1 );
+  size_t digits = ( bits * 1233 ) >> 12;
+  return digits + ( value >= g_digit_thresholds[digits] );
+}
+
+size_t format_u64( char *dest, uint64_t value ) {
+  size_t digits = format_u64_length( value );
+  char  *p = dest + digits;
+
+  /* Two digits per division, from the right */
+  while( value >= 100 ) {
+    const char *pair = g_digit_pairs + 2 * ( value % 100 );
+    value /= 100;
+    p -= 2;
+    p[0] = pair[0];
+    p[1] = pair[1];
+  }
+  if( value >= 10 ) {
+    p[-2] = g_digit_pairs[2 * value];
+    p[-1] = g_digit_pairs[2 * value + 1];
+  } else
+    p[-1] = '0' + (char)value;
+
+  return digits;
+}
+
+size_t format_bencode_int( char *dest, uint64_t value ) {
+  char *r = dest;
+  *r++ = 'i';
+  r += format_u64( r, value );
+  *r++ = 'e';
+  return r - dest;
+}
+
+size_t format_bencode_scrape( char *dest, uint64_t seeds, uint64_t downloads, uint64_t leechers ) {
+  char *r = dest;
+  r += FORMAT_LITERAL( r, "d8:completei" );
+  r += format_u64( r, seeds );
+  r += FORMAT_LITERAL( r, "e10:downloadedi" );
+  r += format_u64( r, downloads );
+  r += FORMAT_LITERAL( r, "e10:incompletei" );
+  r += format_u64( r, leechers );
+  r += FORMAT_LITERAL( r, "ee" );
+  return r - dest;
+}
+
+size_t format_ascii_pair( char *dest, uint64_t first, uint64_t second ) {
+  char *r = dest;
+  *r++ = ':';
+  r += format_u64( r, first );
+  *r++ = ':';
+  r += format_u64( r, second );
+  *r++ = '\n';
+  return r - dest;
+}
+
+const char *g_version_format_c = "$Source$: $Revision$\n";
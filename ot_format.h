@@ -0,0 +1,34 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_FORMAT_H__
+#define __OT_FORMAT_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/* Longest decimal representation of an uint64_t */
+#define OT_FORMAT_U64_MAXLEN 20
+
+/* Copies a string literal without its terminating zero, evaluates to its length */
+#define FORMAT_LITERAL( dest, literal ) ( memcpy( (dest), (literal), sizeof(literal) - 1 ), sizeof(literal) - 1 )
+
+/* Decimal representation of value, not zero terminated. Both return
+   the number of digits */
+size_t format_u64( char *dest, uint64_t value );
+size_t format_u64_length( uint64_t value );
+
+/* Bencoded integer "i<value>e" */
+size_t format_bencode_int( char *dest, uint64_t value );
+
+/* Bencoded scrape dictionary
+   "d8:completei<seeds>e10:downloadedi<downloads>e10:incompletei<leechers>ee",
+   at most 124 bytes */
+size_t format_bencode_scrape( char *dest, uint64_t seeds, uint64_t downloads, uint64_t leechers );
+
+/* ASCII scrape line ":<first>:<second>\n", at most 43 bytes */
+size_t format_ascii_pair( char *dest, uint64_t first, uint64_t second );
+
+#endif
@@ -8,12 +8,17 @@
 /* System */
 #include <sys/param.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #ifdef WANT_COMPRESSION_GZIP
 #include <zlib.h>
 #endif
+#ifdef WANT_COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 
 /* Libowfat */
 #include "byte.h"
@@ -25,6 +30,7 @@
 #include "ot_mutex.h"
 #include "ot_iovec.h"
 #include "ot_fullscrape.h"
+#include "ot_format.h"
 
 /* Fetch full scrape info for all torrents
    Full scrapes usually are huge and one does not want to
@@ -35,36 +41,136 @@
 /* "d8:completei%zde10:downloadedi%zde10:incompletei%zdee" */
 #define OT_SCRAPE_MAXENTRYLEN 256
 
-#ifdef WANT_COMPRESSION_GZIP
-#define IF_COMPRESSION( TASK ) if( mode & TASK_FLAG_GZIP ) TASK
-#define WANT_COMPRESSION_GZIP_PARAM( param1, param2, param3 ) , param1, param2, param3
+#if defined( WANT_COMPRESSION_GZIP ) || defined( WANT_COMPRESSION_ZSTD )
+#define OT_FULLSCRAPE_COMPRESSION
+#define IF_COMPRESSION( TASK ) if( mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) TASK
 #else
 #define IF_COMPRESSION( TASK )
-#define WANT_COMPRESSION_GZIP_PARAM( param1, param2, param3 )
 #endif
 
-/* Forward declaration */
-static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode );
+enum { FULLSCRAPE_FLUSH_NONE, FULLSCRAPE_FLUSH_END };
+
+/* A full scrape is cut into contiguous bucket ranges, rendered by a pool
+   of g_fullscrape_threads threads, the fullscrape worker being one of them.
+   More shards than threads even out ranges holding more torrents */
+#define OT_FULLSCRAPE_SHARDS_PER_THREAD 4
+
+typedef struct {
+  int           first_bucket;
+  int           last_bucket;
+  ot_tasktype   mode;
+  ot_time       since;
+  int           iovec_entries;
+  struct iovec *iovector;
+#ifdef OT_FULLSCRAPE_COMPRESSION
+  char         *out;
+  char         *out_end;
+#endif
+#ifdef WANT_COMPRESSION_GZIP
+  z_stream      strm;
+  uLong         crc;
+  uLong         length;
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  ZSTD_CCtx    *zstd;
+  ZSTD_inBuffer zin;
+  size_t        zpending;
+#endif
+} ot_fullscrape_shard;
+
+unsigned int                g_fullscrape_threads;
+static ot_fullscrape_shard *g_shards;
+static int                  g_shards_count, g_shards_next, g_shards_done;
+static pthread_mutex_t      g_shards_mutex     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       g_shards_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t       g_shards_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Forward declarations */
+static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, ot_time since );
+static void * fullscrape_shard_worker( void * args );
+
+/* Most recent rendering of every format, plain, gzipped and zstd
+   compressed, shared with all requests for that format within
+   g_fullscrape_maxage seconds. Only ever touched by the fullscrape worker */
+#define OT_FULLSCRAPE_CACHE_FORMATS ( TASK_FULLSCRAPE_TRACKERSTATE - TASK_FULLSCRAPE )
+#define OT_FULLSCRAPE_CACHE_ENCODINGS 3
+static struct { ot_shared_iovec *shared; ot_time made; } g_fullscrape_cache[ OT_FULLSCRAPE_CACHE_ENCODINGS * OT_FULLSCRAPE_CACHE_FORMATS ];
+unsigned int g_fullscrape_maxage = OT_FULLSCRAPE_MAXAGE_DEFAULT;
+#ifdef WANT_COMPRESSION_ZSTD
+int g_fullscrape_zstd_level = OT_FULLSCRAPE_ZSTD_LEVEL_DEFAULT;
+#endif
 
 /* Converter function from memory to human readable hex strings
    XXX - Duplicated from ot_stats. Needs fix. */
 static char*to_hex(char*d,uint8_t*s){char*m="0123456789ABCDEF";char *t=d;char*e=d+40;while(d<e){*d++=m[*s>>4];*d++=m[*s++&15];}*d=0;return t;}
 
+/* Returns a reference to a fresh enough rendering of mode, rendering
+   it if there is none, or NULL if mode is not to be cached. made is set
+   to the tracker time the rendering started, every change after it has
+   its torrent's changed at or after that time */
+static ot_shared_iovec *fullscrape_cached( ot_tasktype mode, ot_time *made ) {
+  int iovec_entries, slot;
+  struct iovec *iovector;
+  ot_shared_iovec *shared;
+
+  /* Expired renderings only waste memory */
+  for( slot=0; slot<OT_FULLSCRAPE_CACHE_ENCODINGS*OT_FULLSCRAPE_CACHE_FORMATS; ++slot )
+    if( g_fullscrape_cache[slot].shared && g_now_seconds - g_fullscrape_cache[slot].made >= (ot_time)g_fullscrape_maxage ) {
+      iovec_share_release( g_fullscrape_cache[slot].shared );
+      g_fullscrape_cache[slot].shared = NULL;
+    }
+
+  /* The tracker state is meant to be a current snapshot */
+  if( !g_fullscrape_maxage || ( mode & TASK_TASK_MASK ) >= TASK_FULLSCRAPE_TRACKERSTATE )
+    return NULL;
+
+  slot = OT_FULLSCRAPE_CACHE_ENCODINGS * ( ( mode & TASK_TASK_MASK ) - TASK_FULLSCRAPE );
+  if( mode & TASK_FLAG_GZIP ) slot += 1;
+  if( mode & TASK_FLAG_ZSTD ) slot += 2;
+  if( g_fullscrape_cache[slot].shared ) {
+    *made = g_fullscrape_cache[slot].made;
+    return iovec_share_ref( g_fullscrape_cache[slot].shared );
+  }
+
+  *made = g_now_seconds;
+  fullscrape_make( &iovec_entries, &iovector, mode, 0 );
+  if( !iovec_entries || !( shared = iovec_share( &iovec_entries, &iovector ) ) ) {
+    iovec_free( &iovec_entries, &iovector );
+    free( iovector );
+    return NULL;
+  }
+
+  g_fullscrape_cache[slot].shared = shared;
+  g_fullscrape_cache[slot].made   = *made;
+  return iovec_share_ref( shared );
+}
+
 /* This is the entry point into this worker thread
    It grabs tasks from mutex_tasklist and delivers results back
 */
 static void * fullscrape_worker( void * args ) {
   int iovec_entries;
   struct iovec *iovector;
+  ot_shared_iovec *shared;
 
   (void) args;
 
   while( 1 ) {
     ot_tasktype tasktype = TASK_FULLSCRAPE;
-    ot_taskid   taskid   = mutex_workqueue_poptask( &tasktype );
-    fullscrape_make( &iovec_entries, &iovector, tasktype );
-    if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
-      iovec_free( &iovec_entries, &iovector );
+    ot_time     since, made;
+    ot_taskid   taskid   = mutex_workqueue_poptask_since( &tasktype, &since );
+
+    /* Delta scrapes differ for every client, so are never cached. Every
+       result tells the time to pass as since on the next delta scrape */
+    if( !since && ( shared = fullscrape_cached( tasktype, &made ) ) ) {
+      if( mutex_workqueue_pushresult_shared( taskid, shared, made ) )
+        iovec_share_release( shared );
+    } else {
+      made = g_now_seconds;
+      fullscrape_make( &iovec_entries, &iovector, tasktype, since );
+      if( mutex_workqueue_pushresult_since( taskid, iovec_entries, iovector, made ) )
+        iovec_free( &iovec_entries, &iovector );
+    }
     if( !g_opentracker_running )
       return NULL;
   }
@@ -72,25 +178,144 @@ static void * fullscrape_worker( void * args ) {
 }
 
 static pthread_t thread_id;
+static pthread_t shard_thread_ids[OT_FULLSCRAPE_THREADS_MAX];
 void fullscrape_init( ) {
+  unsigned int i;
+
+  if( !g_fullscrape_threads ) {
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    g_fullscrape_threads = cpus > 0 ? (unsigned int)cpus : 1;
+  }
+  if( g_fullscrape_threads > OT_FULLSCRAPE_THREADS_MAX )
+    g_fullscrape_threads = OT_FULLSCRAPE_THREADS_MAX;
+
+  /* The fullscrape worker renders shards itself */
+  for( i=1; i<g_fullscrape_threads; ++i )
+    pthread_create( shard_thread_ids + i, NULL, fullscrape_shard_worker, NULL );
   pthread_create( &thread_id, NULL, fullscrape_worker, NULL );
 }
 
 void fullscrape_deinit( ) {
+  unsigned int i;
   pthread_cancel( thread_id );
+  for( i=1; i<g_fullscrape_threads; ++i )
+    pthread_cancel( shard_thread_ids[i] );
 }
 
-void fullscrape_deliver( int64 sock, ot_tasktype tasktype ) {
-  mutex_workqueue_pushtask( sock, tasktype );
+void fullscrape_deliver( int64 sock, ot_tasktype tasktype, ot_time since ) {
+  mutex_workqueue_pushtask_since( sock, tasktype, since );
 }
 
-static int fullscrape_increase( int *iovec_entries, struct iovec **iovector,
-                         char **r, char **re  WANT_COMPRESSION_GZIP_PARAM( z_stream *strm, ot_tasktype mode, int zaction ) ) {
-  /* Allocate a fresh output buffer at the end of our buffers list */
-  if( !( *r = iovec_fix_increase_or_free( iovec_entries, iovector, *r, OT_SCRAPE_CHUNK_SIZE ) ) ) {
+#ifdef OT_FULLSCRAPE_COMPRESSION
+/* Every shard compresses on its own. Gzipped shards are raw deflate
+   streams, all but the last one ending in a sync flush, joined under a
+   single gzip header and trailer. Zstd shards are complete frames, which
+   decoders take concatenated */
+static int fullscrape_compress_init( ot_fullscrape_shard *shard, char *out ) {
+  shard->out     = out;
+  shard->out_end = out + OT_SCRAPE_CHUNK_SIZE;
+#ifdef WANT_COMPRESSION_GZIP
+  if( shard->mode & TASK_FLAG_GZIP ) {
+    shard->crc    = crc32( 0L, Z_NULL, 0 );
+    shard->length = 0;
+    byte_zero( &shard->strm, sizeof(shard->strm) );
+    if( deflateInit2( &shard->strm, 7, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+      return -1;
+  }
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  if( shard->mode & TASK_FLAG_ZSTD ) {
+    if( !( shard->zstd = ZSTD_createCCtx( ) ) )
+      return -1;
+    ZSTD_CCtx_setParameter( shard->zstd, ZSTD_c_compressionLevel, g_fullscrape_zstd_level );
+  }
+#endif
+  return 0;
+}
 
-    /* Deallocate gzip buffers */
-    IF_COMPRESSION( deflateEnd(strm); )
+static void fullscrape_compress_end( ot_fullscrape_shard *shard ) {
+#ifdef WANT_COMPRESSION_GZIP
+  if( shard->mode & TASK_FLAG_GZIP )
+    deflateEnd( &shard->strm );
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  if( shard->mode & TASK_FLAG_ZSTD ) {
+    ZSTD_freeCCtx( shard->zstd );
+    shard->zstd = NULL;
+  }
+#endif
+}
+
+/* Hands the uncompressed bytes in [in, in_end) to the shard's compressor */
+static void fullscrape_compress_input( ot_fullscrape_shard *shard, char *in, char *in_end ) {
+#ifdef WANT_COMPRESSION_GZIP
+  if( shard->mode & TASK_FLAG_GZIP ) {
+    shard->crc           = crc32( shard->crc, (Bytef*)in, in_end - in );
+    shard->length       += in_end - in;
+    shard->strm.next_in  = (uint8_t*)in;
+    shard->strm.avail_in = in_end - in;
+  }
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  if( shard->mode & TASK_FLAG_ZSTD ) {
+    shard->zin.src  = in;
+    shard->zin.size = in_end - in;
+    shard->zin.pos  = 0;
+  }
+#endif
+}
+
+/* Compresses pending input into the current output chunk and returns
+   where the compressed data ends */
+static char *fullscrape_compress( ot_fullscrape_shard *shard, int flush ) {
+#ifdef WANT_COMPRESSION_GZIP
+  if( shard->mode & TASK_FLAG_GZIP ) {
+    int zaction = Z_NO_FLUSH, zres;
+    if( flush == FULLSCRAPE_FLUSH_END )
+      zaction = shard->last_bucket == OT_BUCKET_COUNT ? Z_FINISH : Z_SYNC_FLUSH;
+    shard->strm.next_out  = (uint8_t*)shard->out;
+    shard->strm.avail_out = shard->out_end - shard->out;
+    zres = deflate( &shard->strm, zaction );
+    if( ( zres < Z_OK ) && ( zres != Z_BUF_ERROR ) )
+      fprintf( stderr, "deflate() failed while in fullscrape_compress(%d).\n", zaction );
+    shard->out = (char*)shard->strm.next_out;
+  }
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  if( shard->mode & TASK_FLAG_ZSTD ) {
+    ZSTD_outBuffer zout = { shard->out, shard->out_end - shard->out, 0 };
+    size_t zres = ZSTD_compressStream2( shard->zstd, &zout, &shard->zin, flush == FULLSCRAPE_FLUSH_END ? ZSTD_e_end : ZSTD_e_continue );
+    if( ZSTD_isError( zres ) ) {
+      fprintf( stderr, "ZSTD_compressStream2() failed while in fullscrape_compress(%d): %s\n", flush, ZSTD_getErrorName( zres ) );
+      zres = 0;
+    }
+    /* Only when ending the frame, zres is what still waits to be flushed */
+    shard->zpending = ( flush == FULLSCRAPE_FLUSH_END ) ? zres : 0;
+    shard->out += zout.pos;
+  }
+#endif
+  return shard->out;
+}
+
+/* Whether the compressor holds back output although there was room */
+static int fullscrape_compress_pending( ot_fullscrape_shard *shard ) {
+#ifdef WANT_COMPRESSION_ZSTD
+  if( shard->mode & TASK_FLAG_ZSTD )
+    return shard->zpending != 0;
+#endif
+  (void)shard;
+  return 0;
+}
+#endif
+
+static int fullscrape_increase( ot_fullscrape_shard *shard, char **r, char **re, int flush ) {
+  /* Allocate a fresh output buffer at the end of our buffers list */
+  if( !( *r = iovec_fix_increase_or_free( &shard->iovec_entries, &shard->iovector, *r, OT_SCRAPE_CHUNK_SIZE ) ) ) {
+#ifdef OT_FULLSCRAPE_COMPRESSION
+    /* Deallocate compression buffers */
+    if( shard->mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) )
+      fullscrape_compress_end( shard );
+#endif
 
     /* Release lock on current bucket and return */
     return -1;
@@ -100,28 +325,32 @@ static int fullscrape_increase( int *iovec_entries, struct iovec **iovector,
   *re = *r + OT_SCRAPE_CHUNK_SIZE - OT_SCRAPE_MAXENTRYLEN;
 
   /* When compressing, we have all the bytes in output buffer */
-#ifdef WANT_COMPRESSION_GZIP
-  if( mode & TASK_FLAG_GZIP ) {
-    int zres;
+#ifdef OT_FULLSCRAPE_COMPRESSION
+  if( shard->mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) {
     *re -= OT_SCRAPE_MAXENTRYLEN;
-    strm->next_out  = (uint8_t*)*r;
-    strm->avail_out = OT_SCRAPE_CHUNK_SIZE;
-    zres = deflate( strm, zaction );
-    if( ( zres < Z_OK ) && ( zres != Z_BUF_ERROR ) )
-      fprintf( stderr, "deflate() failed while in fullscrape_increase(%d).\n", zaction );
-    *r = (char*)strm->next_out;
+    shard->out     = *r;
+    shard->out_end = *r + OT_SCRAPE_CHUNK_SIZE;
+    *r = fullscrape_compress( shard, flush );
   }
+#else
+  (void)flush;
 #endif
 
   return 0;
 }
 
-static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode ) {
+/* Renders the torrents in the shard's bucket range into its own iovecs,
+   compressed to be concatenated in order, see fullscrape_compress() */
+static void fullscrape_make_shard( ot_fullscrape_shard *shard ) {
+  int          *iovec_entries = &shard->iovec_entries;
+  struct iovec **iovector     = &shard->iovector;
+  ot_tasktype   mode          = shard->mode;
+  int           is_first      = shard->first_bucket == 0;
+  int           is_last       = shard->last_bucket  == OT_BUCKET_COUNT;
   int      bucket;
   char    *r, *re;
-#ifdef WANT_COMPRESSION_GZIP
+#ifdef OT_FULLSCRAPE_COMPRESSION
   char     compress_buffer[OT_SCRAPE_MAXENTRYLEN];
-  z_stream strm;
 #endif
 
   /* Setup return vector... */
@@ -133,33 +362,43 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
   /* re points to low watermark */
   re = r + OT_SCRAPE_CHUNK_SIZE - OT_SCRAPE_MAXENTRYLEN;
 
-#ifdef WANT_COMPRESSION_GZIP
-  if( mode & TASK_FLAG_GZIP ) {
+#ifdef OT_FULLSCRAPE_COMPRESSION
+  if( mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) {
     re += OT_SCRAPE_MAXENTRYLEN;
-    byte_zero( &strm, sizeof(strm) );
-    strm.next_in   = (uint8_t*)compress_buffer;
-    strm.next_out  = (uint8_t*)r;
-    strm.avail_out = OT_SCRAPE_CHUNK_SIZE;
-    if( deflateInit2(&strm,7,Z_DEFLATED,31,8,Z_DEFAULT_STRATEGY) != Z_OK )
-      fprintf( stderr, "not ok.\n" );
+    if( fullscrape_compress_init( shard, r ) ) {
+      fprintf( stderr, "Could not set up compression for fullscrape_make_shard().\n" );
+      fullscrape_compress_end( shard );
+      iovec_free( iovec_entries, iovector );
+      return;
+    }
     r = compress_buffer;
   }
 #endif
 
-  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
-    r += sprintf( r, "d5:filesd" );
+  if( is_first && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
+    r += FORMAT_LITERAL( r, "d5:filesd" );
 
   /* For each bucket... */
-  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    /* Get exclusive access to that bucket */
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    size_t tor_offset;
+  for( bucket=shard->first_bucket; bucket<shard->last_bucket; ++bucket ) {
+    /* Copy the bucket's counters, announces only wait for that */
+    ot_torrent_snapshot *torrents;
+    ssize_t torrent_count = snapshot_bucket( bucket, &torrents ), tor_offset;
+
+    if( torrent_count < 0 ) {
+      IF_COMPRESSION( fullscrape_compress_end( shard ); )
+      iovec_free( iovec_entries, iovector );
+      return;
+    }
 
     /* For each torrent in this bucket.. */
-    for( tor_offset=0; tor_offset<torrents_list->size; ++tor_offset ) {
+    for( tor_offset=0; tor_offset<torrent_count; ++tor_offset ) {
       /* Address torrents members */
-      ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[tor_offset] ).peer_list;
-      ot_hash     *hash      =&( ((ot_torrent*)(torrents_list->data))[tor_offset] ).hash;
+      ot_torrent_snapshot *torrent = torrents + tor_offset;
+      ot_hash             *hash    = &torrent->hash;
+
+      /* Delta scrapes only want torrents whose counters moved */
+      if( torrent->changed < shard->since )
+        continue;
 
       switch( mode & TASK_TASK_MASK ) {
       case TASK_FULLSCRAPE:
@@ -168,78 +407,209 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
         *r++='2'; *r++='0'; *r++=':';
         memcpy( r, hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
         /* push rest of the scrape string */
-        r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee", peer_list->seed_count, peer_list->down_count, peer_list->peer_count-peer_list->seed_count );
+        r += format_bencode_scrape( r, torrent->seed_count, torrent->down_count, torrent->peer_count-torrent->seed_count );
 
         break;
       case TASK_FULLSCRAPE_TPB_ASCII:
         to_hex( r, *hash ); r+= 2 * sizeof(ot_hash);
-        r += sprintf( r, ":%zd:%zd\n", peer_list->seed_count, peer_list->peer_count-peer_list->seed_count );
+        r += format_ascii_pair( r, torrent->seed_count, torrent->peer_count-torrent->seed_count );
         break;
       case TASK_FULLSCRAPE_TPB_BINARY:
         memcpy( r, *hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
-        *(uint32_t*)(r+0) = htonl( (uint32_t)  peer_list->seed_count );
-        *(uint32_t*)(r+4) = htonl( (uint32_t)( peer_list->peer_count-peer_list->seed_count) );
+        *(uint32_t*)(r+0) = htonl( (uint32_t)  torrent->seed_count );
+        *(uint32_t*)(r+4) = htonl( (uint32_t)( torrent->peer_count-torrent->seed_count) );
         r+=8;
         break;
       case TASK_FULLSCRAPE_TPB_URLENCODED:
         r += fmt_urlencoded( r, (char *)*hash, 20 );
-        r += sprintf( r, ":%zd:%zd\n", peer_list->seed_count, peer_list->peer_count-peer_list->seed_count );
+        r += format_ascii_pair( r, torrent->seed_count, torrent->peer_count-torrent->seed_count );
         break;
       case TASK_FULLSCRAPE_TRACKERSTATE:
         to_hex( r, *hash ); r+= 2 * sizeof(ot_hash);
-        r += sprintf( r, ":%zd:%zd\n", peer_list->base, peer_list->down_count );
+        r += format_ascii_pair( r, torrent->base, torrent->down_count );
         break;
       }
 
-#ifdef WANT_COMPRESSION_GZIP
-     if( mode & TASK_FLAG_GZIP ) {
-        int zres;
-        strm.next_in  = (uint8_t*)compress_buffer;
-        strm.avail_in = r - compress_buffer;
-        zres = deflate( &strm, Z_NO_FLUSH );
-        if( ( zres < Z_OK ) && ( zres != Z_BUF_ERROR ) )
-          fprintf( stderr, "deflate() failed while in fullscrape_make().\n" );
-        r = (char*)strm.next_out;
+#ifdef OT_FULLSCRAPE_COMPRESSION
+      if( mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) {
+        fullscrape_compress_input( shard, compress_buffer, r );
+        r = fullscrape_compress( shard, FULLSCRAPE_FLUSH_NONE );
       }
 #endif
 
       /* Check if there still is enough buffer left */
       while( r >= re )
-       if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_NO_FLUSH ) ) )
-         return mutex_bucket_unlock( bucket, 0 );
+       if( fullscrape_increase( shard, &r, &re, FULLSCRAPE_FLUSH_NONE ) )
+         return;
 
       IF_COMPRESSION( r = compress_buffer; )
     }
 
-    /* All torrents done: release lock on current bucket */
-    mutex_bucket_unlock( bucket, 0 );
-
     /* Parent thread died? */
     if( !g_opentracker_running )
       return;
   }
 
-  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
-    r += sprintf( r, "ee" );
+  if( is_last && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
+    r += FORMAT_LITERAL( r, "ee" );
 
-#ifdef WANT_COMPRESSION_GZIP
-  if( mode & TASK_FLAG_GZIP ) {
-    strm.next_in  = (uint8_t*)compress_buffer;
-    strm.avail_in = r - compress_buffer;
-    if( deflate( &strm, Z_FINISH ) < Z_OK )
-      fprintf( stderr, "deflate() failed while in fullscrape_make()'s endgame.\n" );
-    r = (char*)strm.next_out;
+#ifdef OT_FULLSCRAPE_COMPRESSION
+  if( mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) {
+    fullscrape_compress_input( shard, compress_buffer, r );
+    r = fullscrape_compress( shard, FULLSCRAPE_FLUSH_END );
 
-    while( r >= re )
-      if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_FINISH ) ) )
-        return mutex_bucket_unlock( bucket, 0 );
-    deflateEnd(&strm);
+    while( r >= re || fullscrape_compress_pending( shard ) )
+      if( fullscrape_increase( shard, &r, &re, FULLSCRAPE_FLUSH_END ) )
+        return;
+    fullscrape_compress_end( shard );
   }
 #endif
 
   /* Release unused memory in current output buffer */
   iovec_fixlast( iovec_entries, iovector, r );
 }
+
+/* Shard workers take the next unrendered shard of the current full
+   scrape until there are none left */
+static void fullscrape_render_shards( ) {
+  while( 1 ) {
+    ot_fullscrape_shard *shard;
+
+    pthread_mutex_lock( &g_shards_mutex );
+    if( g_shards_next == g_shards_count ) {
+      pthread_mutex_unlock( &g_shards_mutex );
+      return;
+    }
+    shard = g_shards + g_shards_next++;
+    pthread_mutex_unlock( &g_shards_mutex );
+
+    fullscrape_make_shard( shard );
+
+    pthread_mutex_lock( &g_shards_mutex );
+    if( ++g_shards_done == g_shards_count )
+      pthread_cond_signal( &g_shards_done_cond );
+    pthread_mutex_unlock( &g_shards_mutex );
+  }
+}
+
+static void * fullscrape_shard_worker( void * args ) {
+  (void) args;
+
+  while( 1 ) {
+    pthread_mutex_lock( &g_shards_mutex );
+    while( g_shards_next == g_shards_count )
+      pthread_cond_wait( &g_shards_work_cond, &g_shards_mutex );
+    pthread_mutex_unlock( &g_shards_mutex );
+
+    fullscrape_render_shards( );
+  }
+  return NULL;
+}
+
+static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, ot_time since ) {
+  int shard_count = OT_FULLSCRAPE_SHARDS_PER_THREAD * g_fullscrape_threads, shard, failed = 0;
+#ifdef WANT_COMPRESSION_GZIP
+  uLong crc = crc32( 0L, Z_NULL, 0 ), length = 0;
+  char *r;
+#endif
+
+  /* Setup return vector... */
+  *iovec_entries = 0;
+  *iovector = NULL;
+
+  if( shard_count > OT_BUCKET_COUNT )
+    shard_count = OT_BUCKET_COUNT;
+  if( !( g_shards = calloc( shard_count, sizeof(ot_fullscrape_shard) ) ) )
+    return;
+
+  /* Bucket ranges are contiguous, so concatenating the shards in order
+     yields the very same stream a single pass would have produced */
+  for( shard=0; shard<shard_count; ++shard ) {
+    g_shards[shard].first_bucket = (int)( ( (int64_t)OT_BUCKET_COUNT * shard ) / shard_count );
+    g_shards[shard].last_bucket  = (int)( ( (int64_t)OT_BUCKET_COUNT * ( shard + 1 ) ) / shard_count );
+    g_shards[shard].mode         = mode;
+    g_shards[shard].since        = since;
+  }
+
+  /* Hand the shards to the pool and help rendering them */
+  pthread_mutex_lock( &g_shards_mutex );
+  g_shards_next  = 0;
+  g_shards_done  = 0;
+  g_shards_count = shard_count;
+  pthread_cond_broadcast( &g_shards_work_cond );
+  pthread_mutex_unlock( &g_shards_mutex );
+
+  fullscrape_render_shards( );
+
+  pthread_mutex_lock( &g_shards_mutex );
+  while( g_shards_done != g_shards_count )
+    pthread_cond_wait( &g_shards_done_cond, &g_shards_mutex );
+  pthread_mutex_unlock( &g_shards_mutex );
+
+  /* A shard that could not allocate its buffers has freed them */
+  for( shard=0; shard<shard_count; ++shard )
+    if( !g_shards[shard].iovec_entries )
+      failed = 1;
+  if( failed || !g_opentracker_running )
+    goto cleanup;
+
+#ifdef WANT_COMPRESSION_GZIP
+  /* The shards' raw deflate streams share a single gzip header... */
+  if( mode & TASK_FLAG_GZIP ) {
+    static const char gzip_header[10] = { 0x1f, (char)0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+    if( !( r = iovec_increase( iovec_entries, iovector, sizeof(gzip_header) ) ) )
+      goto cleanup;
+    memcpy( r, gzip_header, sizeof(gzip_header) );
+  }
+#endif
+
+  for( shard=0; shard<shard_count; ++shard ) {
+    struct iovec *new_vec = realloc( *iovector, ( *iovec_entries + g_shards[shard].iovec_entries ) * sizeof(struct iovec) );
+    if( !new_vec )
+      goto cleanup;
+    memcpy( new_vec + *iovec_entries, g_shards[shard].iovector, g_shards[shard].iovec_entries * sizeof(struct iovec) );
+    *iovector = new_vec;
+    *iovec_entries += g_shards[shard].iovec_entries;
+    free( g_shards[shard].iovector );
+    g_shards[shard].iovec_entries = 0;
+    g_shards[shard].iovector = NULL;
+
+#ifdef WANT_COMPRESSION_GZIP
+    if( mode & TASK_FLAG_GZIP ) {
+      crc = crc32_combine( crc, g_shards[shard].crc, g_shards[shard].length );
+      length += g_shards[shard].length;
+    }
+#endif
+  }
+
+#ifdef WANT_COMPRESSION_GZIP
+  /* ... and a trailer holding crc32 and size of the whole scrape */
+  if( mode & TASK_FLAG_GZIP ) {
+    int i;
+    if( !( r = iovec_increase( iovec_entries, iovector, 8 ) ) )
+      goto cleanup;
+    for( i=0; i<4; ++i ) {
+      r[i]   = (char)( crc    >> ( 8 * i ) );
+      r[4+i] = (char)( length >> ( 8 * i ) );
+    }
+  }
+#endif
+
+  free( g_shards );
+  g_shards = NULL;
+  return;
+
+cleanup:
+  for( shard=0; shard<shard_count; ++shard ) {
+    iovec_free( &g_shards[shard].iovec_entries, &g_shards[shard].iovector );
+    free( g_shards[shard].iovector );
+  }
+  free( g_shards );
+  g_shards = NULL;
+  iovec_free( iovec_entries, iovector );
+  free( *iovector );
+  *iovector = NULL;
+}
 #endif
 
 const char *g_version_fullscrape_c = "$Source$: $Revision$\n";
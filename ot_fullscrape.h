@@ -8,9 +8,25 @@
 
 #ifdef WANT_FULLSCRAPE
 
+/* Seconds a rendered full scrape is served to subsequent requests */
+#define OT_FULLSCRAPE_MAXAGE_DEFAULT 30
+extern unsigned int g_fullscrape_maxage;
+
+/* Threads rendering a full scrape, 0 means one per online cpu */
+#define OT_FULLSCRAPE_THREADS_MAX 64
+extern unsigned int g_fullscrape_threads;
+
+#ifdef WANT_COMPRESSION_ZSTD
+/* Compression level of zstd encoded full scrapes */
+#define OT_FULLSCRAPE_ZSTD_LEVEL_DEFAULT 3
+extern int g_fullscrape_zstd_level;
+#endif
+
 void fullscrape_init( );
 void fullscrape_deinit( );
-void fullscrape_deliver( int64 sock, ot_tasktype tasktype );
+/* since restricts the scrape to torrents changed at or after that
+   time in seconds since epoch, 0 scrapes all torrents */
+void fullscrape_deliver( int64 sock, ot_tasktype tasktype, ot_time since );
 
 #else
 
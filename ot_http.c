@@ -29,6 +29,8 @@
 #include "ot_fullscrape.h"
 #include "ot_stats.h"
 #include "ot_accesslist.h"
+#include "ot_tcp.h"
+#include "ot_format.h"
 
 #define OT_MAXMULTISCRAPE_COUNT 64
 extern char *g_redirecturl;
@@ -39,13 +41,131 @@ ssize_t g_stats_path_len;
 enum {
   SUCCESS_HTTP_HEADER_LENGTH = 80,
   SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING = 32,
+  SUCCESS_HTTP_HEADER_LENGTH_NEXT_SINCE = 40,
   SUCCESS_HTTP_SIZE_OFF = 17 };
 
+/* Sockets served by tcp worker loops are unknown to libowfat's io layer,
+   their cookies and event interests are kept by ot_tcp.c */
+static struct http_data *http_getcookie( const int64 sock, struct ot_workstruct *ws ) {
+  return ws->tcp_worker ? tcp_getcookie( sock ) : io_getcookie( sock );
+}
+
+static void http_close( const int64 sock, struct ot_workstruct *ws ) {
+  if( ws->tcp_worker ) tcp_close( sock ); else io_close( sock );
+}
+
+/* Time out the socket in seconds from now, 0 disables the timeout */
+static void http_timeout( const int64 sock, struct ot_workstruct *ws, time_t seconds ) {
+  tai6464 t;
+  if( ws->tcp_worker ) {
+    tcp_timeout( sock, seconds );
+    return;
+  }
+  taia_uint( &t, 0 );
+  if( seconds ) {
+    taia_now( &t ); taia_addsec( &t, &t, seconds );
+  }
+  io_timeout( sock, t );
+}
+
+static void http_dontwantread( const int64 sock, struct ot_workstruct *ws ) {
+  if( ws->tcp_worker ) tcp_dontwantread( sock ); else io_dontwantread( sock );
+}
+
+static void http_wantwrite( const int64 sock, struct ot_workstruct *ws ) {
+  if( ws->tcp_worker ) tcp_wantwrite( sock ); else io_wantwrite( sock );
+}
+
+struct http_data *http_newcookie( ot_ip6 ip ) {
+  struct http_data *cookie = (struct http_data*)malloc( sizeof(struct http_data) );
+  if( cookie ) {
+    memset( cookie, 0, sizeof(struct http_data) );
+    memcpy( cookie->ip, ip, sizeof(ot_ip6) );
+  }
+  return cookie;
+}
+
+void http_handle_dead( const int64 sock, struct ot_workstruct *ws ) {
+  struct http_data *cookie = http_getcookie( sock, ws );
+  if( cookie ) {
+    iob_reset( &cookie->batch );
+    if( cookie->shared )
+      iovec_share_release( cookie->shared );
+    array_reset( &cookie->request );
+    if( cookie->flag & STRUCT_HTTP_FLAG_WAITINGFORTASK )
+      mutex_workqueue_canceltask( sock );
+    free( cookie );
+  }
+  http_close( sock, ws );
+}
+
+void http_handle_read( const int64 sock, struct ot_workstruct *ws, ssize_t byte_count ) {
+  struct http_data *cookie = http_getcookie( sock, ws );
+
+  if( !cookie ) return;
+  if( byte_count <= 0 ) {
+    http_handle_dead( sock, ws );
+    return;
+  }
+
+  /* If we get the whole request in one packet, handle it without copying */
+  if( !array_start( &cookie->request ) ) {
+    if( ( ws->header_size = http_header_complete( ws->inbuf, byte_count ) ) ) {
+      ws->request = ws->inbuf;
+      ws->request_size = byte_count;
+      http_handle_request( sock, ws );
+    } else
+      array_catb( &cookie->request, ws->inbuf, byte_count );
+    return;
+  }
+
+  array_catb( &cookie->request, ws->inbuf, byte_count );
+  if( array_failed( &cookie->request ) || array_bytes( &cookie->request ) > 8192 ) {
+    http_issue_error( sock, ws, CODE_HTTPERROR_500 );
+    return;
+  }
+
+  while( ( ws->header_size = http_header_complete( array_start( &cookie->request ), array_bytes( &cookie->request ) ) ) ) {
+    ws->request      = array_start( &cookie->request );
+    ws->request_size = array_bytes( &cookie->request );
+    http_handle_request( sock, ws );
+#ifdef WANT_KEEPALIVE
+    if( !ws->keep_alive )
+#endif
+      return;
+  }
+}
+
+void http_handle_write( const int64 sock, struct ot_workstruct *ws ) {
+  struct http_data *cookie = http_getcookie( sock, ws );
+  if( !cookie || ( iob_send( sock, &cookie->batch ) <= 0 ) )
+    http_handle_dead( sock, ws );
+}
+
+/* Returns the size of the request header, if it is complete, 0 otherwise */
+size_t http_header_complete( char * request, ssize_t byte_count ) {
+  int i = 0, state = 0;
+
+  for( i=1; i < byte_count; i+=2 )
+    if( request[i] <= 13 ) {
+      i--;
+      for( state = 0 ; i < byte_count; ++i ) {
+        char c = request[i];
+        if( c == '\r' || c == '\n' )
+          state = ( state >> 2 ) | ( ( c << 6 ) & 0xc0 );
+        else
+          break;
+        if( state >= 0xa0 || state == 0x99 ) return i + 1;
+      }
+  }
+  return 0;
+}
+
 static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = http_getcookie( sock, ws );
   ssize_t written_size;
 
-  if( !cookie ) { io_close(sock); return; }
+  if( !cookie ) { http_close( sock, ws ); return; }
 
   /* whoever sends data is not interested in its input-array */
   if( ws->keep_alive && ws->header_size != ws->request_size ) {
@@ -61,16 +181,15 @@ static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
   written_size = write( sock, ws->reply, ws->reply_size );
   if( ( written_size < 0 ) || ( ( written_size == ws->reply_size ) && !ws->keep_alive ) ) {
     array_reset( &cookie->request );
-    free( cookie ); io_close( sock ); return;
+    free( cookie ); http_close( sock, ws ); return;
   }
 
   if( written_size < ws->reply_size ) {
     char * outbuf;
-    tai6464 t;
 
     if( !( outbuf = malloc( ws->reply_size - written_size ) ) ) {
       array_reset( &cookie->request );
-      free(cookie); io_close( sock );
+      free(cookie); http_close( sock, ws );
       return;
     }
 
@@ -79,10 +198,10 @@ static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
 
     /* writeable short data sockets just have a tcp timeout */
     if( !ws->keep_alive ) {
-      taia_uint( &t, 0 ); io_timeout( sock, t );
-      io_dontwantread( sock );
+      http_timeout( sock, ws, 0 );
+      http_dontwantread( sock, ws );
     }
-    io_wantwrite( sock );
+    http_wantwrite( sock, ws );
   }
 }
 
@@ -114,16 +233,17 @@ ssize_t http_issue_error( const int64 sock, struct ot_workstruct *ws, int code )
   return ws->reply_size = -2;
 }
 
-ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector ) {
-  struct http_data *cookie = io_getcookie( sock );
+/* Shared iovecs are sent in place, the connection holds a reference
+   to them until it is reset or dies */
+ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector, ot_shared_iovec *shared, ot_time since ) {
+  struct http_data *cookie = http_getcookie( sock, ws );
   char *header;
   int i;
   size_t header_size, size = iovec_length( &iovec_entries, &iovector );
-  tai6464 t;
 
   /* No cookie? Bad socket. Leave. */
   if( !cookie ) {
-    iovec_free( &iovec_entries, &iovector );
+    if( shared ) iovec_share_release( shared ); else iovec_free( &iovec_entries, &iovector );
     HTTPERROR_500;
   }
 
@@ -135,49 +255,68 @@ ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iove
 
   /* Our answers never are 0 vectors. Return an error. */
   if( !iovec_entries ) {
+    if( shared ) iovec_share_release( shared );
     HTTPERROR_500;
   }
 
   /* Prepare space for http header */
-  header = malloc( SUCCESS_HTTP_HEADER_LENGTH + SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING );
+  header = malloc( SUCCESS_HTTP_HEADER_LENGTH + SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING + SUCCESS_HTTP_HEADER_LENGTH_NEXT_SINCE );
   if( !header ) {
-    iovec_free( &iovec_entries, &iovector );
+    if( shared ) iovec_share_release( shared ); else iovec_free( &iovec_entries, &iovector );
     HTTPERROR_500;
   }
 
+  header_size = FORMAT_LITERAL( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n" );
   if( cookie->flag & STRUCT_HTTP_FLAG_GZIP )
-    header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: gzip\r\nContent-Length: %zd\r\n\r\n", size );
+    header_size += FORMAT_LITERAL( header + header_size, "Content-Encoding: gzip\r\n" );
   else if( cookie->flag & STRUCT_HTTP_FLAG_BZIP2 )
-    header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: bzip2\r\nContent-Length: %zd\r\n\r\n", size );
-  else
-    header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zd\r\n\r\n", size );
+    header_size += FORMAT_LITERAL( header + header_size, "Content-Encoding: bzip2\r\n" );
+  else if( cookie->flag & STRUCT_HTTP_FLAG_ZSTD )
+    header_size += FORMAT_LITERAL( header + header_size, "Content-Encoding: zstd\r\n" );
+  /* Full scrapes tell mirrors where their next delta scrape starts */
+  if( since ) {
+    header_size += FORMAT_LITERAL( header + header_size, "X-Next-Since: " );
+    header_size += format_u64( header + header_size, (uint64_t)since );
+    header_size += FORMAT_LITERAL( header + header_size, "\r\n" );
+  }
+  header_size += FORMAT_LITERAL( header + header_size, "Content-Length: " );
+  header_size += format_u64( header + header_size, size );
+  header_size += FORMAT_LITERAL( header + header_size, "\r\n\r\n" );
 
   iob_reset( &cookie->batch );
+  if( cookie->shared ) iovec_share_release( cookie->shared );
+  cookie->shared = shared;
   iob_addbuf_free( &cookie->batch, header, header_size );
 
   /* Will move to ot_iovec.c */
-  for( i=0; i<iovec_entries; ++i )
-    iob_addbuf_munmap( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
-  free( iovector );
+  if( shared )
+    for( i=0; i<iovec_entries; ++i )
+      iob_addbuf( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+  else {
+    for( i=0; i<iovec_entries; ++i )
+      iob_addbuf_munmap( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+    free( iovector );
+  }
 
   /* writeable sockets timeout after 10 minutes */
-  taia_now( &t ); taia_addsec( &t, &t, OT_CLIENT_TIMEOUT_SEND );
-  io_timeout( sock, t );
-  io_dontwantread( sock );
-  io_wantwrite( sock );
+  http_timeout( sock, ws, OT_CLIENT_TIMEOUT_SEND );
+  http_dontwantread( sock, ws );
+  http_wantwrite( sock, ws );
   return 0;
 }
 
 static ssize_t http_handle_stats( const int64 sock, struct ot_workstruct *ws, char *read_ptr ) {
 static const ot_keywords keywords_main[] =
-  { { "mode", 1 }, {"format", 2 }, { NULL, -3 } };
+  { { "mode", 1 }, {"format", 2 }, { "since", 3 }, { NULL, -3 } };
 static const ot_keywords keywords_mode[] =
   { { "peer", TASK_STATS_PEERS }, { "conn", TASK_STATS_CONNS }, { "scrp", TASK_STATS_SCRAPE }, { "udp4", TASK_STATS_UDP }, { "tcp4", TASK_STATS_TCP },
     { "busy", TASK_STATS_BUSY_NETWORKS }, { "torr", TASK_STATS_TORRENTS }, { "fscr", TASK_STATS_FULLSCRAPE },
     { "s24s", TASK_STATS_SLASH24S }, { "tpbs", TASK_STATS_TPB }, { "herr", TASK_STATS_HTTPERRORS }, { "completed", TASK_STATS_COMPLETED },
     { "top100", TASK_STATS_TOP100 }, { "top10", TASK_STATS_TOP10 }, { "renew", TASK_STATS_RENEW }, { "syncs", TASK_STATS_SYNCS }, { "version", TASK_STATS_VERSION },
     { "everything", TASK_STATS_EVERYTHING }, { "statedump", TASK_FULLSCRAPE_TRACKERSTATE }, { "fulllog", TASK_STATS_FULLLOG },
-    { "woodpeckers", TASK_STATS_WOODPECKERS},
+    { "woodpeckers", TASK_STATS_WOODPECKERS}, { "stalls", TASK_STATS_STALLS },
+    { "udpbatch", TASK_STATS_UDP_BATCH }, { "clean", TASK_STATS_CLEAN }, { "cleanrate", TASK_STATS_CLEAN_RATE },
+    { "snapshot", TASK_STATS_SNAPSHOT }, { "accesslist", TASK_STATS_ACCESSLIST },
 #ifdef WANT_LOG_NUMWANT
     { "numwants", TASK_STATS_NUMWANTS},
 #endif
@@ -187,9 +326,12 @@ static const ot_keywords keywords_format[] =
     { "txt", TASK_FULLSCRAPE_TPB_ASCII }, { NULL, -3 } };
 
   int mode = TASK_STATS_PEERS, scanon = 1, format = 0;
+  ot_time since = 0;
+  char *write_ptr;
+  ssize_t len;
 
 #ifdef WANT_RESTRICT_STATS
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = http_getcookie( sock, ws );
 
   if( !cookie || !accesslist_isblessed( cookie->ip, OT_PERMISSION_MAY_STAT ) )
     HTTPERROR_403_IP;
@@ -206,6 +348,10 @@ static const ot_keywords keywords_format[] =
     case  2: /* matched "format" */
       if( ( format = scan_find_keywords( keywords_format, &read_ptr, SCAN_SEARCHPATH_VALUE ) ) <= 0 ) HTTPERROR_400_PARAM;
       break;
+    case  3: /* matched "since" */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( ( len <= 0 ) || scan_fixed_time( write_ptr, len, &since ) ) HTTPERROR_400_PARAM;
+      break;
     }
   }
 
@@ -215,8 +361,15 @@ static const ot_keywords keywords_format[] =
   }
 
   if( mode == TASK_STATS_TPB ) {
-    struct http_data* cookie = io_getcookie( sock );
-    tai6464 t;
+    struct http_data* cookie = http_getcookie( sock, ws );
+#ifdef WANT_COMPRESSION_ZSTD
+    ws->request[ws->request_size] = 0;
+    if( strstr( read_ptr - 1, "zstd" ) ) {
+      cookie->flag |= STRUCT_HTTP_FLAG_ZSTD;
+      format |= TASK_FLAG_ZSTD;
+    } else
+#endif
+    {
 #ifdef WANT_COMPRESSION_GZIP
     ws->request[ws->request_size] = 0;
 #ifdef WANT_COMPRESSION_GZIP_ALWAYS
@@ -228,22 +381,29 @@ static const ot_keywords keywords_format[] =
     }
 #endif
 #endif
+    }
     /* Pass this task to the worker thread */
     cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
 
     /* Clients waiting for us should not easily timeout */
-    taia_uint( &t, 0 ); io_timeout( sock, t );
-    fullscrape_deliver( sock, format );
-    io_dontwantread( sock );
+    http_timeout( sock, ws, 0 );
+    fullscrape_deliver( sock, format, since );
+    http_dontwantread( sock, ws );
     return ws->reply_size = -2;
   }
 #endif
 
+  /* Writing snapshots is expensive, never let just anyone trigger it */
+  if( mode == TASK_STATS_SNAPSHOT ) {
+    struct http_data *cookie = http_getcookie( sock, ws );
+    if( !cookie || !accesslist_isblessed( cookie->ip, OT_PERMISSION_MAY_STAT ) )
+      HTTPERROR_403_IP;
+  }
+
   /* default format for now */
   if( ( mode & TASK_CLASS_MASK ) == TASK_STATS ) {
-    tai6464 t;
     /* Complex stats also include expensive memory debugging tools */
-    taia_uint( &t, 0 ); io_timeout( sock, t );
+    http_timeout( sock, ws, 0 );
     stats_deliver( sock, mode );
     return ws->reply_size = -2;
   }
@@ -259,10 +419,9 @@ typedef struct { ot_ip6 ip; ot_time last_fullscrape; } ot_scrape_log;
 #endif
 
 #ifdef WANT_FULLSCRAPE
-static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data* cookie = io_getcookie( sock );
+static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *ws, ot_time since ) {
+  struct http_data* cookie = http_getcookie( sock, ws );
   int format = 0;
-  tai6464 t;
 
 #ifdef WANT_MODEST_FULLSCRAPES
   {
@@ -285,15 +444,25 @@ static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *w
   }
 #endif
 
-#ifdef WANT_COMPRESSION_GZIP
+#ifdef WANT_COMPRESSION_ZSTD
   ws->request[ws->request_size-1] = 0;
-  if( strstr( ws->request, "gzip" ) ) {
-    cookie->flag |= STRUCT_HTTP_FLAG_GZIP;
-    format = TASK_FLAG_GZIP;
-    stats_issue_event( EVENT_FULLSCRAPE_REQUEST_GZIP, 0, (uintptr_t)cookie->ip );
+  if( strstr( ws->request, "zstd" ) ) {
+    cookie->flag |= STRUCT_HTTP_FLAG_ZSTD;
+    format = TASK_FLAG_ZSTD;
+    stats_issue_event( EVENT_FULLSCRAPE_REQUEST_ZSTD, 0, (uintptr_t)cookie->ip );
   } else
 #endif
-    stats_issue_event( EVENT_FULLSCRAPE_REQUEST, 0, (uintptr_t)cookie->ip );
+  {
+#ifdef WANT_COMPRESSION_GZIP
+    ws->request[ws->request_size-1] = 0;
+    if( strstr( ws->request, "gzip" ) ) {
+      cookie->flag |= STRUCT_HTTP_FLAG_GZIP;
+      format = TASK_FLAG_GZIP;
+      stats_issue_event( EVENT_FULLSCRAPE_REQUEST_GZIP, 0, (uintptr_t)cookie->ip );
+    } else
+#endif
+      stats_issue_event( EVENT_FULLSCRAPE_REQUEST, 0, (uintptr_t)cookie->ip );
+  }
 
 #ifdef _DEBUG_HTTPERROR
   fprintf( stderr, "%s", ws->debugbuf );
@@ -302,18 +471,21 @@ static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *w
   /* Pass this task to the worker thread */
   cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
   /* Clients waiting for us should not easily timeout */
-  taia_uint( &t, 0 ); io_timeout( sock, t );
-  fullscrape_deliver( sock, TASK_FULLSCRAPE | format );
-  io_dontwantread( sock );
+  http_timeout( sock, ws, 0 );
+  fullscrape_deliver( sock, TASK_FULLSCRAPE | format, since );
+  http_dontwantread( sock, ws );
   return ws->reply_size = -2;
 }
 #endif
 
 static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, char *read_ptr ) {
-  static const ot_keywords keywords_scrape[] = { { "info_hash", 1 }, { NULL, -3 } };
+  static const ot_keywords keywords_scrape[] = { { "info_hash", 1 }, { "since", 2 }, { NULL, -3 } };
 
   ot_hash * multiscrape_buf = (ot_hash*)ws->request;
   int scanon = 1, numwant = 0;
+  ot_time since = -1;
+  char *write_ptr;
+  ssize_t len;
 
   /* This is to hack around stupid clients that send "scrape ?info_hash" */
   if( read_ptr[-1] != '?' ) {
@@ -332,9 +504,19 @@ static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, c
       if( scan_urlencoded_query( &read_ptr, (char*)(multiscrape_buf + numwant++), SCAN_SEARCHPATH_VALUE ) != (ssize_t)sizeof(ot_hash) )
         HTTPERROR_400_PARAM;
       break;
+    case  2: /* matched "since" */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( ( len <= 0 ) || scan_fixed_time( write_ptr, len, &since ) ) HTTPERROR_400_PARAM;
+      break;
     }
   }
 
+#ifdef WANT_FULLSCRAPE
+  /* No info_hash, but a point in time: full scrape of what changed since */
+  if( !numwant && since >= 0 )
+    return http_handle_fullscrape( sock, ws, since );
+#endif
+
   /* No info_hash found? Inform user */
   if( !numwant ) HTTPERROR_400_PARAM;
 
@@ -348,6 +530,59 @@ static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, c
   return ws->reply_size;
 }
 
+#ifdef WANT_ACCESSLIST
+static ssize_t http_handle_accesslist( const int64 sock, struct ot_workstruct *ws, char *read_ptr ) {
+  static const ot_keywords keywords_accesslist[] = { { "add", 1 }, { "remove", 2 }, { NULL, -3 } };
+
+  struct http_data *cookie = http_getcookie( sock, ws );
+  ot_hash *hashes = (ot_hash*)ws->request, hash;
+  uint8_t  remove[OT_ACCESSLIST_UPDATE_MAX];
+  int      scanon = 1, count = 0, i;
+  ssize_t  changed;
+  size_t   removed;
+  char    *write_ptr;
+  ssize_t  len;
+
+  if( !cookie || !accesslist_isblessed( cookie->ip, OT_PERMISSION_MAY_ACCESSLIST ) )
+    HTTPERROR_403_IP;
+
+  while( scanon ) {
+    int what = scan_find_keywords( keywords_accesslist, &read_ptr, SCAN_SEARCHPATH_PARAM );
+    switch( what ) {
+    case -2: scanon = 0; break;   /* TERMINATOR */
+    default: HTTPERROR_400_PARAM; /* PARSE ERROR */
+    case -3: scan_urlencoded_skipvalue( &read_ptr ); break;
+    case  1: /* matched "add" */
+    case  2: /* matched "remove" */
+      if( count == OT_ACCESSLIST_UPDATE_MAX ) HTTPERROR_400_PARAM;
+      /* Take info_hashes url encoded like in announces, or in hex */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( len == (ssize_t)sizeof(ot_hash) )
+        memcpy( hash, write_ptr, sizeof(ot_hash) );
+      else if( len == 2 * (ssize_t)sizeof(ot_hash) ) {
+        for( i=0; i<(int)sizeof(ot_hash); ++i ) {
+          int eger1 = scan_fromhex( write_ptr[ 2*i ] );
+          int eger2 = scan_fromhex( write_ptr[ 1 + 2*i ] );
+          if( eger1 < 0 || eger2 < 0 ) HTTPERROR_400_PARAM;
+          hash[i] = eger1 * 16 + eger2;
+        }
+      } else
+        HTTPERROR_400_PARAM;
+      /* Hashes end up before the request still to be parsed */
+      memmove( hashes + count, hash, sizeof(ot_hash) );
+      remove[count++] = what == 2;
+      break;
+    }
+  }
+
+  if( !count ) HTTPERROR_400_PARAM;
+  if( ( changed = accesslist_update( (const ot_hash*)hashes, remove, count, &removed ) ) < 0 ) HTTPERROR_500;
+
+  /* Hashes already listed or already missing do not count */
+  return ws->reply_size = sprintf( ws->reply, "Accesslist updated, %zu info_hashes added and %zu removed.\n", (size_t)changed - removed, removed );
+}
+#endif
+
 #ifdef WANT_LOG_NUMWANT
   unsigned long long numwants[201];
 #endif
@@ -382,7 +617,7 @@ static ssize_t http_handle_announce( const int64 sock, struct ot_workstruct *ws,
   unsigned short    port = 0;
   char             *write_ptr;
   ssize_t           len;
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = http_getcookie( sock, ws );
 
   /* This is to hack around stupid clients that send "announce ?info_hash" */
   if( read_ptr[-1] != '?' ) {
@@ -532,7 +767,7 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   char   *read_ptr = ws->request, *write_ptr;
 
 #ifdef WANT_FULLLOG_NETWORKS
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = http_getcookie( sock, ws );
   if( loglist_check_address( cookie->ip ) ) {
     ot_log *log = malloc( sizeof( ot_log ) );
     if( log ) {
@@ -587,7 +822,7 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
     http_handle_announce( sock, ws, read_ptr );
 #ifdef WANT_FULLSCRAPE
   else if( !memcmp( write_ptr, "scrape HTTP/", 12 ) )
-    http_handle_fullscrape( sock, ws );
+    http_handle_fullscrape( sock, ws, 0 );
 #endif
   /* This is the hardcore match for scrape */
   else if( !memcmp( write_ptr, "sc", 2 ) )
@@ -595,6 +830,10 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   /* All the rest is matched the standard way */
   else if( len == g_stats_path_len && !memcmp( write_ptr, g_stats_path, len ) )
     http_handle_stats( sock, ws, read_ptr );
+#ifdef WANT_ACCESSLIST
+  else if( len == sizeof(OT_ACCESSLIST_PATH) - 1 && !memcmp( write_ptr, OT_ACCESSLIST_PATH, len ) )
+    http_handle_accesslist( sock, ws, read_ptr );
+#endif
   else
     HTTPERROR_404;
 
@@ -617,15 +856,16 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
      plus dynamic space needed to expand our Content-Length value. We reserve SUCCESS_HTTP_SIZE_OFF for its expansion and calculate
      the space NOT needed to expand in reply_off
   */
-  reply_off = SUCCESS_HTTP_SIZE_OFF - snprintf( ws->outbuf, 0, "%zd", ws->reply_size );
+  reply_off = SUCCESS_HTTP_SIZE_OFF - format_u64_length( ws->reply_size );
   ws->reply = ws->outbuf + reply_off;
 
-  /* 2. Now we sprintf our header so that sprintf writes its terminating '\0' exactly one byte before content starts. Complete
-     packet size is increased by size of header plus one byte '\n', we will copy over '\0' in next step */
-  ws->reply_size += 1 + sprintf( ws->reply, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zd\r\n\r", ws->reply_size );
-
-  /* 3. Finally we join both blocks neatly */
-  ws->outbuf[ SUCCESS_HTTP_HEADER_LENGTH - 1 ] = '\n';
+  /* 2. Now we write our header so that its final '\n' lands exactly one byte before content starts. Complete packet size is
+     increased by size of header */
+  write_ptr  = ws->reply;
+  write_ptr += FORMAT_LITERAL( write_ptr, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " );
+  write_ptr += format_u64( write_ptr, ws->reply_size );
+  write_ptr += FORMAT_LITERAL( write_ptr, "\r\n\r\n" );
+  ws->reply_size += write_ptr - ws->reply;
 
   http_senddata( sock, ws );
   return ws->reply_size;
@@ -9,7 +9,8 @@
 typedef enum {
   STRUCT_HTTP_FLAG_WAITINGFORTASK = 1,
   STRUCT_HTTP_FLAG_GZIP           = 2,
-  STRUCT_HTTP_FLAG_BZIP2          = 4
+  STRUCT_HTTP_FLAG_BZIP2          = 4,
+  STRUCT_HTTP_FLAG_ZSTD           = 8
 } STRUCT_HTTP_FLAG;
 
 struct http_data {
@@ -17,10 +18,19 @@ struct http_data {
   io_batch         batch;
   ot_ip6           ip;
   STRUCT_HTTP_FLAG flag;
+  struct ot_shared_iovec *shared; /* Reply data this connection sends in place */
 };
 
+size_t  http_header_complete( char * request, ssize_t byte_count );
+
+/* Connection handling shared by the main loop and the tcp worker loops.
+   http_handle_read expects byte_count bytes just read into ws->inbuf */
+struct http_data *http_newcookie( ot_ip6 ip );
+void    http_handle_dead( const int64 s, struct ot_workstruct *ws );
+void    http_handle_read( const int64 s, struct ot_workstruct *ws, ssize_t byte_count );
+void    http_handle_write( const int64 s, struct ot_workstruct *ws );
 ssize_t http_handle_request( const int64 s, struct ot_workstruct *ws );
-ssize_t http_sendiovecdata( const int64 s, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector );
+ssize_t http_sendiovecdata( const int64 s, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector, struct ot_shared_iovec *shared, ot_time since );
 ssize_t http_issue_error( const int64 s, struct ot_workstruct *ws, int code );
 
 extern char   *g_stats_path;
@@ -65,6 +65,39 @@ void  *iovec_fix_increase_or_free( int *iovec_entries, struct iovec **iovector,
 }
 
 
+/* Takes over the iovecs and seals them read only, the caller holds the
+   first reference. Returns NULL and leaves the iovecs alone on failure */
+ot_shared_iovec *iovec_share( int *iovec_entries, struct iovec **iovector ) {
+  ot_shared_iovec *shared = malloc( sizeof( ot_shared_iovec ) );
+  int i;
+
+  if( !shared )
+    return NULL;
+
+  for( i=0; i<*iovec_entries; ++i )
+    mprotect( ((*iovector)[i]).iov_base, ((*iovector)[i]).iov_len, PROT_READ );
+
+  shared->refcount      = 1;
+  shared->iovec_entries = *iovec_entries;
+  shared->iovector      = *iovector;
+  *iovec_entries = 0;
+  *iovector      = NULL;
+  return shared;
+}
+
+ot_shared_iovec *iovec_share_ref( ot_shared_iovec *shared ) {
+  __sync_fetch_and_add( &shared->refcount, 1 );
+  return shared;
+}
+
+void iovec_share_release( ot_shared_iovec *shared ) {
+  if( __sync_sub_and_fetch( &shared->refcount, 1 ) )
+    return;
+  iovec_free( &shared->iovec_entries, &shared->iovector );
+  free( shared->iovector );
+  free( shared );
+}
+
 size_t iovec_length( int *iovec_entries, struct iovec **iovector ) {
   size_t length = 0;
   int i;
@@ -16,4 +16,16 @@ size_t iovec_length( int *iovec_entries, struct iovec **iovector );
 
 void  *iovec_fix_increase_or_free( int *iovec_entries, struct iovec **iovector, void *last_ptr, size_t new_alloc );
 
+/* Immutable iovecs shared by several readers. Whoever drops the last
+   reference unmaps them */
+typedef struct ot_shared_iovec {
+  int           refcount;
+  int           iovec_entries;
+  struct iovec *iovector;
+} ot_shared_iovec;
+
+ot_shared_iovec *iovec_share( int *iovec_entries, struct iovec **iovector );
+ot_shared_iovec *iovec_share_ref( ot_shared_iovec *shared );
+void             iovec_share_release( ot_shared_iovec *shared );
+
 #endif
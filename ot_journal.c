@@ -0,0 +1,369 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <pthread.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* Libowfat */
+#include "byte.h"
+#include "io.h"
+#include "mmap.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_mutex.h"
+#include "ot_vector.h"
+#include "ot_accesslist.h"
+#include "ot_journal.h"
+
+char *g_journal_filename;
+
+/* Announces queue records here, the journal thread swaps in the spare
+   buffer once a second and writes out the full one */
+static pthread_mutex_t    journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ot_journal_record *journal_queue, *journal_spare;
+static size_t             journal_queue_fill, journal_queue_space, journal_spare_space;
+
+static int                journal_fd = -1;
+static off_t              journal_size;
+static off_t              journal_compact_size = OT_JOURNAL_COMPACT_SIZE;
+static int                journal_replayed;
+
+/* Torn or garbled records at the end of a journal must not be replayed */
+static uint32_t journal_check( const ot_journal_record *record ) {
+  const uint8_t *data = (const uint8_t *)record;
+  uint32_t       check = 2166136261U;
+  size_t         i;
+  for( i=0; i<sizeof(ot_journal_record); ++i )
+    if( i < offsetof( ot_journal_record, check ) || i >= offsetof( ot_journal_record, down_count ) )
+      check = ( check ^ data[i] ) * 16777619U;
+  return check;
+}
+
+static void journal_fill_record( ot_journal_record *record, const ot_hash hash, size_t down_count, ot_time base ) {
+  byte_zero( record, sizeof(ot_journal_record) );
+  memcpy( record->hash, hash, sizeof(ot_hash) );
+  record->down_count = down_count;
+  record->base       = base;
+  record->check      = journal_check( record );
+}
+
+void journal_log( const ot_hash hash, size_t down_count, ot_time base ) {
+  if( !g_journal_filename )
+    return;
+
+  pthread_mutex_lock( &journal_mutex );
+  if( journal_queue_fill == journal_queue_space ) {
+    size_t             new_space = journal_queue_space ? 2 * journal_queue_space : 1024;
+    ot_journal_record *new_queue = realloc( journal_queue, new_space * sizeof(ot_journal_record) );
+    if( !new_queue ) {
+      pthread_mutex_unlock( &journal_mutex );
+      return;
+    }
+    journal_queue       = new_queue;
+    journal_queue_space = new_space;
+  }
+  journal_fill_record( journal_queue + journal_queue_fill++, hash, down_count, base );
+  pthread_mutex_unlock( &journal_mutex );
+}
+
+static int journal_write_all( int fd, const void *data, size_t size ) {
+  const char *p = data;
+  while( size ) {
+    ssize_t written = write( fd, p, size );
+    if( written < 0 )
+      return -1;
+    p    += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/* Opens a journal file for appending, fresh files get a header */
+static int journal_open( const char *filename, int flags, off_t *size ) {
+  ot_journal_header header;
+  struct stat       st;
+  int               fd = open( filename, O_WRONLY | O_CREAT | flags, 0644 );
+
+  if( fd < 0 || fstat( fd, &st ) ) {
+    fprintf( stderr, "Warning: Can't open journal %s for writing.\n", filename );
+    if( fd >= 0 ) close( fd );
+    return -1;
+  }
+
+  if( !st.st_size ) {
+    byte_zero( &header, sizeof(header) );
+    memcpy( header.magic, OT_JOURNAL_MAGIC, sizeof(header.magic) );
+    header.version     = OT_JOURNAL_VERSION;
+    header.record_size = sizeof(ot_journal_record);
+    if( journal_write_all( fd, &header, sizeof(header) ) ) {
+      close( fd );
+      return -1;
+    }
+    st.st_size = sizeof(header);
+  }
+
+  /* Cut off a record torn by a crash, else all new ones would be garbled */
+  if( st.st_size > (off_t)sizeof(header) && ( st.st_size - sizeof(header) ) % sizeof(ot_journal_record) ) {
+    st.st_size -= ( st.st_size - sizeof(header) ) % sizeof(ot_journal_record);
+    if( ftruncate( fd, st.st_size ) ) {
+      close( fd );
+      return -1;
+    }
+  }
+  *size = st.st_size;
+  return fd;
+}
+
+/* Puts records that could not be written back in front of the queue */
+static void journal_requeue( const ot_journal_record *records, size_t count ) {
+  pthread_mutex_lock( &journal_mutex );
+  if( journal_queue_fill + count > OT_JOURNAL_REQUEUE_MAX ) {
+    pthread_mutex_unlock( &journal_mutex );
+    fprintf( stderr, "Warning: Journal %s can not be written, dropping %zd records.\n", g_journal_filename, count );
+    return;
+  }
+  if( journal_queue_fill + count > journal_queue_space ) {
+    ot_journal_record *new_queue = realloc( journal_queue, ( journal_queue_fill + count ) * sizeof(ot_journal_record) );
+    if( !new_queue ) {
+      pthread_mutex_unlock( &journal_mutex );
+      fprintf( stderr, "Warning: Journal %s can not be written, dropping %zd records.\n", g_journal_filename, count );
+      return;
+    }
+    journal_queue       = new_queue;
+    journal_queue_space = journal_queue_fill + count;
+  }
+  memmove( journal_queue + count, journal_queue, journal_queue_fill * sizeof(ot_journal_record) );
+  memcpy( journal_queue, records, count * sizeof(ot_journal_record) );
+  journal_queue_fill += count;
+  pthread_mutex_unlock( &journal_mutex );
+}
+
+/* Group commit: everything queued during the last second hits the disk
+   with one write and one sync */
+static void journal_flush( void ) {
+  ot_journal_record *records;
+  size_t             count, space;
+
+  pthread_mutex_lock( &journal_mutex );
+  records = journal_queue;
+  count   = journal_queue_fill;
+  space   = journal_queue_space;
+  journal_queue       = journal_spare;
+  journal_queue_space = journal_spare_space;
+  journal_queue_fill  = 0;
+  pthread_mutex_unlock( &journal_mutex );
+
+  journal_spare       = records;
+  journal_spare_space = space;
+
+  if( !count )
+    return;
+
+  /* The journal could not be opened at start or after compaction */
+  if( journal_fd < 0 )
+    journal_fd = journal_open( g_journal_filename, O_APPEND, &journal_size );
+
+  if( journal_fd < 0 || journal_write_all( journal_fd, records, count * sizeof(ot_journal_record) ) || fsync( journal_fd ) ) {
+    fprintf( stderr, "Warning: Writing journal %s failed, retrying.\n", g_journal_filename );
+    /* A partial record would garble all records appended after it */
+    if( journal_fd >= 0 && ftruncate( journal_fd, journal_size ) ) {
+      close( journal_fd );
+      journal_fd = -1;
+    }
+    journal_requeue( records, count );
+    return;
+  }
+  journal_size += count * sizeof(ot_journal_record);
+}
+
+/* Writes the download counts of all torrents into a fresh file */
+static int journal_write_compact( const char *filename ) {
+  ot_journal_record *records = NULL;
+  size_t             space = 0;
+  off_t              size;
+  int                bucket, fd = journal_open( filename, O_TRUNC, &size ), result = 0;
+
+  if( fd < 0 )
+    return -1;
+
+  for( bucket=0; bucket<OT_BUCKET_COUNT && !result; ++bucket ) {
+    const ot_vector *torrents_list = mutex_bucket_lock_shared( bucket );
+    ot_torrent      *torrent = (ot_torrent*)(torrents_list->data);
+    size_t           j, count = 0;
+
+    if( torrents_list->size > space ) {
+      ot_journal_record *new_records = realloc( records, torrents_list->size * sizeof(ot_journal_record) );
+      if( !new_records ) {
+        mutex_bucket_unlock( bucket, 0 );
+        result = -1;
+        break;
+      }
+      records = new_records;
+      space   = torrents_list->size;
+    }
+
+    /* Torrents without downloads would not survive their peers anyway */
+    for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j, ++torrent )
+      if( OT_TORRENT_SLOT_USED( torrent ) && torrent->peer_list->down_count )
+        journal_fill_record( records + count++, torrent->hash, torrent->peer_list->down_count, torrent->peer_list->base );
+    mutex_bucket_unlock( bucket, 0 );
+
+    if( count && journal_write_all( fd, records, count * sizeof(ot_journal_record) ) )
+      result = -1;
+  }
+
+  free( records );
+  if( fsync( fd ) )
+    result = -1;
+  close( fd );
+  return result;
+}
+
+static void journal_compact( void ) {
+  char oldname[512], compactname[512], tmpname[512];
+
+  if( snprintf( oldname, sizeof(oldname), "%s.1", g_journal_filename ) >= (int)sizeof(oldname) ||
+      snprintf( compactname, sizeof(compactname), "%s.compact", g_journal_filename ) >= (int)sizeof(compactname) ||
+      snprintf( tmpname, sizeof(tmpname), "%s.compact.tmp", g_journal_filename ) >= (int)sizeof(tmpname) )
+    return;
+
+  /* A previous compaction that did not finish left <journal>.1 behind,
+     keep that until a compacted state covers it */
+  if( access( oldname, F_OK ) ) {
+    close( journal_fd );
+    if( rename( g_journal_filename, oldname ) ) {
+      journal_fd = journal_open( g_journal_filename, O_APPEND, &journal_size );
+      return;
+    }
+    /* If this fails, journal_flush tries again */
+    if( ( journal_fd = journal_open( g_journal_filename, O_APPEND, &journal_size ) ) < 0 )
+      fprintf( stderr, "Warning: Can't reopen journal %s after moving it away, retrying.\n", g_journal_filename );
+  }
+
+  /* Memory holds everything in <journal>.1 and the old compacted state */
+  if( journal_write_compact( tmpname ) || rename( tmpname, compactname ) ) {
+    fprintf( stderr, "Warning: Compacting journal %s failed.\n", g_journal_filename );
+    unlink( tmpname );
+    return;
+  }
+  unlink( oldname );
+}
+
+static void journal_replay_torrent( const ot_journal_record *record ) {
+  ot_vector  *torrents_list = mutex_bucket_lock_by_hash( (uint8_t*)record->hash );
+  ot_torrent *torrent;
+  int         exactmatch, delta_torrentcount = 0;
+
+  if( !accesslist_hashisvalid( (uint8_t*)record->hash ) )
+    return mutex_bucket_unlock_by_hash( (uint8_t*)record->hash, 0 );
+
+  torrent = vector_find_or_insert_torrent( torrents_list, record->hash, &exactmatch );
+  if( !torrent )
+    return mutex_bucket_unlock_by_hash( (uint8_t*)record->hash, 0 );
+
+  if( !exactmatch ) {
+    if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
+      vector_remove_torrent( torrents_list, torrent );
+      return mutex_bucket_unlock_by_hash( (uint8_t*)record->hash, 0 );
+    }
+    byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
+    torrent->peer_list->base    = record->base;
+    torrent->peer_list->changed = g_now_seconds;
+    delta_torrentcount = 1;
+  }
+
+  if( record->down_count > torrent->peer_list->down_count ) {
+    torrent->peer_list->down_count = record->down_count;
+    torrent->peer_list->changed    = g_now_seconds;
+  }
+  mutex_bucket_unlock_by_hash( (uint8_t*)record->hash, delta_torrentcount );
+}
+
+static void journal_replay_file( const char *filename ) {
+  const ot_journal_header *header;
+  const ot_journal_record *records;
+  const char              *map;
+  size_t                   size, count, i;
+
+  if( !( map = mmap_read( filename, &size ) ) )
+    return;
+
+  header = (const ot_journal_header *)map;
+  if( size < sizeof(*header) || memcmp( header->magic, OT_JOURNAL_MAGIC, sizeof(header->magic) ) ||
+      header->version != OT_JOURNAL_VERSION || header->record_size != sizeof(ot_journal_record) ) {
+    fprintf( stderr, "Warning: %s is no journal of this opentracker, ignoring it.\n", filename );
+    mmap_unmap( map, size );
+    return;
+  }
+
+  records = (const ot_journal_record *)( header + 1 );
+  count   = ( size - sizeof(*header) ) / sizeof(ot_journal_record);
+  for( i=0; i<count; ++i )
+    if( records[i].check == journal_check( records + i ) )
+      journal_replay_torrent( records + i );
+
+  mmap_unmap( map, size );
+}
+
+void journal_replay( void ) {
+  char filename[512];
+
+  if( g_journal_filename ) {
+    if( snprintf( filename, sizeof(filename), "%s.compact", g_journal_filename ) < (int)sizeof(filename) )
+      journal_replay_file( filename );
+    if( snprintf( filename, sizeof(filename), "%s.1", g_journal_filename ) < (int)sizeof(filename) )
+      journal_replay_file( filename );
+    journal_replay_file( g_journal_filename );
+  }
+  journal_replayed = 1;
+}
+
+static void * journal_worker( void * args ) {
+  (void)args;
+
+  while( 1 ) {
+    sleep( 1 );
+    journal_flush( );
+
+    /* Compacting before replay had merged the journal would lose it */
+    if( journal_replayed && journal_fd >= 0 && journal_size > journal_compact_size ) {
+      journal_compact( );
+      /* Whatever the outcome, do not retry before the journal grew again */
+      journal_compact_size = journal_size + OT_JOURNAL_COMPACT_SIZE;
+    }
+  }
+  return NULL;
+}
+
+static pthread_t thread_id;
+static int       thread_running;
+void journal_init( void ) {
+  if( !g_journal_filename )
+    return;
+  journal_fd     = journal_open( g_journal_filename, O_APPEND, &journal_size );
+  thread_running = !pthread_create( &thread_id, NULL, journal_worker, NULL );
+}
+
+void journal_deinit( void ) {
+  if( thread_running ) {
+    pthread_cancel( thread_id );
+    pthread_join( thread_id, NULL );
+    journal_flush( );
+  }
+  thread_running = 0;
+  if( journal_fd >= 0 )
+    close( journal_fd );
+  journal_fd = -1;
+}
+
+const char *g_version_journal_c = "$Source$: $Revision$\n";
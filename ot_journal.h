@@ -0,0 +1,51 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_JOURNAL_H__
+#define __OT_JOURNAL_H__
+
+/* The journal is an append only log of download counters, so that they
+   survive crashes. Announces only queue a record, once a second the
+   journal thread appends all queued records and syncs them to disk.
+   Records hold the counter's new value instead of an increment, replaying
+   them takes the maximum and thus does no harm if repeated.
+
+   Once the journal grows beyond OT_JOURNAL_COMPACT_SIZE, it is moved to
+   <journal>.1 and all current counters are written to <journal>.compact,
+   after which <journal>.1 is removed. Replay reads all three files */
+#define OT_JOURNAL_MAGIC        "OTJOURNL"
+#define OT_JOURNAL_VERSION      1
+#define OT_JOURNAL_COMPACT_SIZE ( 64 * 1024 * 1024 )
+
+/* Records kept queued while the journal can not be written */
+#define OT_JOURNAL_REQUEUE_MAX  ( 1024 * 1024 )
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t record_size;
+} ot_journal_header;
+
+typedef struct {
+  ot_hash  hash;
+  uint32_t check;
+  uint64_t down_count;
+  int64_t  base;
+} ot_journal_record;
+
+/* Journal file, no journal is written if unset */
+extern char *g_journal_filename;
+
+void journal_init( void );
+void journal_deinit( void );
+
+/* Queues a torrent's new download count, called with its bucket locked.
+   New torrents are logged with their count of 0 */
+void journal_log( const ot_hash hash, size_t down_count, ot_time base );
+
+/* Merges all journal files into the torrents loaded so far */
+void journal_replay( void );
+
+#endif
@@ -166,6 +166,7 @@ static void * livesync_worker( void * args ) {
   /* Initialize our "thread local storage" */
   ws.inbuf   = ws.request = malloc( LIVESYNC_INCOMING_BUFFSIZE );
   ws.outbuf  = ws.reply   = 0;
+  ot_random_seed( &ws );
   
   memcpy( in_ip, V4mappedprefix, sizeof( V4mappedprefix ) );
 
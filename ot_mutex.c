@@ -4,11 +4,14 @@
    $id$ */
 
 /* System */
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <unistd.h>
 
 /* Libowfat */
 #include "byte.h"
@@ -19,72 +22,58 @@
 #include "trackerlogic.h"
 #include "ot_mutex.h"
 #include "ot_stats.h"
+#include "ot_iovec.h"
 
 /* #define MTX_DBG( STRING ) fprintf( stderr, STRING ) */
 #define MTX_DBG( STRING )
 
 /* Our global all torrents list */
-static ot_vector all_torrents[OT_BUCKET_COUNT];
-static size_t    g_torrent_count;
+static ot_vector *all_torrents;
+static size_t     g_torrent_count;
+int               g_bucket_count_bits = OT_BUCKET_COUNT_BITS_DEFAULT;
 
-/* Bucket Magic */
-static int bucket_locklist[ OT_MAX_THREADS ];
-static int bucket_locklist_count = 0;
-static pthread_mutex_t bucket_mutex;
-static pthread_cond_t bucket_being_unlocked;
+/* Bucket Magic: each bucket has a lock of its own, so threads only ever
+   contend if they actually need the same bucket. Readers, like scrapes
+   and statistics, share the lock, writers need it exclusively */
+static pthread_rwlock_t *bucket_lock;
+static unsigned long    *bucket_stalls;
+static unsigned long     bucket_stalls_total;
+
+/* Background threads, like the cleaners, still show up in the per bucket
+   stalls but not in the total, which tells how often requests waited */
+static __thread int      bucket_stalls_background;
 
 /* Self pipe from opentracker.c */
 extern int g_self_pipe[2];
 
-static int bucket_check( int bucket ) {
-  /* C should come with auto-i ;) */
-  int i;
-
-  /* No more space to acquire lock to bucket -- should not happen */
-  if( bucket_locklist_count == OT_MAX_THREADS ) {
-    fprintf( stderr, "More lock requests than mutexes. Consult source code.\n" );
-    return -1;
-  }
-
-  /* See, if bucket is already locked */
-  for( i=0; i<bucket_locklist_count; ++i )
-    if( bucket_locklist[ i ] == bucket ) {
-      stats_issue_event( EVENT_BUCKET_LOCKED, 0, 0 );
-      return -1;
-    }
-
-  return 0;
+static void bucket_stalled( int bucket ) {
+  __sync_fetch_and_add( bucket_stalls + bucket, 1 );
+  if( !bucket_stalls_background )
+    __sync_fetch_and_add( &bucket_stalls_total, 1 );
+  stats_issue_event( EVENT_BUCKET_LOCKED, 0, bucket );
 }
 
-static void bucket_push( int bucket ) {
-  bucket_locklist[ bucket_locklist_count++ ] = bucket;
+/* Can block */
+ot_vector *mutex_bucket_lock( int bucket ) {
+  /* Only fall back to a blocking lock, if someone else holds the bucket */
+  if( pthread_rwlock_trywrlock( bucket_lock + bucket ) ) {
+    bucket_stalled( bucket );
+    pthread_rwlock_wrlock( bucket_lock + bucket );
+  }
+  return all_torrents + bucket;
 }
 
-static void bucket_remove( int bucket ) {
-  int i = 0;
-
-  while( ( i < bucket_locklist_count ) && ( bucket_locklist[ i ] != bucket ) )
-    ++i;
-
-  if( i == bucket_locklist_count ) {
-    fprintf( stderr, "Request to unlock bucket that was never locked. Consult source code.\n" );
-    return;
+/* Can block, but only behind writers */
+const ot_vector *mutex_bucket_lock_shared( int bucket ) {
+  if( pthread_rwlock_tryrdlock( bucket_lock + bucket ) ) {
+    bucket_stalled( bucket );
+    pthread_rwlock_rdlock( bucket_lock + bucket );
   }
-
-  for( ; i < bucket_locklist_count - 1; ++i )
-    bucket_locklist[ i ] = bucket_locklist[ i + 1 ];
-
-  --bucket_locklist_count;
+  return all_torrents + bucket;
 }
 
-/* Can block */
-ot_vector *mutex_bucket_lock( int bucket ) {
-  pthread_mutex_lock( &bucket_mutex );
-  while( bucket_check( bucket ) )
-    pthread_cond_wait( &bucket_being_unlocked, &bucket_mutex );
-  bucket_push( bucket );
-  pthread_mutex_unlock( &bucket_mutex );
-  return all_torrents + bucket;
+const ot_vector *mutex_bucket_lock_shared_by_hash( ot_hash hash ) {
+  return mutex_bucket_lock_shared( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT );
 }
 
 ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) {
@@ -92,11 +81,9 @@ ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) {
 }
 
 void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
-  pthread_mutex_lock( &bucket_mutex );
-  bucket_remove( bucket );
-  g_torrent_count += delta_torrentcount;
-  pthread_cond_broadcast( &bucket_being_unlocked );
-  pthread_mutex_unlock( &bucket_mutex );
+  pthread_rwlock_unlock( bucket_lock + bucket );
+  if( delta_torrentcount )
+    __sync_add_and_fetch( &g_torrent_count, delta_torrentcount );
 }
 
 void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
@@ -104,11 +91,19 @@ void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
 }
 
 size_t mutex_get_torrent_count( ) {
-  size_t torrent_count;
-  pthread_mutex_lock( &bucket_mutex );
-  torrent_count = g_torrent_count;
-  pthread_mutex_unlock( &bucket_mutex );
-  return torrent_count;
+  return __sync_add_and_fetch( &g_torrent_count, 0 );
+}
+
+unsigned long mutex_get_bucket_stalls( int bucket ) {
+  return bucket_stalls[ bucket ];
+}
+
+unsigned long mutex_get_stall_count( void ) {
+  return bucket_stalls_total;
+}
+
+void mutex_bucket_stalls_background( void ) {
+  bucket_stalls_background = 1;
 }
 
 /* TaskQueue Magic */
@@ -117,8 +112,12 @@ struct ot_task {
   ot_taskid       taskid;
   ot_tasktype     tasktype;
   int64           sock;
+  int             wakeup_fd;
+  /* Where a delta scrape starts, on results the tracker time they cover */
+  ot_time         since;
   int             iovec_entries;
   struct iovec   *iovec;
+  ot_shared_iovec *shared;
   struct ot_task *next;
 };
 
@@ -127,7 +126,19 @@ static struct ot_task *tasklist;
 static pthread_mutex_t tasklist_mutex;
 static pthread_cond_t tasklist_being_filled;
 
+/* Pipe of the event loop running in this thread, results of the tasks it
+   pushes are only handed back to it. -1 is the libowfat main loop */
+static __thread int g_loop_wakeup_fd = -1;
+
+void mutex_workqueue_setwakeup( int wakeup_fd ) {
+  g_loop_wakeup_fd = wakeup_fd;
+}
+
 int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
+  return mutex_workqueue_pushtask_since( sock, tasktype, 0 );
+}
+
+int mutex_workqueue_pushtask_since( int64 sock, ot_tasktype tasktype, ot_time since ) {
   struct ot_task ** tmptask, * task;
 
   /* Want exclusive access to tasklist */
@@ -152,8 +163,11 @@ int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
   task->taskid        = 0;
   task->tasktype      = tasktype;
   task->sock          = sock;
+  task->wakeup_fd     = g_loop_wakeup_fd;
+  task->since         = since;
   task->iovec_entries = 0;
   task->iovec         = NULL;
+  task->shared        = NULL;
   task->next          = 0;
 
   /* Inform waiting workers and release lock */
@@ -183,8 +197,11 @@ void mutex_workqueue_canceltask( int64 sock ) {
     int i;
 
     /* Free task's iovec */
-    for( i=0; i<(*task)->iovec_entries; ++i )
-      munmap( iovec[i].iov_base, iovec[i].iov_len );
+    if( (*task)->shared )
+      iovec_share_release( (*task)->shared );
+    else
+      for( i=0; i<(*task)->iovec_entries; ++i )
+        munmap( iovec[i].iov_base, iovec[i].iov_len );
 
     *task = (*task)->next;
     free( ptask );
@@ -197,6 +214,11 @@ void mutex_workqueue_canceltask( int64 sock ) {
 }
 
 ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
+  ot_time since;
+  return mutex_workqueue_poptask_since( tasktype, &since );
+}
+
+ot_taskid mutex_workqueue_poptask_since( ot_tasktype *tasktype, ot_time *since ) {
   struct ot_task * task;
   ot_taskid taskid = 0;
 
@@ -216,6 +238,7 @@ ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
     if( task ) {
       task->taskid = taskid = ++next_free_taskid;
       *tasktype = task->tasktype;
+      *since    = task->since;
     } else {
       /* Wait until the next task is being fed */
       MTX_DBG( "poptask cond waits.\n" );
@@ -256,9 +279,10 @@ void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
   MTX_DBG( "pushsuccess unlocked.\n" );
 }
 
-int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
+static int mutex_workqueue_pushresult_internal( ot_taskid taskid, int iovec_entries, struct iovec *iovec, ot_shared_iovec *shared, ot_time since ) {
   struct ot_task * task;
   const char byte = 'o';
+  int wakeup_fd = -1;
 
   /* Want exclusive access to tasklist */
   MTX_DBG( "pushresult locks.\n" );
@@ -272,7 +296,10 @@ int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iove
   if( task ) {
     task->iovec_entries = iovec_entries;
     task->iovec         = iovec;
+    task->shared        = shared;
+    task->since         = since;
     task->tasktype      = TASK_DONE;
+    wakeup_fd           = task->wakeup_fd;
   }
 
   /* Release lock */
@@ -280,13 +307,30 @@ int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iove
   pthread_mutex_unlock( &tasklist_mutex );
   MTX_DBG( "pushresult unlocked.\n" );
 
-  io_trywrite( g_self_pipe[1], &byte, 1 );
+  /* A full wakeup pipe means a wakeup is pending already */
+  if( wakeup_fd == -1 )
+    io_trywrite( g_self_pipe[1], &byte, 1 );
+  else if( write( wakeup_fd, &byte, 1 ) == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+    fprintf( stderr, "Warning: waking up tcp worker failed: %s\n", strerror( errno ) );
 
   /* Indicate whether the worker has to throw away results */
   return task ? 0 : -1;
 }
 
-int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
+int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
+  return mutex_workqueue_pushresult_internal( taskid, iovec_entries, iovec, NULL, 0 );
+}
+
+int mutex_workqueue_pushresult_since( ot_taskid taskid, int iovec_entries, struct iovec *iovec, ot_time since ) {
+  return mutex_workqueue_pushresult_internal( taskid, iovec_entries, iovec, NULL, since );
+}
+
+/* Hands over one reference to shared */
+int mutex_workqueue_pushresult_shared( ot_taskid taskid, ot_shared_iovec *shared, ot_time since ) {
+  return mutex_workqueue_pushresult_internal( taskid, shared->iovec_entries, shared->iovector, shared, since );
+}
+
+int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec, ot_shared_iovec **shared, ot_time *since ) {
   struct ot_task ** task;
   int64 sock = -1;
 
@@ -296,14 +340,16 @@ int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
   MTX_DBG( "popresult locked.\n" );
 
   task = &tasklist;
-  while( *task && ( (*task)->tasktype != TASK_DONE ) )
+  while( *task && ( ( (*task)->tasktype != TASK_DONE ) || ( (*task)->wakeup_fd != g_loop_wakeup_fd ) ) )
     task = &(*task)->next;
 
-  if( *task && ( (*task)->tasktype == TASK_DONE ) ) {
+  if( *task ) {
     struct ot_task *ptask = *task;
 
     *iovec_entries = (*task)->iovec_entries;
     *iovec         = (*task)->iovec;
+    *shared        = (*task)->shared;
+    *since         = (*task)->since;
     sock           = (*task)->sock;
 
     *task = (*task)->next;
@@ -318,19 +364,35 @@ int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
 }
 
 void mutex_init( ) {
+  pthread_rwlockattr_t attr;
+  int i;
   pthread_mutex_init(&tasklist_mutex, NULL);
   pthread_cond_init (&tasklist_being_filled, NULL);
-  pthread_mutex_init(&bucket_mutex, NULL);
-  pthread_cond_init (&bucket_being_unlocked, NULL);
-  byte_zero( all_torrents, sizeof( all_torrents ) );
+
+  all_torrents  = calloc( OT_BUCKET_COUNT, sizeof( ot_vector ) );
+  bucket_lock   = malloc( OT_BUCKET_COUNT * sizeof( pthread_rwlock_t ) );
+  bucket_stalls = calloc( OT_BUCKET_COUNT, sizeof( unsigned long ) );
+  if( !all_torrents || !bucket_lock || !bucket_stalls )
+    exerr( "Could not allocate torrent buckets." );
+
+  /* Announces must not starve behind an endless stream of scrapes */
+  pthread_rwlockattr_init( &attr );
+#ifdef __GLIBC__
+  pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+#endif
+  for( i=0; i<OT_BUCKET_COUNT; ++i )
+    pthread_rwlock_init( bucket_lock + i, &attr );
+  pthread_rwlockattr_destroy( &attr );
 }
 
 void mutex_deinit( ) {
-  pthread_mutex_destroy(&bucket_mutex);
-  pthread_cond_destroy(&bucket_being_unlocked);
+  int i;
+  for( i=0; i<OT_BUCKET_COUNT; ++i )
+    pthread_rwlock_destroy( bucket_lock + i );
   pthread_mutex_destroy(&tasklist_mutex);
   pthread_cond_destroy(&tasklist_being_filled);
-  byte_zero( all_torrents, sizeof( all_torrents ) );
+  /* Worker threads may still be around, so leave the bucket arrays in place */
+  byte_zero( all_torrents, OT_BUCKET_COUNT * sizeof( ot_vector ) );
 }
 
 const char *g_version_mutex_c = "$Source$: $Revision$\n";
@@ -14,10 +14,19 @@ void mutex_deinit( );
 ot_vector *mutex_bucket_lock( int bucket );
 ot_vector *mutex_bucket_lock_by_hash( ot_hash hash );
 
+/* Shared locks for readers, release them with mutex_bucket_unlock*( x, 0 ) */
+const ot_vector *mutex_bucket_lock_shared( int bucket );
+const ot_vector *mutex_bucket_lock_shared_by_hash( ot_hash hash );
+
 void mutex_bucket_unlock( int bucket, int delta_torrentcount );
 void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount );
 
 size_t mutex_get_torrent_count();
+unsigned long mutex_get_bucket_stalls( int bucket );
+unsigned long mutex_get_stall_count( void );
+
+/* Stalls of the calling thread no longer count in mutex_get_stall_count */
+void mutex_bucket_stalls_background( void );
 
 typedef enum {
   TASK_STATS_CONNS                 = 0x0001,
@@ -33,6 +42,11 @@ typedef enum {
   TASK_STATS_SYNCS                 = 0x000b,
   TASK_STATS_COMPLETED             = 0x000c,
   TASK_STATS_NUMWANTS              = 0x000d,
+  TASK_STATS_UDP_BATCH             = 0x000e,
+  TASK_STATS_CLEAN                 = 0x000f,
+  TASK_STATS_CLEAN_RATE            = 0x0010,
+  TASK_STATS_SNAPSHOT              = 0x0011,
+  TASK_STATS_ACCESSLIST            = 0x0012,
 
   TASK_STATS                       = 0x0100, /* Mask */
   TASK_STATS_TORRENTS              = 0x0101,
@@ -43,6 +57,7 @@ typedef enum {
   TASK_STATS_EVERYTHING            = 0x0106,
   TASK_STATS_FULLLOG               = 0x0107,
   TASK_STATS_WOODPECKERS           = 0x0108,
+  TASK_STATS_STALLS                = 0x0109,
   
   TASK_FULLSCRAPE                  = 0x0200, /* Default mode */
   TASK_FULLSCRAPE_TPB_BINARY       = 0x0201,
@@ -56,6 +71,7 @@ typedef enum {
 
   TASK_FLAG_GZIP                   = 0x1000,
   TASK_FLAG_BZIP2                  = 0x2000,
+  TASK_FLAG_ZSTD                   = 0x4000,
 
   TASK_TASK_MASK                   = 0x0fff,
   TASK_CLASS_MASK                  = 0x0f00,
@@ -64,11 +80,23 @@ typedef enum {
 
 typedef unsigned long ot_taskid;
 
+struct ot_shared_iovec;
+
 int       mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype );
 void      mutex_workqueue_canceltask( int64 sock );
 void      mutex_workqueue_pushsuccess( ot_taskid taskid );
 ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype );
+
+/* Tasks restricted to torrents changed since a point in time, 0 for all */
+int       mutex_workqueue_pushtask_since( int64 sock, ot_tasktype tasktype, ot_time since );
+ot_taskid mutex_workqueue_poptask_since( ot_tasktype *tasktype, ot_time *since );
 int       mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovector );
-int64     mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovector );
+
+/* Results telling the tracker time they cover, to be passed as since by
+   the next delta scrape, 0 for results that do not */
+int       mutex_workqueue_pushresult_since( ot_taskid taskid, int iovec_entries, struct iovec *iovector, ot_time since );
+int       mutex_workqueue_pushresult_shared( ot_taskid taskid, struct ot_shared_iovec *shared, ot_time since );
+int64     mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovector, struct ot_shared_iovec **shared, ot_time *since );
+void      mutex_workqueue_setwakeup( int wakeup_fd );
 
 #endif
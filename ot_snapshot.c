@@ -0,0 +1,429 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* Libowfat */
+#include "byte.h"
+#include "io.h"
+#include "mmap.h"
+#include "uint32.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_mutex.h"
+#include "ot_vector.h"
+#include "ot_accesslist.h"
+#include "ot_snapshot.h"
+
+char         *g_snapshot_filename;
+unsigned int  g_snapshot_interval;
+unsigned int  g_snapshot_rate;
+
+/* Set from the SIGUSR1 handler, see snapshot_request */
+static volatile sig_atomic_t snapshot_requested;
+
+/* Outcome of the most recent snapshot_write, see snapshot_status */
+static ot_time            snapshot_last_written;
+static uint64_t           snapshot_last_torrents;
+static uint64_t           snapshot_last_peers;
+static unsigned long long snapshot_last_usec;
+static int                snapshot_last_result = 1; /* none yet */
+
+/* Only the snapshot thread writes snapshots, so one set of buffers does */
+static ot_snapshot_torrent *snapshot_torrents;
+static size_t               snapshot_torrents_space;
+static ot_peer             *snapshot_peers;
+static size_t               snapshot_peers_space;
+
+static unsigned long long snapshot_usec( void ) {
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return (unsigned long long)tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/* Keeps snapshots within g_snapshot_rate kilobytes per second by pausing
+   between buckets, once written has gotten ahead of the time spent */
+static void snapshot_throttle( unsigned long long start, uint64_t written ) {
+  unsigned long long due, spent;
+  if( !g_snapshot_rate )
+    return;
+  due   = ( written * 1000000ULL ) / ( (unsigned long long)g_snapshot_rate * 1024 );
+  spent = snapshot_usec() - start;
+  if( due > spent )
+    usleep( due - spent > 1000000ULL ? 1000000 : (useconds_t)( due - spent ) );
+}
+
+static int snapshot_grow( void **buffer, size_t *space, size_t needed, size_t member_size ) {
+  void *new_buffer;
+  if( needed <= *space )
+    return 0;
+  if( !( new_buffer = realloc( *buffer, 2 * needed * member_size ) ) )
+    return -1;
+  *buffer = new_buffer;
+  *space  = 2 * needed;
+  return 0;
+}
+
+/* Copies one bucket's torrents and peers into the snapshot buffers.
+   Returns -1 if memory was short */
+static int snapshot_copy_bucket( int bucket, ot_snapshot_block *block ) {
+  const ot_vector *torrents_list = mutex_bucket_lock_shared( bucket );
+  ot_torrent      *torrent = (ot_torrent*)(torrents_list->data);
+  size_t           j, torrent_count = 0, peer_count = 0;
+
+  if( snapshot_grow( (void**)&snapshot_torrents, &snapshot_torrents_space, torrents_list->size, sizeof(ot_snapshot_torrent) ) ) {
+    mutex_bucket_unlock( bucket, 0 );
+    return -1;
+  }
+
+  for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j, ++torrent ) {
+    ot_snapshot_torrent *record = snapshot_torrents + torrent_count;
+    ot_vector           *bucket_list;
+    int                  num_buckets = 1;
+    size_t               first_peer = peer_count, i;
+
+    if( !OT_TORRENT_SLOT_USED( torrent ) )
+      continue;
+
+    bucket_list = &torrent->peer_list->peers;
+    if( OT_PEERLIST_HASBUCKETS( torrent->peer_list ) ) {
+      num_buckets = bucket_list->size;
+      bucket_list = (ot_vector *)bucket_list->data;
+    }
+
+    while( num_buckets-- ) {
+      if( snapshot_grow( (void**)&snapshot_peers, &snapshot_peers_space, peer_count + bucket_list->size, sizeof(ot_peer) ) ) {
+        mutex_bucket_unlock( bucket, 0 );
+        return -1;
+      }
+      for( i=0; i<bucket_list->size; ++i )
+        vector_get_peer( bucket_list, i, snapshot_peers + peer_count++ );
+      ++bucket_list;
+    }
+
+    memcpy( record->hash, torrent->hash, sizeof(ot_hash) );
+    record->peer_count = peer_count - first_peer;
+    record->base       = torrent->peer_list->base;
+    record->down_count = torrent->peer_list->down_count;
+    ++torrent_count;
+  }
+
+  mutex_bucket_unlock( bucket, 0 );
+  block->torrent_count = torrent_count;
+  block->peer_count    = peer_count;
+  return 0;
+}
+
+int snapshot_write( const char *filename ) {
+  ot_snapshot_header header;
+  ot_snapshot_block *index;
+  char               tmpname[512];
+  FILE              *file;
+  uint64_t           offset = sizeof(header);
+  unsigned long long start = snapshot_usec();
+  int                bucket, result = -1;
+
+  if( snprintf( tmpname, sizeof(tmpname), "%s.tmp", filename ) >= (int)sizeof(tmpname) )
+    return -1;
+  if( !( index = malloc( OT_BUCKET_COUNT * sizeof(ot_snapshot_block) ) ) )
+    return -1;
+  if( !( file = fopen( tmpname, "w" ) ) ) {
+    fprintf( stderr, "Warning: Can't open snapshot file %s for writing.\n", tmpname );
+    free( index );
+    return -1;
+  }
+
+  byte_zero( &header, sizeof(header) );
+  memcpy( header.magic, OT_SNAPSHOT_MAGIC, sizeof(header.magic) );
+  header.version   = OT_SNAPSHOT_VERSION;
+  header.byteorder = OT_SNAPSHOT_BYTEORDER;
+  header.peer_size = sizeof(ot_peer);
+  header.written   = g_now_seconds;
+
+  /* Header is rewritten with the final counts when all blocks are out */
+  if( fwrite( &header, sizeof(header), 1, file ) != 1 )
+    goto bailout;
+
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+    ot_snapshot_block *block = index + header.block_count;
+    if( snapshot_copy_bucket( bucket, block ) )
+      goto bailout;
+    if( !block->torrent_count )
+      continue;
+    if( fwrite( snapshot_torrents, sizeof(ot_snapshot_torrent), block->torrent_count, file ) != block->torrent_count ||
+        fwrite( snapshot_peers, sizeof(ot_peer), block->peer_count, file ) != block->peer_count )
+      goto bailout;
+    block->offset = offset;
+    offset += block->torrent_count * sizeof(ot_snapshot_torrent) + block->peer_count * sizeof(ot_peer);
+
+    /* Keep the next block's records aligned */
+    if( offset % sizeof(uint64_t) ) {
+      static const uint8_t padding[sizeof(uint64_t)];
+      size_t pad = sizeof(uint64_t) - offset % sizeof(uint64_t);
+      if( fwrite( padding, 1, pad, file ) != pad )
+        goto bailout;
+      offset += pad;
+    }
+    header.torrent_count += block->torrent_count;
+    header.peer_count    += block->peer_count;
+    header.block_count++;
+
+    snapshot_throttle( start, offset );
+  }
+
+  header.index_offset = offset;
+  if( fwrite( index, sizeof(ot_snapshot_block), header.block_count, file ) != header.block_count ||
+      fseek( file, 0, SEEK_SET ) ||
+      fwrite( &header, sizeof(header), 1, file ) != 1 ||
+      fflush( file ) || fsync( fileno( file ) ) )
+    goto bailout;
+
+  result = 0;
+
+bailout:
+  if( fclose( file ) )
+    result = -1;
+  /* Only complete snapshots replace the previous one */
+  if( !result && rename( tmpname, filename ) )
+    result = -1;
+  if( result ) {
+    fprintf( stderr, "Warning: Writing snapshot %s failed.\n", filename );
+    unlink( tmpname );
+  }
+  free( index );
+
+  snapshot_last_result = result;
+  if( !result ) {
+    snapshot_last_written  = header.written;
+    snapshot_last_torrents = header.torrent_count;
+    snapshot_last_peers    = header.peer_count;
+    snapshot_last_usec     = snapshot_usec() - start;
+  }
+  return result;
+}
+
+/* Loading: threads take blocks one by one and bulk insert their torrents
+   into the buckets they belong to. With the same bucket count as the
+   writer, that is exactly one bucket per block */
+typedef struct {
+  const uint8_t           *map;
+  const ot_snapshot_block *index;
+  uint64_t                 block_count;
+  uint64_t                 next_block;
+  int                      failed;
+} ot_snapshot_load;
+
+static int snapshot_load_torrent( ot_vector *torrents_list, const ot_snapshot_torrent *record, const ot_peer *peers ) {
+  static __thread ot_peer *peer_buffer;
+  static __thread size_t   peer_buffer_space;
+  ot_torrent *torrent;
+  int         exactmatch;
+
+  if( !accesslist_hashisvalid( (uint8_t*)record->hash ) )
+    return 0;
+
+  torrent = vector_find_or_insert_torrent( torrents_list, record->hash, &exactmatch );
+  if( !torrent || exactmatch )
+    return 0;
+
+  if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
+    vector_remove_torrent( torrents_list, torrent );
+    return 0;
+  }
+
+  byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
+  torrent->peer_list->base       = record->base;
+  torrent->peer_list->down_count = record->down_count;
+  torrent->peer_list->changed    = g_now_seconds;
+
+  /* Peers are sorted in place, so take them out of the read only map.
+     If memory is short, the torrent comes back without peers */
+  if( record->peer_count && !snapshot_grow( (void**)&peer_buffer, &peer_buffer_space, record->peer_count, sizeof(ot_peer) ) ) {
+    memcpy( peer_buffer, peers, record->peer_count * sizeof(ot_peer) );
+    vector_fill_peers( torrent->peer_list, peer_buffer, record->peer_count );
+  }
+  return 1;
+}
+
+static int snapshot_load_block( const uint8_t *map, const ot_snapshot_block *block ) {
+  const ot_snapshot_torrent *records = (const ot_snapshot_torrent *)( map + block->offset );
+  const ot_peer             *peers   = (const ot_peer *)( records + block->torrent_count );
+  uint64_t                   i = 0, j, peer_count = 0;
+
+  /* Records must not claim more peers than the block holds */
+  for( j=0; j<block->torrent_count; ++j )
+    peer_count += records[j].peer_count;
+  if( peer_count != block->peer_count )
+    return -1;
+
+  while( i < block->torrent_count ) {
+    int        bucket = uint32_read_big( (const char*)records[i].hash ) >> OT_BUCKET_COUNT_SHIFT;
+    ot_vector *torrents_list;
+    int        delta_torrentcount = 0;
+
+    for( j=i+1; j<block->torrent_count; ++j )
+      if( ( uint32_read_big( (const char*)records[j].hash ) >> OT_BUCKET_COUNT_SHIFT ) != (uint32_t)bucket )
+        break;
+
+    torrents_list = mutex_bucket_lock( bucket );
+    vector_reserve_torrents( torrents_list, j - i );
+    for( ; i<j; ++i ) {
+      delta_torrentcount += snapshot_load_torrent( torrents_list, records + i, peers );
+      peers += records[i].peer_count;
+    }
+    mutex_bucket_unlock( bucket, delta_torrentcount );
+  }
+  return 0;
+}
+
+static void * snapshot_load_worker( void * args ) {
+  ot_snapshot_load *load = args;
+  uint64_t          block;
+
+  while( ( block = __sync_fetch_and_add( &load->next_block, 1 ) ) < load->block_count )
+    if( snapshot_load_block( load->map, load->index + block ) )
+      load->failed = 1;
+  return NULL;
+}
+
+static int snapshot_check( const uint8_t *map, size_t size ) {
+  const ot_snapshot_header *header = (const ot_snapshot_header *)map;
+  const ot_snapshot_block  *index;
+  uint64_t                  block;
+
+  if( header->version != OT_SNAPSHOT_VERSION || header->byteorder != OT_SNAPSHOT_BYTEORDER ||
+      header->peer_size != sizeof(ot_peer) ) {
+    fprintf( stderr, "Warning: Snapshot was written by an incompatible opentracker.\n" );
+    return -1;
+  }
+
+  if( header->index_offset < sizeof(*header) || header->index_offset > size ||
+      header->block_count > ( size - header->index_offset ) / sizeof(ot_snapshot_block) )
+    return -1;
+
+  index = (const ot_snapshot_block *)( map + header->index_offset );
+  for( block=0; block<header->block_count; ++block ) {
+    uint64_t room;
+    if( index[block].offset < sizeof(*header) || index[block].offset > header->index_offset ||
+        index[block].offset % sizeof(uint64_t) )
+      return -1;
+    room = header->index_offset - index[block].offset;
+    if( index[block].torrent_count > room / sizeof(ot_snapshot_torrent) )
+      return -1;
+    room -= index[block].torrent_count * sizeof(ot_snapshot_torrent);
+    if( index[block].peer_count > room / sizeof(ot_peer) )
+      return -1;
+  }
+  return 0;
+}
+
+int snapshot_load( const char *filename ) {
+  ot_snapshot_load load;
+  pthread_t        threads[OT_SNAPSHOT_THREADS_MAX];
+  const uint8_t   *map;
+  size_t           size;
+  long             cpus = sysconf( _SC_NPROCESSORS_ONLN );
+  int              thread_count, started = 0, i;
+
+  if( !( map = (const uint8_t *)mmap_read( filename, &size ) ) )
+    return 1;
+  if( size < sizeof(ot_snapshot_header) || memcmp( map, OT_SNAPSHOT_MAGIC, 8 ) ) {
+    mmap_unmap( (const char *)map, size );
+    return 1;
+  }
+  if( snapshot_check( map, size ) ) {
+    fprintf( stderr, "Warning: Snapshot %s is broken, ignoring it.\n", filename );
+    mmap_unmap( (const char *)map, size );
+    return -1;
+  }
+
+  byte_zero( &load, sizeof(load) );
+  load.map         = map;
+  load.index       = (const ot_snapshot_block *)( map + ((const ot_snapshot_header *)map)->index_offset );
+  load.block_count = ((const ot_snapshot_header *)map)->block_count;
+
+  thread_count = cpus > 0 ? (int)cpus : 1;
+  if( thread_count > OT_SNAPSHOT_THREADS_MAX )
+    thread_count = OT_SNAPSHOT_THREADS_MAX;
+  if( (uint64_t)thread_count > load.block_count )
+    thread_count = load.block_count ? (int)load.block_count : 1;
+
+  /* This thread does its share, too */
+  for( i=1; i<thread_count; ++i )
+    if( !pthread_create( threads + started, NULL, snapshot_load_worker, &load ) )
+      ++started;
+  snapshot_load_worker( &load );
+  for( i=0; i<started; ++i )
+    pthread_join( threads[i], NULL );
+
+  mmap_unmap( (const char *)map, size );
+  if( load.failed ) {
+    fprintf( stderr, "Warning: Snapshot %s is partly broken, loaded what was intact.\n", filename );
+    return -1;
+  }
+  return 0;
+}
+
+size_t snapshot_status( char *reply ) {
+  if( snapshot_last_result > 0 )
+    return sprintf( reply, "Snapshot requested. There was none so far.\n" );
+  if( snapshot_last_result < 0 )
+    return sprintf( reply, "Snapshot requested. The last one failed.\n" );
+  return sprintf( reply, "Snapshot requested. The last one was written at %llu with %llu torrents and %llu peers in %llu ms.\n",
+                  (unsigned long long)snapshot_last_written, (unsigned long long)snapshot_last_torrents,
+                  (unsigned long long)snapshot_last_peers, snapshot_last_usec / 1000 );
+}
+
+/* Writes a checkpoint every g_snapshot_interval seconds and whenever one
+   is requested. Buckets are only locked one at a time while being copied,
+   so the tracker never pauses as a whole */
+static void * snapshot_worker( void * args ) {
+  ot_time next_checkpoint = g_now_seconds + g_snapshot_interval;
+
+  (void)args;
+
+  while( 1 ) {
+    sleep( 1 );
+
+    if( !snapshot_requested && ( !g_snapshot_interval || g_now_seconds < next_checkpoint ) )
+      continue;
+    snapshot_requested = 0;
+
+    if( !g_snapshot_filename ) {
+      fprintf( stderr, "Warning: Snapshot requested, but no tracker.snapshot file configured.\n" );
+      continue;
+    }
+    snapshot_write( g_snapshot_filename );
+    next_checkpoint = g_now_seconds + g_snapshot_interval;
+  }
+  return NULL;
+}
+
+static pthread_t thread_id;
+static int       thread_running;
+void snapshot_init( void ) {
+  thread_running = !pthread_create( &thread_id, NULL, snapshot_worker, NULL );
+}
+
+void snapshot_deinit( void ) {
+  if( thread_running )
+    pthread_cancel( thread_id );
+  thread_running = 0;
+}
+
+void snapshot_request( void ) {
+  snapshot_requested = 1;
+}
+
+const char *g_version_snapshot_c = "$Source$: $Revision$\n";
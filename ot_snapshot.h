@@ -0,0 +1,80 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_SNAPSHOT_H__
+#define __OT_SNAPSHOT_H__
+
+/* A snapshot is a binary dump of all torrents and their peers that can be
+   mapped and loaded in parallel on start up, see -l. It is written in the
+   host's byte order and only loads on trackers built for the same address
+   family. Layout:
+
+     | header | block 0 | block 1 | ... | block index |
+
+   Each block holds the torrents of one bucket as ot_snapshot_torrent
+   records in bucket order, i.e. sorted by info hash unless built with
+   WANT_TORRENT_HASHTABLE, followed by the peers of all these torrents as
+   ot_peer, in the same order as the records. The index at index_offset
+   holds one ot_snapshot_block per block */
+#define OT_SNAPSHOT_MAGIC     "OTSNAPSH"
+#define OT_SNAPSHOT_VERSION   1
+#define OT_SNAPSHOT_BYTEORDER 0x01020304
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t peer_size;
+  uint32_t reserved;
+  int64_t  written;
+  uint64_t block_count;
+  uint64_t index_offset;
+  uint64_t torrent_count;
+  uint64_t peer_count;
+} ot_snapshot_header;
+
+typedef struct {
+  ot_hash  hash;
+  uint32_t peer_count;
+  int64_t  base;
+  uint64_t down_count;
+} ot_snapshot_torrent;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t torrent_count;
+  uint64_t peer_count;
+} ot_snapshot_block;
+
+/* Threads filling buckets from a snapshot, one per online cpu at most */
+#define OT_SNAPSHOT_THREADS_MAX 64
+
+/* Where SIGUSR1, /stats?mode=snapshot and periodic checkpoints write
+   snapshots to */
+extern char *g_snapshot_filename;
+
+/* Seconds between checkpoints, 0 only writes snapshots on request */
+extern unsigned int g_snapshot_interval;
+
+/* Kilobytes per second a snapshot may be written with, 0 is unlimited */
+extern unsigned int g_snapshot_rate;
+
+void snapshot_init( void );
+void snapshot_deinit( void );
+
+/* Asks the snapshot thread to write a new snapshot, safe to call from
+   signal handlers */
+void snapshot_request( void );
+
+/* Returns 0 if the snapshot was written, -1 otherwise */
+int  snapshot_write( const char *filename );
+
+/* Returns 0 if filename was loaded as a snapshot, 1 if it is no
+   snapshot at all and -1 if it is broken or memory was short */
+int  snapshot_load( const char *filename );
+
+size_t snapshot_status( char *reply );
+
+#endif
@@ -30,6 +30,8 @@
 #include "ot_iovec.h"
 #include "ot_stats.h"
 #include "ot_accesslist.h"
+#include "ot_clean.h"
+#include "ot_snapshot.h"
 
 #ifndef NO_FULLSCRAPE_LOGGING
 #define LOG_TO_STDERR( ... ) fprintf( stderr, __VA_ARGS__ )
@@ -60,6 +62,13 @@ static char *             ot_failed_request_names[] = { "302 Redirect", "400 Par
 static unsigned long long ot_renewed[OT_PEER_TIMEOUT];
 static unsigned long long ot_overall_sync_count;
 static unsigned long long ot_overall_stall_count;
+static unsigned long long ot_overall_udp_recv_calls;
+static unsigned long long ot_overall_udp_recv_packets;
+static unsigned long long ot_overall_udp_send_calls;
+static unsigned long long ot_overall_udp_send_packets;
+static unsigned long long ot_overall_clean_cycles;
+static unsigned long long ot_overall_clean_cpu_usec;
+static ot_clean_cycle     ot_last_clean_cycle;
 
 static time_t ot_start_time;
 
@@ -219,30 +228,17 @@ static size_t stats_slash24s_txt( char *reply, size_t amount ) {
   stats_network_node *slash24s_network_counters_root = NULL;
   char *r=reply;
   int bucket;
-  size_t i;
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    for( i=0; i<torrents_list->size; ++i ) {
-      ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[i] ).peer_list;
-      ot_vector   *bucket_list = &peer_list->peers;
-      int          num_buckets = 1;
-
-      if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-        num_buckets = bucket_list->size;
-        bucket_list = (ot_vector *)bucket_list->data;
-      }
+    /* Building the tree allocates, do that outside the bucket lock */
+    uint8_t *peer_addresses;
+    ssize_t peer_count = snapshot_bucket_peers( bucket, &peer_addresses ), peer;
 
-      while( num_buckets-- ) {
-        ot_peer *peers = (ot_peer*)bucket_list->data;
-        size_t   numpeers = bucket_list->size;
-        while( numpeers-- )
-          if( stat_increase_network_count( &slash24s_network_counters_root, 0, (uintptr_t)(peers++) ) )
-            goto bailout_unlock;
-        ++bucket_list;
-      }
-    }
-    mutex_bucket_unlock( bucket, 0 );
+    if( peer_count < 0 )
+      goto bailout_error;
+    for( peer=0; peer<peer_count; ++peer )
+      if( stat_increase_network_count( &slash24s_network_counters_root, 0, (uintptr_t)( peer_addresses + peer * OT_PEER_COMPARE_SIZE ) ) )
+        goto bailout_error;
     if( !g_opentracker_running )
       goto bailout_error;
   }
@@ -252,8 +248,6 @@ static size_t stats_slash24s_txt( char *reply, size_t amount ) {
   r += stats_return_busy_networks( r, slash24s_network_counters_root, amount, STATS_NETWORK_NODE_LIMIT );
   goto success;
 
-bailout_unlock:
-  mutex_bucket_unlock( bucket, 0 );
 bailout_error:
   r = reply;
 success:
@@ -293,11 +287,11 @@ static int torrent_statter( ot_torrent *torrent, uintptr_t data ) {
 /* Converter function from memory to human readable hex strings */
 static char*to_hex(char*d,uint8_t*s){char*m="0123456789ABCDEF";char *t=d;char*e=d+40;while(d<e){*d++=m[*s>>4];*d++=m[*s++&15];}*d=0;return t;}
 
-typedef struct { size_t val; ot_torrent * torrent; } ot_record;
+/* Only torrents with a non-zero val ever make it into a record */
+typedef struct { size_t val; ot_hash hash; } ot_record;
 
 /* Fetches stats from tracker */
 size_t stats_top_txt( char * reply, int amount ) {
-  size_t    j;
   ot_record top100s[100], top100c[100];
   char     *r  = reply, hex_out[42];
   int       idx, bucket;
@@ -309,35 +303,38 @@ size_t stats_top_txt( char * reply, int amount ) {
   byte_zero( top100c, sizeof( top100c ) );
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    for( j=0; j<torrents_list->size; ++j ) {
-      ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[j] ).peer_list;
-      int idx = amount - 1; while( (idx >= 0) && ( peer_list->peer_count > top100c[idx].val ) ) --idx;
+    ot_torrent_snapshot *torrents;
+    ssize_t torrent_count = snapshot_bucket( bucket, &torrents ), j;
+    if( torrent_count < 0 )
+      return 0;
+    for( j=0; j<torrent_count; ++j ) {
+      ot_torrent_snapshot *torrent = torrents + j;
+      int idx;
+      idx = amount - 1; while( (idx >= 0) && ( torrent->peer_count > top100c[idx].val ) ) --idx;
       if ( idx++ != amount - 1 ) {
         memmove( top100c + idx + 1, top100c + idx, ( amount - 1 - idx ) * sizeof( ot_record ) );
-        top100c[idx].val = peer_list->peer_count;
-        top100c[idx].torrent = (ot_torrent*)(torrents_list->data) + j;
+        top100c[idx].val = torrent->peer_count;
+        memcpy( top100c[idx].hash, torrent->hash, sizeof(ot_hash) );
       }
-      idx = amount - 1; while( (idx >= 0) && ( peer_list->seed_count > top100s[idx].val ) ) --idx;
+      idx = amount - 1; while( (idx >= 0) && ( torrent->seed_count > top100s[idx].val ) ) --idx;
       if ( idx++ != amount - 1 ) {
         memmove( top100s + idx + 1, top100s + idx, ( amount - 1 - idx ) * sizeof( ot_record ) );
-        top100s[idx].val = peer_list->seed_count;
-        top100s[idx].torrent = (ot_torrent*)(torrents_list->data) + j;
+        top100s[idx].val = torrent->seed_count;
+        memcpy( top100s[idx].hash, torrent->hash, sizeof(ot_hash) );
       }
     }
-    mutex_bucket_unlock( bucket, 0 );
     if( !g_opentracker_running )
       return 0;
   }
 
   r += sprintf( r, "Top %d torrents by peers:\n", amount );
   for( idx=0; idx<amount; ++idx )
-    if( top100c[idx].torrent )
-      r += sprintf( r, "\t%zd\t%s\n", top100c[idx].val, to_hex( hex_out, top100c[idx].torrent->hash) );
+    if( top100c[idx].val )
+      r += sprintf( r, "\t%zd\t%s\n", top100c[idx].val, to_hex( hex_out, top100c[idx].hash) );
   r += sprintf( r, "Top %d torrents by seeds:\n", amount );
   for( idx=0; idx<amount; ++idx )
-    if( top100s[idx].torrent )
-      r += sprintf( r, "\t%zd\t%s\n", top100s[idx].val, to_hex( hex_out, top100s[idx].torrent->hash) );
+    if( top100s[idx].val )
+      r += sprintf( r, "\t%zd\t%s\n", top100s[idx].val, to_hex( hex_out, top100s[idx].hash) );
 
   return r - reply;
 }
@@ -372,6 +369,60 @@ static size_t stats_udpconnections_mrtg( char * reply ) {
                  );
 }
 
+/* Hundredths of packets moved per recvmmsg and sendmmsg call */
+static unsigned long long packets_per_call( unsigned long long packets, unsigned long long calls ) {
+  return calls ? ( 100 * packets ) / calls : 0;
+}
+
+static size_t stats_udpbatch_mrtg( char * reply ) {
+  ot_time t = time( NULL ) - ot_start_time;
+  unsigned long long recv_ppc = packets_per_call( ot_overall_udp_recv_packets, ot_overall_udp_recv_calls );
+  unsigned long long send_ppc = packets_per_call( ot_overall_udp_send_packets, ot_overall_udp_send_calls );
+  return sprintf( reply,
+                 "%llu\n%llu\n%i seconds (%i hours)\nopentracker udp batch stats, %llu.%02llu packets per recvmmsg :: %llu.%02llu packets per sendmmsg.",
+                 ot_overall_udp_recv_packets,
+                 ot_overall_udp_recv_calls,
+                 (int)t,
+                 (int)(t / 3600),
+                 recv_ppc / 100, recv_ppc % 100,
+                 send_ppc / 100, send_ppc % 100
+                 );
+}
+
+static size_t stats_clean_mrtg( char * reply ) {
+  ot_time t = time( NULL ) - ot_start_time;
+  unsigned long long average = ot_overall_clean_cycles ? ot_overall_clean_cpu_usec / ot_overall_clean_cycles : 0;
+  return sprintf( reply,
+                 "%llu\n%llu\n%i seconds (%i hours)\nopentracker clean stats, %llu usec cpu last cycle (%llu usec average) :: %llu torrents cleaned, %llu skipped.",
+                 ot_last_clean_cycle.cpu_usec,
+                 ot_last_clean_cycle.cleaned,
+                 (int)t,
+                 (int)(t / 3600),
+                 ot_last_clean_cycle.cpu_usec, average,
+                 ot_last_clean_cycle.cleaned,
+                 ot_last_clean_cycle.skipped
+                 );
+}
+
+/* Events per second over the last clean cycle */
+static unsigned long long per_clean_second( unsigned long long count ) {
+  return ot_last_clean_cycle.wall_usec ? ( count * 1000000ULL ) / ot_last_clean_cycle.wall_usec : 0;
+}
+
+static size_t stats_cleanrate_mrtg( char * reply ) {
+  ot_time t = time( NULL ) - ot_start_time;
+  return sprintf( reply,
+                 "%llu\n%llu\n%i seconds (%i hours)\nopentracker clean rate stats, last cycle took %llu seconds :: %llu buckets/s, %llu peers removed/s.",
+                 per_clean_second( ot_last_clean_cycle.buckets ),
+                 per_clean_second( ot_last_clean_cycle.peers_removed ),
+                 (int)t,
+                 (int)(t / 3600),
+                 ot_last_clean_cycle.wall_usec / 1000000ULL,
+                 per_clean_second( ot_last_clean_cycle.buckets ),
+                 per_clean_second( ot_last_clean_cycle.peers_removed )
+                 );
+}
+
 static size_t stats_tcpconnections_mrtg( char * reply ) {
   time_t t = time( NULL ) - ot_start_time;
   return sprintf( reply,
@@ -518,6 +569,25 @@ static void stats_return_fulllog( int *iovec_entries, struct iovec **iovector, c
 }
 #endif
 
+static void stats_return_stalls( int *iovec_entries, struct iovec **iovector, char *r ) {
+  char * re = r + OT_STATS_TMPSIZE;
+  int    bucket;
+
+  r += sprintf( r, "%llu stalls overall\n", ot_overall_stall_count );
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+    unsigned long stalls = mutex_get_bucket_stalls( bucket );
+    if( !stalls )
+      continue;
+    if( r + 64 >= re ) {
+      r = iovec_fix_increase_or_free( iovec_entries, iovector, r, OT_STATS_TMPSIZE );
+      if( !r ) return;
+      re = r + OT_STATS_TMPSIZE;
+    }
+    r += sprintf( r, "%05d %lu\n", bucket, stalls );
+  }
+  iovec_fixlast( iovec_entries, iovector, r );
+}
+
 static size_t stats_return_everything( char * reply ) {
   torrent_stats stats = {0,0,0};
   int i;
@@ -539,7 +609,8 @@ static size_t stats_return_everything( char * reply ) {
   r += sprintf( r, "  <completed>\n    <count>%llu</count>\n  </completed>\n", ot_overall_completed );
   r += sprintf( r, "  <connections>\n" );
   r += sprintf( r, "    <tcp>\n      <accept>%llu</accept>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n    </tcp>\n", ot_overall_tcp_connections, ot_overall_tcp_successfulannounces, ot_overall_udp_successfulscrapes );
-  r += sprintf( r, "    <udp>\n      <overall>%llu</overall>\n      <connect>%llu</connect>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n      <missmatch>%llu</missmatch>\n    </udp>\n", ot_overall_udp_connections, ot_overall_udp_connects, ot_overall_udp_successfulannounces, ot_overall_udp_successfulscrapes, ot_overall_udp_connectionidmissmatches );
+  r += sprintf( r, "    <udp>\n      <overall>%llu</overall>\n      <connect>%llu</connect>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n      <missmatch>%llu</missmatch>\n", ot_overall_udp_connections, ot_overall_udp_connects, ot_overall_udp_successfulannounces, ot_overall_udp_successfulscrapes, ot_overall_udp_connectionidmissmatches );
+  r += sprintf( r, "      <batch>\n        <recv_calls>%llu</recv_calls>\n        <recv_packets>%llu</recv_packets>\n        <send_calls>%llu</send_calls>\n        <send_packets>%llu</send_packets>\n      </batch>\n    </udp>\n", ot_overall_udp_recv_calls, ot_overall_udp_recv_packets, ot_overall_udp_send_calls, ot_overall_udp_send_packets );
   r += sprintf( r, "    <livesync>\n      <count>%llu</count>\n    </livesync>\n", ot_overall_sync_count );
   r += sprintf( r, "  </connections>\n" );
   r += sprintf( r, "  <debug>\n" );
@@ -552,6 +623,9 @@ static size_t stats_return_everything( char * reply ) {
     r += sprintf( r, "      <count code=\"%s\">%llu</count>\n", ot_failed_request_names[i], ot_failed_request_counts[i] );
   r += sprintf( r, "    </http_error>\n" );
   r += sprintf( r, "    <mutex_stall>\n      <count>%llu</count>\n    </mutex_stall>\n", ot_overall_stall_count );
+  r += sprintf( r, "    <clean>\n      <cycles>%llu</cycles>\n      <cpu_usec>%llu</cpu_usec>\n      <last_cpu_usec>%llu</last_cpu_usec>\n      <last_cleaned>%llu</last_cleaned>\n      <last_skipped>%llu</last_skipped>\n      <last_wall_usec>%llu</last_wall_usec>\n      <last_buckets>%llu</last_buckets>\n      <last_peers_removed>%llu</last_peers_removed>\n    </clean>\n",
+                ot_overall_clean_cycles, ot_overall_clean_cpu_usec, ot_last_clean_cycle.cpu_usec, ot_last_clean_cycle.cleaned, ot_last_clean_cycle.skipped,
+                ot_last_clean_cycle.wall_usec, ot_last_clean_cycle.buckets, ot_last_clean_cycle.peers_removed );
   r += sprintf( r, "  </debug>\n" );
   r += sprintf( r, "</stats>" );
   return r - reply;
@@ -560,13 +634,15 @@ static size_t stats_return_everything( char * reply ) {
 extern const char
 *g_version_opentracker_c, *g_version_accesslist_c, *g_version_clean_c, *g_version_fullscrape_c, *g_version_http_c,
 *g_version_iovec_c, *g_version_mutex_c, *g_version_stats_c, *g_version_udp_c, *g_version_vector_c,
-*g_version_scan_urlencoded_query_c, *g_version_trackerlogic_c, *g_version_livesync_c, *g_version_rijndael_c;
+*g_version_scan_urlencoded_query_c, *g_version_trackerlogic_c, *g_version_livesync_c, *g_version_rijndael_c, *g_version_tcp_c, *g_version_format_c, *g_version_snapshot_c,
+*g_version_journal_c;
 
 size_t stats_return_tracker_version( char *reply ) {
-  return sprintf( reply, "%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
+  return sprintf( reply, "%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
                  g_version_opentracker_c, g_version_accesslist_c, g_version_clean_c, g_version_fullscrape_c, g_version_http_c,
                  g_version_iovec_c, g_version_mutex_c, g_version_stats_c, g_version_udp_c, g_version_vector_c,
-                 g_version_scan_urlencoded_query_c, g_version_trackerlogic_c, g_version_livesync_c, g_version_rijndael_c );
+                 g_version_scan_urlencoded_query_c, g_version_trackerlogic_c, g_version_livesync_c, g_version_rijndael_c, g_version_tcp_c, g_version_format_c, g_version_snapshot_c,
+                 g_version_journal_c );
 }
 
 size_t return_stats_for_tracker( char *reply, int mode, int format ) {
@@ -580,6 +656,17 @@ size_t return_stats_for_tracker( char *reply, int mode, int format ) {
       return stats_udpconnections_mrtg( reply );
     case TASK_STATS_TCP:
       return stats_tcpconnections_mrtg( reply );
+    case TASK_STATS_UDP_BATCH:
+      return stats_udpbatch_mrtg( reply );
+    case TASK_STATS_CLEAN:
+      return stats_clean_mrtg( reply );
+    case TASK_STATS_CLEAN_RATE:
+      return stats_cleanrate_mrtg( reply );
+    case TASK_STATS_SNAPSHOT:
+      snapshot_request( );
+      return snapshot_status( reply );
+    case TASK_STATS_ACCESSLIST:
+      return accesslist_stats( reply );
     case TASK_STATS_FULLSCRAPE:
       return stats_fullscrapes_mrtg( reply );
     case TASK_STATS_COMPLETED:
@@ -626,6 +713,8 @@ static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype
     case TASK_STATS_FULLLOG:      stats_return_fulllog( iovec_entries, iovector, r );
                                                                             return;
 #endif
+    case TASK_STATS_STALLS:      stats_return_stalls( iovec_entries, iovector, r );
+                                                                            return;
     default:
       iovec_free(iovec_entries, iovector);
       return;
@@ -695,6 +784,7 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
     }
       break;
     case EVENT_FULLSCRAPE_REQUEST_GZIP:
+    case EVENT_FULLSCRAPE_REQUEST_ZSTD:
     {
       ot_ip6 *ip = (ot_ip6*)event_data; /* ugly hack to transfer ip to stats */
       char _debug[512];
@@ -726,6 +816,20 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
 #endif
     case EVENT_CONNID_MISSMATCH:
       ++ot_overall_udp_connectionidmissmatches;
+      break;
+    case EVENT_UDP_RECV_BATCH:
+      ot_overall_udp_recv_calls++;
+      ot_overall_udp_recv_packets += event_data;
+      break;
+    case EVENT_UDP_SEND_BATCH:
+      ot_overall_udp_send_calls++;
+      ot_overall_udp_send_packets += event_data;
+      break;
+    case EVENT_CLEAN_CYCLE:
+      memcpy( &ot_last_clean_cycle, (ot_clean_cycle*)event_data, sizeof(ot_clean_cycle) );
+      ot_overall_clean_cycles++;
+      ot_overall_clean_cpu_usec += ot_last_clean_cycle.cpu_usec;
+      break;
     default:
       break;
   }
@@ -17,11 +17,15 @@ typedef enum {
   EVENT_SCRAPE,
   EVENT_FULLSCRAPE_REQUEST,
   EVENT_FULLSCRAPE_REQUEST_GZIP,
+  EVENT_FULLSCRAPE_REQUEST_ZSTD,
   EVENT_FULLSCRAPE,   /* TCP only */
   EVENT_FAILED,
   EVENT_BUCKET_LOCKED,
   EVENT_WOODPECKER,
-  EVENT_CONNID_MISSMATCH
+  EVENT_CONNID_MISSMATCH,
+  EVENT_UDP_RECV_BATCH, /* UDP only */
+  EVENT_UDP_SEND_BATCH, /* UDP only */
+  EVENT_CLEAN_CYCLE
 } ot_status_event;
 
 enum {
@@ -0,0 +1,306 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/* Libowfat */
+#include "socket.h"
+#include "io.h"
+#include "iob.h"
+#include "array.h"
+#include "ndelay.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_mutex.h"
+#include "ot_http.h"
+#include "ot_iovec.h"
+#include "ot_stats.h"
+#include "ot_tcp.h"
+
+#ifdef __linux__
+
+/* Every worker loop owns an epoll set holding its listening sockets, its
+   connections and the pipe the work queue wakes it up on. Neither is
+   registered with libowfat's io layer, which only serves the main loop */
+struct ot_tcp_worker {
+  int epoll_fd;
+  int wakeup[2];
+  int connections; /* First socket in the loop's connection list, -1 for none */
+};
+
+/* Connections of all worker loops, indexed by socket. An entry is only
+   ever touched by the loop owning the socket */
+struct ot_tcp_connection {
+  struct http_data     *cookie;
+  struct ot_tcp_worker *worker;
+  time_t                timeout; /* 0 for none */
+  uint32_t              events;
+  int                   prev, next;
+};
+
+enum { TCP_EVENT_CONNECTION, TCP_EVENT_LISTENER, TCP_EVENT_WAKEUP };
+#define TCP_EVENT_DATA( kind, sock ) ( ( (uint64_t)(kind) << 32 ) | (uint32_t)(sock) )
+#define OT_TCP_EPOLL_EVENTS 256
+
+static struct ot_tcp_worker      g_tcp_workers[OT_TCP_WORKERS_MAX];
+static unsigned int              g_tcp_worker_count;
+static struct ot_tcp_connection *g_tcp_connections;
+static int64                     g_tcp_connections_size;
+
+int tcp_add_listener( int64 sock, unsigned int worker ) {
+  struct epoll_event event;
+
+  if( worker >= OT_TCP_WORKERS_MAX )
+    return -1;
+
+  /* Loops are created in order, as their first listener shows up */
+  while( g_tcp_worker_count <= worker ) {
+    struct ot_tcp_worker *new_worker = g_tcp_workers + g_tcp_worker_count;
+    if( ( new_worker->epoll_fd = epoll_create1( EPOLL_CLOEXEC ) ) == -1 )
+      return -1;
+    if( pipe( new_worker->wakeup ) == -1 )
+      return -1;
+    ndelay_on( new_worker->wakeup[0] );
+    ndelay_on( new_worker->wakeup[1] );
+    event.events   = EPOLLIN;
+    event.data.u64 = TCP_EVENT_DATA( TCP_EVENT_WAKEUP, new_worker->wakeup[0] );
+    if( epoll_ctl( new_worker->epoll_fd, EPOLL_CTL_ADD, new_worker->wakeup[0], &event ) == -1 )
+      return -1;
+    new_worker->connections = -1;
+    ++g_tcp_worker_count;
+  }
+
+  ndelay_on( sock );
+  event.events   = EPOLLIN;
+  event.data.u64 = TCP_EVENT_DATA( TCP_EVENT_LISTENER, sock );
+  return epoll_ctl( g_tcp_workers[worker].epoll_fd, EPOLL_CTL_ADD, sock, &event );
+}
+
+struct http_data *tcp_getcookie( int64 sock ) {
+  if( sock < 0 || sock >= g_tcp_connections_size )
+    return NULL;
+  return g_tcp_connections[sock].cookie;
+}
+
+void tcp_close( int64 sock ) {
+  if( sock >= 0 && sock < g_tcp_connections_size ) {
+    struct ot_tcp_connection *connection = g_tcp_connections + sock;
+    if( connection->worker ) {
+      if( connection->prev != -1 )
+        g_tcp_connections[connection->prev].next = connection->next;
+      else
+        connection->worker->connections = connection->next;
+      if( connection->next != -1 )
+        g_tcp_connections[connection->next].prev = connection->prev;
+    }
+    memset( connection, 0, sizeof(struct ot_tcp_connection) );
+  }
+  close( sock );
+}
+
+void tcp_timeout( int64 sock, time_t seconds ) {
+  if( sock >= 0 && sock < g_tcp_connections_size )
+    g_tcp_connections[sock].timeout = seconds ? g_now_seconds + seconds : 0;
+}
+
+static void tcp_want( int64 sock, uint32_t events ) {
+  struct ot_tcp_connection *connection;
+  struct epoll_event event;
+
+  if( sock < 0 || sock >= g_tcp_connections_size )
+    return;
+  connection = g_tcp_connections + sock;
+  if( !connection->worker || connection->events == events )
+    return;
+
+  connection->events = events;
+  event.events   = events;
+  event.data.u64 = TCP_EVENT_DATA( TCP_EVENT_CONNECTION, sock );
+  epoll_ctl( connection->worker->epoll_fd, EPOLL_CTL_MOD, sock, &event );
+}
+
+void tcp_dontwantread( int64 sock ) {
+  if( sock >= 0 && sock < g_tcp_connections_size )
+    tcp_want( sock, g_tcp_connections[sock].events & ~EPOLLIN );
+}
+
+void tcp_wantwrite( int64 sock ) {
+  if( sock >= 0 && sock < g_tcp_connections_size )
+    tcp_want( sock, g_tcp_connections[sock].events | EPOLLOUT );
+}
+
+static void tcp_handle_read( const int64 sock, struct ot_workstruct *ws ) {
+  ssize_t byte_count;
+
+  /* Events of a socket closed earlier in the same round */
+  if( !tcp_getcookie( sock ) ) return;
+
+  byte_count = read( sock, ws->inbuf, G_INBUF_SIZE );
+  if( byte_count == -1 && errno == EAGAIN ) return;
+  http_handle_read( sock, ws, byte_count );
+}
+
+static void tcp_handle_accept( struct ot_tcp_worker *worker, const int64 serversocket ) {
+  struct ot_tcp_connection *connection;
+  struct http_data *cookie;
+  struct epoll_event event;
+  int64 sock;
+  ot_ip6 ip;
+  uint16 port;
+
+  while( ( sock = socket_accept6( serversocket, ip, &port, NULL ) ) != -1 ) {
+    if( sock >= g_tcp_connections_size || !( cookie = http_newcookie( ip ) ) ) {
+      close( sock );
+      continue;
+    }
+
+    /* Put fd into a non-blocking mode */
+    ndelay_on( sock );
+
+    event.events   = EPOLLIN;
+    event.data.u64 = TCP_EVENT_DATA( TCP_EVENT_CONNECTION, sock );
+    if( epoll_ctl( worker->epoll_fd, EPOLL_CTL_ADD, sock, &event ) == -1 ) {
+      free( cookie );
+      close( sock );
+      continue;
+    }
+
+    connection          = g_tcp_connections + sock;
+    connection->cookie  = cookie;
+    connection->worker  = worker;
+    connection->timeout = g_now_seconds + OT_CLIENT_TIMEOUT;
+    connection->events  = EPOLLIN;
+    connection->prev    = -1;
+    connection->next    = worker->connections;
+    if( connection->next != -1 )
+      g_tcp_connections[connection->next].prev = sock;
+    worker->connections = sock;
+
+    stats_issue_event( EVENT_ACCEPT, FLAG_TCP, (uintptr_t)ip);
+  }
+}
+
+static void tcp_handle_timeouts( struct ot_tcp_worker *worker, struct ot_workstruct *ws ) {
+  int sock = worker->connections;
+  while( sock != -1 ) {
+    int next = g_tcp_connections[sock].next;
+    if( g_tcp_connections[sock].timeout && g_tcp_connections[sock].timeout < g_now_seconds )
+      http_handle_dead( sock, ws );
+    sock = next;
+  }
+}
+
+static void * tcp_worker( void * args ) {
+  struct ot_tcp_worker *worker = (struct ot_tcp_worker *)args;
+  struct epoll_event events[OT_TCP_EPOLL_EVENTS];
+  struct ot_workstruct ws;
+  time_t next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
+  struct iovec *iovector;
+  int    iovec_entries;
+  ot_shared_iovec *shared;
+  ot_time          since;
+
+  memset( &ws, 0, sizeof(ws) );
+  ws.inbuf   = malloc( G_INBUF_SIZE );
+  ws.outbuf  = malloc( G_OUTBUF_SIZE );
+#ifdef _DEBUG_HTTPERROR
+  ws.debugbuf= malloc( G_DEBUGBUF_SIZE );
+#endif
+  if( !ws.inbuf || !ws.outbuf )
+    exerr( "Initializing tcp worker failed." );
+  ws.tcp_worker = 1;
+  ot_random_seed( &ws );
+
+  /* Results of our tasks must come back to this loop */
+  mutex_workqueue_setwakeup( worker->wakeup[1] );
+
+  while( g_opentracker_running ) {
+    int64 sock;
+    int i, count = epoll_wait( worker->epoll_fd, events, OT_TCP_EPOLL_EVENTS, OT_CLIENT_TIMEOUT_CHECKINTERVAL * 1000 );
+
+    for( i=0; i<count; ++i ) {
+      sock = (uint32_t)events[i].data.u64;
+      switch( events[i].data.u64 >> 32 ) {
+        case TCP_EVENT_LISTENER:
+          tcp_handle_accept( worker, sock );
+          break;
+        case TCP_EVENT_WAKEUP:
+          while( read( sock, ws.inbuf, G_INBUF_SIZE ) > 0 ) {}
+          break;
+        default:
+          if( events[i].events & EPOLLOUT )
+            http_handle_write( sock, &ws );
+          else
+            tcp_handle_read( sock, &ws );
+      }
+    }
+
+    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector, &shared, &since ) ) != -1 )
+      http_sendiovecdata( sock, &ws, iovec_entries, iovector, shared, since );
+
+    if( g_now_seconds > next_timeout_check ) {
+      tcp_handle_timeouts( worker, &ws );
+      next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
+    }
+  }
+
+  free( ws.inbuf );
+  free( ws.outbuf );
+#ifdef _DEBUG_HTTPERROR
+  free( ws.debugbuf );
+#endif
+  return NULL;
+}
+
+void tcp_init( ) {
+  struct rlimit limit;
+  pthread_t thread_id;
+  unsigned int i;
+
+  if( !g_tcp_worker_count )
+    return;
+
+  /* No socket can be numbered beyond our file descriptor limit */
+  if( getrlimit( RLIMIT_NOFILE, &limit ) || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > ( 1 << 24 ) )
+    limit.rlim_cur = 1 << 24;
+  g_tcp_connections_size = limit.rlim_cur;
+  g_tcp_connections = calloc( g_tcp_connections_size, sizeof(struct ot_tcp_connection) );
+  if( !g_tcp_connections )
+    exerr( "Could not allocate tcp connection table." );
+
+#ifdef _DEBUG
+  fprintf( stderr, " installing %d tcp worker loops\n", g_tcp_worker_count );
+#endif
+  for( i=0; i<g_tcp_worker_count; ++i )
+    pthread_create( &thread_id, NULL, tcp_worker, g_tcp_workers + i );
+}
+
+#else
+
+/* Without epoll all tcp sockets are served by the main loop */
+int tcp_add_listener( int64 sock, unsigned int worker ) { (void)sock; (void)worker; return -1; }
+void tcp_init( ) {}
+struct http_data *tcp_getcookie( int64 sock ) { (void)sock; return NULL; }
+void tcp_close( int64 sock ) { close( sock ); }
+void tcp_timeout( int64 sock, time_t seconds ) { (void)sock; (void)seconds; }
+void tcp_dontwantread( int64 sock ) { (void)sock; }
+void tcp_wantwrite( int64 sock ) { (void)sock; }
+
+#endif
+
+const char *g_version_tcp_c = "$Source$: $Revision$\n";
@@ -0,0 +1,22 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_TCP_H__
+#define __OT_TCP_H__
+
+/* Upper bound for tcp worker loops */
+#define OT_TCP_WORKERS_MAX 64
+
+int   tcp_add_listener( int64 sock, unsigned int worker );
+void  tcp_init( );
+
+/* Connection handling for sockets owned by tcp worker loops */
+struct http_data *tcp_getcookie( int64 sock );
+void  tcp_close( int64 sock );
+void  tcp_timeout( int64 sock, time_t seconds );
+void  tcp_dontwantread( int64 sock );
+void  tcp_wantwrite( int64 sock );
+
+#endif
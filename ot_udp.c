@@ -4,15 +4,25 @@
    $id$ */
 
 /* System */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sched.h>
+#endif
 
 /* Libowfat */
 #include "socket.h"
 #include "io.h"
+#include "ip6.h"
 
 /* Opentracker */
 #include "trackerlogic.h"
@@ -20,60 +30,136 @@
 #include "ot_stats.h"
 #include "ot_rijndael.h"
 
+/* AES-NI is picked at runtime, if the cpu supports it */
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define OT_UDP_AESNI
+#include <wmmintrin.h>
+#endif
+
 static const uint8_t g_static_connid[8] = { 0x23, 0x42, 0x05, 0x17, 0xde, 0x41, 0x50, 0xff };
 static uint32_t g_rijndael_round_key[44] = {0};
-static uint32_t g_key_of_the_hour[2] = {0};
-static ot_time  g_hour_of_the_key;
+
+/* Key ring: secret tweaks for the current and the previous hour, each in
+   the slot of its hour's parity. A slot is rewritten under a seqlock, seq
+   is odd while that happens. Readers copy the slot out and retry if seq
+   moved meanwhile, so they never see a tweak half way through its reuse */
+static struct { uint32_t key[4]; ot_time hour; unsigned int seq; } g_key_ring[2];
+static pthread_mutex_t g_key_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void udp_encrypt_table( const uint8_t plain[16], uint8_t crypt[16] ) {
+  rijndaelEncrypt128( g_rijndael_round_key, plain, crypt );
+}
+static void (*udp_encrypt)( const uint8_t plain[16], uint8_t crypt[16] ) = udp_encrypt_table;
+
+#ifdef OT_UDP_AESNI
+/* The same key schedule, in the byte order aesenc expects */
+static uint8_t g_aesni_round_key[11*16] __attribute__((aligned(16)));
+
+__attribute__((target("aes,sse2")))
+static void udp_encrypt_aesni( const uint8_t plain[16], uint8_t crypt[16] ) {
+  const __m128i *rk = (const __m128i *)g_aesni_round_key;
+  __m128i block = _mm_xor_si128( _mm_loadu_si128( (const __m128i *)plain ), _mm_load_si128( rk ) );
+  int round;
+  for( round=1; round<10; ++round )
+    block = _mm_aesenc_si128( block, _mm_load_si128( rk + round ) );
+  _mm_storeu_si128( (__m128i *)crypt, _mm_aesenclast_si128( block, _mm_load_si128( rk + 10 ) ) );
+}
+#endif
 
 static void udp_generate_rijndael_round_key() {
   uint8_t key[16];
-  key[0] = random(); key[1] = random(); key[2] = random(); key[3] = random();
+  int i;
+  for( i=0; i<16; ++i ) key[i] = random();
   rijndaelKeySetupEnc128( g_rijndael_round_key, key );
 
-  g_key_of_the_hour[0] = random();
-  g_hour_of_the_key = g_now_minutes;
+#ifdef OT_UDP_AESNI
+  if( __builtin_cpu_supports( "aes" ) ) {
+    for( i=0; i<44; ++i ) {
+      g_aesni_round_key[4*i  ] = g_rijndael_round_key[i] >> 24;
+      g_aesni_round_key[4*i+1] = g_rijndael_round_key[i] >> 16;
+      g_aesni_round_key[4*i+2] = g_rijndael_round_key[i] >> 8;
+      g_aesni_round_key[4*i+3] = g_rijndael_round_key[i];
+    }
+    udp_encrypt = udp_encrypt_aesni;
+  }
+#endif
 }
 
-/* Generate current and previous connection id for ip */
-static void udp_make_connectionid( uint32_t connid[2], const ot_ip6 remoteip, int age ) {
-  uint32_t plain[4], crypt[4];
-  int i;
-  if( g_now_minutes + 60 > g_hour_of_the_key ) {
-    g_hour_of_the_key = g_now_minutes;
-    g_key_of_the_hour[1] = g_key_of_the_hour[0];
-    g_key_of_the_hour[0] = random();
+/* Copies the tweak for hour to key, creating it when the hour just began.
+   Returns 0 if that hour has long expired */
+static int udp_key_of_the_hour( ot_time hour, uint32_t key[4] ) {
+  int slot = hour & 1, i;
+  unsigned int seq;
+  ot_time slot_hour;
+
+  do {
+    seq = __atomic_load_n( &g_key_ring[slot].seq, __ATOMIC_ACQUIRE );
+    for( i=0; i<4; ++i )
+      key[i] = __atomic_load_n( &g_key_ring[slot].key[i], __ATOMIC_RELAXED );
+    slot_hour = __atomic_load_n( &g_key_ring[slot].hour, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+  } while( ( seq & 1 ) || seq != __atomic_load_n( &g_key_ring[slot].seq, __ATOMIC_RELAXED ) );
+
+  if( slot_hour >= hour )
+    return slot_hour == hour;
+
+  /* Only writers take the mutex, so inside it the slot can be read plainly */
+  pthread_mutex_lock( &g_key_ring_mutex );
+  if( g_key_ring[slot].hour < hour ) {
+    seq = g_key_ring[slot].seq;
+    __atomic_store_n( &g_key_ring[slot].seq, seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    for( i=0; i<4; ++i )
+      __atomic_store_n( &g_key_ring[slot].key[i], (uint32_t)random(), __ATOMIC_RELAXED );
+    __atomic_store_n( &g_key_ring[slot].hour, hour, __ATOMIC_RELAXED );
+    __atomic_store_n( &g_key_ring[slot].seq, seq + 2, __ATOMIC_RELEASE );
   }
+  slot_hour = g_key_ring[slot].hour;
+  memcpy( key, g_key_ring[slot].key, sizeof(g_key_ring[slot].key) );
+  pthread_mutex_unlock( &g_key_ring_mutex );
+
+  return slot_hour == hour;
+}
+
+/* Generate current and previous connection id for ip, returns 0 if the
+   key for that hour is not available */
+static int udp_make_connectionid( uint32_t connid[2], const ot_ip6 remoteip, int age ) {
+  uint32_t plain[4], crypt[4], key[4];
+  int i;
+
+  if( !udp_key_of_the_hour( g_now_minutes / 60 - age, key ) )
+    return 0;
 
   memcpy( plain, remoteip, sizeof( plain ) );
-  for( i=0; i<4; ++i ) plain[i] ^= g_key_of_the_hour[age];
-  rijndaelEncrypt128( g_rijndael_round_key, (uint8_t*)remoteip, (uint8_t*)crypt );
+  for( i=0; i<4; ++i ) plain[i] ^= key[i];
+  udp_encrypt( (uint8_t*)plain, (uint8_t*)crypt );
   connid[0] = crypt[0] ^ crypt[1];
   connid[1] = crypt[2] ^ crypt[3];
+  return 1;
 }
 
-/* UDP implementation according to http://xbtt.sourceforge.net/udp_tracker_protocol.html */
-int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
-  ot_ip6      remoteip;
+/* UDP implementation according to http://xbtt.sourceforge.net/udp_tracker_protocol.html
+   Handles the packet of byte_count bytes in ws->inbuf, writes the answer
+   to ws->outbuf and returns its size, or 0 if no answer is to be sent */
+static size_t udp_handle_packet( struct ot_workstruct *ws, size_t byte_count, const ot_ip6 remoteip ) {
   uint32_t   *inpacket = (uint32_t*)ws->inbuf;
   uint32_t   *outpacket = (uint32_t*)ws->outbuf;
-  uint32_t    numwant, left, event, scopeid;
+  uint32_t    numwant, left, event;
   uint32_t    connid[2];
-  uint16_t    port, remoteport;
-  size_t      byte_count, scrape_count;
-
-  byte_count = socket_recv6( serversocket, ws->inbuf, G_INBUF_SIZE, remoteip, &remoteport, &scopeid );
-  if( !byte_count ) return 0;
+  uint16_t    port;
+  size_t      scrape_count;
 
   stats_issue_event( EVENT_ACCEPT, FLAG_UDP, (uintptr_t)remoteip );
   stats_issue_event( EVENT_READ, FLAG_UDP, byte_count );
 
   /* Minimum udp tracker packet size, also catches error */
   if( byte_count < 16 )
-    return 1;
+    return 0;
 
   /* Generate the connection id we give out and expect to and from
      the requesting ip address, this prevents udp spoofing */
-  udp_make_connectionid( connid, remoteip, 0 );
+  if( !udp_make_connectionid( connid, remoteip, 0 ) )
+    return 0;
 
   /* Initialise hash pointer */
   ws->hash = NULL;
@@ -85,14 +171,12 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
     /* If connection id does not match, try the one that was
        valid in the previous hour. Only if this also does not
        match, return an error packet */
-    udp_make_connectionid( connid, remoteip, 1 );
-    if( inpacket[0] != connid[0] || inpacket[1] != connid[1] ) {
+    if( !udp_make_connectionid( connid, remoteip, 1 ) || inpacket[0] != connid[0] || inpacket[1] != connid[1] ) {
       const size_t s = sizeof( "Connection ID missmatch." );
       outpacket[0] = 3; outpacket[1] = inpacket[3];
       memcpy( &outpacket[2], "Connection ID missmatch.", s );
-      socket_send6( serversocket, ws->outbuf, 8 + s, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_CONNID_MISSMATCH, FLAG_UDP, 8 + s );
-      return 1;
+      return 8 + s;
     }
   }
 
@@ -100,20 +184,19 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
     case 0: /* This is a connect action */
       /* look for udp bittorrent magic id */
       if( (ntohl(inpacket[0]) != 0x00000417) || (ntohl(inpacket[1]) != 0x27101980) )
-        return 1;
+        return 0;
 
       outpacket[0] = 0;
       outpacket[1] = inpacket[3];
       outpacket[2] = connid[0];
       outpacket[3] = connid[1];
 
-      socket_send6( serversocket, ws->outbuf, 16, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_CONNECT, FLAG_UDP, 16 );
-      break;
+      return 16;
     case 1: /* This is an announce action */
       /* Minimum udp announce packet size */
       if( byte_count < 98 )
-        return 1;
+        return 0;
 
       /* We do only want to know, if it is zero */
       left  = inpacket[64/4] | inpacket[68/4];
@@ -149,9 +232,8 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
         ws->reply_size = 8 + add_peer_to_torrent_and_return_peers( FLAG_UDP, ws, numwant );
       }
 
-      socket_send6( serversocket, ws->outbuf, ws->reply_size, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_ANNOUNCE, FLAG_UDP, ws->reply_size );
-      break;
+      return ws->reply_size;
 
     case 2: /* This is a scrape action */
       outpacket[0] = htonl( 2 );    /* scrape action */
@@ -160,23 +242,157 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
       for( scrape_count = 0; ( scrape_count * 20 < byte_count - 16) && ( scrape_count <= 74 ); scrape_count++ )
         return_udp_scrape_for_torrent( *(ot_hash*)( ((char*)inpacket) + 16 + 20 * scrape_count ), ((char*)outpacket) + 8 + 12 * scrape_count );
 
-      socket_send6( serversocket, ws->outbuf, 8 + 12 * scrape_count, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_SCRAPE, FLAG_UDP, scrape_count );
-      break;
+      return 8 + 12 * scrape_count;
   }
+  return 0;
+}
+
+int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
+  ot_ip6      remoteip;
+  uint32_t    scopeid;
+  uint16_t    remoteport;
+  size_t      byte_count, reply_size;
+
+  byte_count = socket_recv6( serversocket, ws->inbuf, G_INBUF_SIZE, remoteip, &remoteport, &scopeid );
+  if( !byte_count ) return 0;
+
+  reply_size = udp_handle_packet( ws, byte_count, remoteip );
+  if( reply_size )
+    socket_send6( serversocket, ws->outbuf, reply_size, remoteip, remoteport, 0 );
   return 1;
 }
 
+#ifdef __linux__
+/* Extract the ip address a datagram came from, v4 sockets report
+   plain sockaddr_in that we present v4 mapped */
+static int udp_sockaddr_ip6( const struct sockaddr_storage *addr, ot_ip6 remoteip ) {
+  if( addr->ss_family == AF_INET6 ) {
+    memcpy( remoteip, &((const struct sockaddr_in6*)addr)->sin6_addr, sizeof(ot_ip6) );
+    return 1;
+  }
+  if( addr->ss_family == AF_INET ) {
+    memcpy( remoteip, V4mappedprefix, sizeof( V4mappedprefix ) );
+    memcpy( remoteip + sizeof( V4mappedprefix ), &((const struct sockaddr_in*)addr)->sin_addr, 4 );
+    return 1;
+  }
+  return 0;
+}
+
+/* Drain up to batch_size datagrams with one recvmmsg, answer them all
+   and flush the replies with as few sendmmsg calls as possible */
+static void udp_worker_batched( int64 sock, struct ot_workstruct *ws, unsigned int batch_size ) {
+  struct mmsghdr          *in_msgs  = calloc( batch_size, sizeof(struct mmsghdr) );
+  struct mmsghdr          *out_msgs = calloc( batch_size, sizeof(struct mmsghdr) );
+  struct iovec            *in_iov   = calloc( batch_size, sizeof(struct iovec) );
+  struct iovec            *out_iov  = calloc( batch_size, sizeof(struct iovec) );
+  struct sockaddr_storage *addrs    = calloc( batch_size, sizeof(struct sockaddr_storage) );
+  char                    *inbufs   = malloc( (size_t)batch_size * G_INBUF_SIZE );
+  char                    *outbufs  = malloc( (size_t)batch_size * G_OUTBUF_SIZE );
+  unsigned int i;
+
+  if( !in_msgs || !out_msgs || !in_iov || !out_iov || !addrs || !inbufs || !outbufs ) {
+    fprintf( stderr, "Not enough memory for udp batch of %u packets, falling back to single packets.\n", batch_size );
+    batch_size = 0;
+  }
+
+  for( i=0; i<batch_size; ++i ) {
+    in_iov[i].iov_base            = inbufs + i * G_INBUF_SIZE;
+    in_iov[i].iov_len             = G_INBUF_SIZE;
+    in_msgs[i].msg_hdr.msg_iov    = in_iov + i;
+    in_msgs[i].msg_hdr.msg_iovlen = 1;
+    in_msgs[i].msg_hdr.msg_name   = addrs + i;
+    out_msgs[i].msg_hdr.msg_iov   = out_iov + i;
+    out_msgs[i].msg_hdr.msg_iovlen= 1;
+  }
+
+  while( batch_size && g_opentracker_running ) {
+    int received, sent;
+    unsigned int replies = 0;
+
+    for( i=0; i<batch_size; ++i )
+      in_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+
+    /* Block for the first packet only, then take what is queued */
+    received = recvmmsg( sock, in_msgs, batch_size, MSG_WAITFORONE, NULL );
+    if( received < 0 ) {
+      if( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) continue;
+      /* Anything else will not go away, do not spin on it */
+      fprintf( stderr, "Warning: recvmmsg failed (%s), falling back to single packets.\n", strerror( errno ) );
+      break;
+    }
+    if( !received ) continue;
+    stats_issue_event( EVENT_UDP_RECV_BATCH, FLAG_UDP, received );
+
+    for( i=0; i<(unsigned int)received; ++i ) {
+      ot_ip6 remoteip;
+      size_t reply_size;
+
+      if( !udp_sockaddr_ip6( addrs + i, remoteip ) ) continue;
+
+      ws->inbuf  = in_iov[i].iov_base;
+      ws->outbuf = outbufs + replies * G_OUTBUF_SIZE;
+      reply_size = udp_handle_packet( ws, in_msgs[i].msg_len, remoteip );
+      if( !reply_size ) continue;
+
+      out_iov[replies].iov_base             = ws->outbuf;
+      out_iov[replies].iov_len              = reply_size;
+      out_msgs[replies].msg_hdr.msg_name    = addrs + i;
+      out_msgs[replies].msg_hdr.msg_namelen = in_msgs[i].msg_hdr.msg_namelen;
+      ++replies;
+    }
+
+    /* sendmmsg stops at the first datagram that fails, skip it and go on */
+    for( i=0; i<replies; i+=sent ) {
+      sent = sendmmsg( sock, out_msgs + i, replies - i, 0 );
+      if( sent <= 0 )
+        sent = 1;
+      else
+        stats_issue_event( EVENT_UDP_SEND_BATCH, FLAG_UDP, sent );
+    }
+  }
+
+  free( in_msgs ); free( out_msgs ); free( in_iov ); free( out_iov ); free( addrs );
+  free( inbufs ); free( outbufs );
+}
+#endif
+
+struct udp_worker_args {
+  int64        sock;
+  unsigned int batch_size;
+  int          cpu;
+};
+
 static void* udp_worker( void * args ) {
-  int64 sock = (int64)args;
+  int64 sock = ((struct udp_worker_args*)args)->sock;
+  unsigned int batch_size = ((struct udp_worker_args*)args)->batch_size;
+  int cpu = ((struct udp_worker_args*)args)->cpu;
   struct ot_workstruct ws;
   memset( &ws, 0, sizeof(ws) );
 
-  ws.inbuf=malloc(G_INBUF_SIZE);
-  ws.outbuf=malloc(G_OUTBUF_SIZE);
 #ifdef    _DEBUG_HTTPERROR
   ws.debugbuf=malloc(G_DEBUGBUF_SIZE);
 #endif
+  ot_random_seed( &ws );
+
+#ifdef __linux__
+  /* Keep the worker on the cpu that the kernel steers its socket's packets to */
+  if( cpu >= 0 ) {
+    cpu_set_t cpuset;
+    CPU_ZERO( &cpuset );
+    CPU_SET( cpu, &cpuset );
+    if( pthread_setaffinity_np( pthread_self(), sizeof(cpuset), &cpuset ) )
+      fprintf( stderr, "Warning: Could not pin udp worker to cpu %d.\n", cpu );
+  }
+
+  if( batch_size > 1 )
+    udp_worker_batched( sock, &ws, batch_size );
+#else
+  (void)batch_size; (void)cpu;
+#endif
+
+  ws.inbuf=malloc(G_INBUF_SIZE);
+  ws.outbuf=malloc(G_OUTBUF_SIZE);
 
   while( g_opentracker_running )
     handle_udp6( sock, &ws );
@@ -189,15 +405,25 @@ static void* udp_worker( void * args ) {
   return NULL;
 }
 
-void udp_init( int64 sock, unsigned int worker_count ) {
+void udp_init( int64 sock, unsigned int worker_count, unsigned int batch_size, int cpu ) {
   pthread_t thread_id;
+  struct udp_worker_args *args;
   if( !g_rijndael_round_key[0] )
     udp_generate_rijndael_round_key();
+  if( !worker_count )
+    return;
 #ifdef _DEBUG
   fprintf( stderr, " installing %d workers on udp socket %ld", worker_count, (unsigned long)sock );
 #endif
+  /* Shared by all workers on this socket, who never return */
+  args = malloc( sizeof(struct udp_worker_args) );
+  if( !args )
+    exerr( "Could not allocate udp worker arguments." );
+  args->sock       = sock;
+  args->batch_size = batch_size;
+  args->cpu        = cpu;
   while( worker_count-- )
-    pthread_create( &thread_id, NULL, udp_worker, (void *)sock );
+    pthread_create( &thread_id, NULL, udp_worker, args );
 }
 
 const char *g_version_udp_c = "$Source$: $Revision$\n";
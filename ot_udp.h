@@ -6,7 +6,11 @@
 #ifndef __OT_UDP_H__
 #define __OT_UDP_H__
 
-void udp_init( int64 sock, unsigned int worker_count );
+/* Upper bound for datagrams drained with a single recvmmsg call */
+#define OT_UDP_BATCH_MAX 1024
+
+/* Workers are pinned to cpu unless it is negative */
+void udp_init( int64 sock, unsigned int worker_count, unsigned int batch_size, int cpu );
 int  handle_udp6( int64 serversocket, struct ot_workstruct *ws );
 
 #endif
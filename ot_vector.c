@@ -8,6 +8,9 @@
 #include <string.h>
 #include <strings.h>
 #include <stdint.h>
+#if defined( WANT_TORRENT_HASHTABLE ) && defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
 
 /* Opentracker */
 #include "trackerlogic.h"
@@ -17,10 +20,6 @@
 #include "uint32.h"
 #include "uint16.h"
 
-static int vector_compare_peer(const void *peer1, const void *peer2 ) {
-  return memcmp( peer1, peer2, OT_PEER_COMPARE_SIZE );
-}
-
 /* This function gives us a binary search that returns a pointer, even if
    no exact match is found. In that case it sets exactmatch 0 and gives
    calling functions the chance to insert data
@@ -47,13 +46,6 @@ void *binary_search( const void * const key, const void * base, const size_t mem
   return (void*)base;
 }
 
-static uint8_t vector_hash_peer( ot_peer *peer, int bucket_count ) {
-  unsigned int hash = 5381, i = OT_PEER_COMPARE_SIZE;
-  uint8_t *p = (uint8_t*)peer;
-  while( i-- ) hash += (hash<<5) + *(p++);
-  return hash % bucket_count;
-}
-
 /* This is the generic insert operation for our vector type.
    It tries to locate the object at "key" with size "member_size" by comparing its first "compare_size" bytes with
    those of objects in vector. Our special "binary_search" function does that and either returns the match or a
@@ -82,30 +74,149 @@ void *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, s
   return match;
 }
 
-ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch ) {
-  ot_peer *match;
+static uint8_t vector_hash_peer( const uint8_t *addr, int bucket_count ) {
+  unsigned int hash = 5381, i = OT_PEER_COMPARE_SIZE;
+  while( i-- ) hash += (hash<<5) + *(addr++);
+  return hash % bucket_count;
+}
+
+/* Sort order of peers in a vector: leechers first, then by address */
+static int vector_compare_peer( const void *peer1, const void *peer2 ) {
+  int seeding = ( OT_PEERFLAG( peer1 ) & PEER_FLAG_SEEDING ) - ( OT_PEERFLAG( peer2 ) & PEER_FLAG_SEEDING );
+  return seeding ? seeding : memcmp( peer1, peer2, OT_PEER_COMPARE_SIZE );
+}
 
-  /* If space is zero but size is set, we're dealing with a list of vector->size buckets */
+/* If space is zero but size is set, we're dealing with a list of vector->size buckets */
+static ot_vector *vector_peer_bucket( ot_vector *vector, const ot_peer *peer ) {
   if( vector->space < vector->size )
-    vector = ((ot_vector*)vector->data) + vector_hash_peer(peer, vector->size );
-  match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, exactmatch );
+    return ((ot_vector*)vector->data) + vector_hash_peer( (const uint8_t*)peer, vector->size );
+  return vector;
+}
 
-  if( *exactmatch ) return match;
+/* Leechers are sorted in front of all seeders, so their count is the index of the first seeder */
+size_t vector_count_leechers( const ot_vector *vector ) {
+  const uint8_t *flags = OT_VECTOR_PEER_FLAGS( vector );
+  size_t lo = 0, hi = vector->size;
+
+  while( lo < hi ) {
+    size_t mid = lo + ( hi - lo ) / 2;
+    if( flags[mid] & PEER_FLAG_SEEDING )
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
 
-  if( vector->size + 1 > vector->space ) {
-    size_t   new_space = vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS;
-    ot_peer *new_data = realloc( vector->data, new_space * sizeof(ot_peer) );
-    if( !new_data ) return NULL;
-    /* Adjust pointer if it moved by realloc */
-    match = new_data + (match - (ot_peer*)vector->data);
+/* Looks up the peer's address among leechers and seeders. If it is not
+   found, exactmatch is set 0 and the index returned is where the peer
+   belongs with its current seeding flag */
+static size_t vector_locate_peer( const ot_vector *vector, const ot_peer *peer, int *exactmatch ) {
+  uint8_t *addrs    = (uint8_t*)vector->data;
+  size_t   leechers = vector_count_leechers( vector );
+  uint8_t *leecher  = binary_search( peer, addrs, leechers, OT_PEER_COMPARE_SIZE, OT_PEER_COMPARE_SIZE, exactmatch );
+  uint8_t *seeder;
+
+  if( *exactmatch )
+    return ( leecher - addrs ) / OT_PEER_COMPARE_SIZE;
+
+  seeder = binary_search( peer, addrs + leechers * OT_PEER_COMPARE_SIZE, vector->size - leechers, OT_PEER_COMPARE_SIZE, OT_PEER_COMPARE_SIZE, exactmatch );
+  if( *exactmatch || ( OT_PEERFLAG( peer ) & PEER_FLAG_SEEDING ) )
+    return ( seeder - addrs ) / OT_PEER_COMPARE_SIZE;
+  return ( leecher - addrs ) / OT_PEER_COMPARE_SIZE;
+}
 
-    vector->data = new_data;
-    vector->space = new_space;
+/* Moves the peers to a block holding new_space peers.
+   Returns 0 if memory was short, in that case the vector is untouched */
+static int vector_resize_peers( ot_vector *vector, size_t new_space ) {
+  uint8_t *new_data = malloc( new_space * OT_PEER_STRIDE );
+  if( !new_data ) return 0;
+
+  if( vector->size ) {
+    memcpy( new_data, vector->data, vector->size * OT_PEER_COMPARE_SIZE );
+    memcpy( new_data + new_space * OT_PEER_COMPARE_SIZE, OT_VECTOR_PEER_FLAGS( vector ), vector->size );
+    memcpy( new_data + new_space * ( OT_PEER_COMPARE_SIZE + 1 ), OT_VECTOR_PEER_TIMES( vector ), vector->size );
   }
-  memmove( match + 1, match, sizeof(ot_peer) * ( ((ot_peer*)vector->data) + vector->size - match ) );
+  free( vector->data );
+  vector->data  = new_data;
+  vector->space = new_space;
+  return 1;
+}
+
+static void vector_set_peer( ot_vector *vector, size_t index, const ot_peer *peer ) {
+  memcpy( OT_VECTOR_PEER_ADDR( vector, index ), peer, OT_PEER_COMPARE_SIZE );
+  OT_VECTOR_PEER_FLAGS( vector )[index] = OT_PEERFLAG( peer );
+  OT_VECTOR_PEER_TIMES( vector )[index] = OT_PEERTIME( peer );
+}
+
+/* Caller has to make sure there is space for one more peer */
+static void vector_insert_peer_at( ot_vector *vector, size_t index, const ot_peer *peer ) {
+  size_t tail = vector->size - index;
 
+  memmove( OT_VECTOR_PEER_ADDR( vector, index + 1 ), OT_VECTOR_PEER_ADDR( vector, index ), tail * OT_PEER_COMPARE_SIZE );
+  memmove( OT_VECTOR_PEER_FLAGS( vector ) + index + 1, OT_VECTOR_PEER_FLAGS( vector ) + index, tail );
+  memmove( OT_VECTOR_PEER_TIMES( vector ) + index + 1, OT_VECTOR_PEER_TIMES( vector ) + index, tail );
+  vector_set_peer( vector, index, peer );
   vector->size++;
-  return match;
+}
+
+static void vector_delete_peer_at( ot_vector *vector, size_t index ) {
+  size_t tail = --vector->size - index;
+
+  memmove( OT_VECTOR_PEER_ADDR( vector, index ), OT_VECTOR_PEER_ADDR( vector, index + 1 ), tail * OT_PEER_COMPARE_SIZE );
+  memmove( OT_VECTOR_PEER_FLAGS( vector ) + index, OT_VECTOR_PEER_FLAGS( vector ) + index + 1, tail );
+  memmove( OT_VECTOR_PEER_TIMES( vector ) + index, OT_VECTOR_PEER_TIMES( vector ) + index + 1, tail );
+}
+
+void vector_get_peer( const ot_vector *vector, size_t index, ot_peer *peer ) {
+  memcpy( peer, OT_VECTOR_PEER_ADDR( vector, index ), OT_PEER_COMPARE_SIZE );
+  OT_PEERFLAG( peer ) = OT_VECTOR_PEER_FLAGS( vector )[index];
+  OT_PEERTIME( peer ) = OT_VECTOR_PEER_TIMES( vector )[index];
+}
+
+/* Looks up a peer by its address. Returns 1 and copies the stored peer to
+   found, if it is in the vector, 0 otherwise */
+int vector_find_peer( ot_vector *vector, const ot_peer *peer, ot_peer *found ) {
+  int    exactmatch;
+  size_t index;
+
+  vector = vector_peer_bucket( vector, peer );
+  index  = vector_locate_peer( vector, peer, &exactmatch );
+  if( !exactmatch )
+    return 0;
+  if( found )
+    vector_get_peer( vector, index, found );
+  return 1;
+}
+
+/* Stores peer, replacing any peer with the same address.
+   It returns 0 if memory was short
+              1 if the peer was new
+              2 if a peer was replaced
+*/
+int vector_store_peer( ot_vector *vector, const ot_peer *peer ) {
+  int    exactmatch, result = 1;
+  size_t index;
+
+  vector = vector_peer_bucket( vector, peer );
+  index  = vector_locate_peer( vector, peer, &exactmatch );
+
+  if( exactmatch ) {
+    /* Unless the peer moves between leechers and seeders, update in place */
+    if( !( ( OT_VECTOR_PEER_FLAGS( vector )[index] ^ OT_PEERFLAG( peer ) ) & PEER_FLAG_SEEDING ) ) {
+      vector_set_peer( vector, index, peer );
+      return 2;
+    }
+    vector_delete_peer_at( vector, index );
+    index  = vector_locate_peer( vector, peer, &exactmatch );
+    result = 2;
+  } else if( vector->size + 1 > vector->space ) {
+    if( !vector_resize_peers( vector, vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS ) )
+      return 0;
+  }
+
+  vector_insert_peer_at( vector, index, peer );
+  return result;
 }
 
 /* This is the non-generic delete from vector-operation specialized for peers in pools.
@@ -113,28 +224,37 @@ ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exac
               1 if a non-seeding peer was removed
               2 if a seeding peer was removed
 */
-int vector_remove_peer( ot_vector *vector, ot_peer *peer ) {
-  int      exactmatch;
-  ot_peer *match, *end;
+int vector_remove_peer( ot_vector *vector, const ot_peer *peer ) {
+  int    exactmatch;
+  size_t index;
 
   if( !vector->size ) return 0;
 
-  /* If space is zero but size is set, we're dealing with a list of vector->size buckets */
-  if( vector->space < vector->size )
-    vector = ((ot_vector*)vector->data) + vector_hash_peer(peer, vector->size );
-
-  end = ((ot_peer*)vector->data) + vector->size;
-  match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, &exactmatch );
+  vector = vector_peer_bucket( vector, peer );
+  index  = vector_locate_peer( vector, peer, &exactmatch );
   if( !exactmatch ) return 0;
 
-  exactmatch = ( OT_PEERFLAG( match ) & PEER_FLAG_SEEDING ) ? 2 : 1;
-  memmove( match, match + 1, sizeof(ot_peer) * ( end - match - 1 ) );
-
-  vector->size--;
+  exactmatch = ( OT_VECTOR_PEER_FLAGS( vector )[index] & PEER_FLAG_SEEDING ) ? 2 : 1;
+  vector_delete_peer_at( vector, index );
   vector_fixup_peers( vector );
   return exactmatch;
 }
 
+#ifndef WANT_TORRENT_HASHTABLE
+
+ot_torrent *vector_find_torrent( const ot_vector *vector, const ot_hash hash ) {
+  int         exactmatch;
+  ot_torrent *match = binary_search( hash, vector->data, vector->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  return exactmatch ? match : NULL;
+}
+
+ot_torrent *vector_find_or_insert_torrent( ot_vector *vector, const ot_hash hash, int *exactmatch ) {
+  ot_torrent *match = vector_find_or_insert( vector, (void*)hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, exactmatch );
+  if( match && !*exactmatch )
+    memcpy( match->hash, hash, sizeof( ot_hash ) );
+  return match;
+}
+
 void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
   ot_torrent *end = ((ot_torrent*)vector->data) + vector->size;
 
@@ -151,6 +271,236 @@ void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
   }
 }
 
+/* Makes room for count more torrents, so that inserting them in order
+   does not reallocate. Returns -1 if memory was short */
+int vector_reserve_torrents( ot_vector *vector, size_t count ) {
+  ot_torrent *new_data;
+
+  if( vector->size + count <= vector->space )
+    return 0;
+  new_data = realloc( vector->data, ( vector->size + count ) * sizeof( ot_torrent ) );
+  if( !new_data ) return -1;
+  vector->data  = new_data;
+  vector->space = vector->size + count;
+  return 0;
+}
+
+/* vector_remove_torrent already shrinks, only release empty vectors */
+void vector_fixup_torrents( ot_vector * vector ) {
+  if( !vector->size ) {
+    free( vector->data );
+    vector->data = NULL;
+    vector->space = 0;
+  }
+}
+
+#else
+
+/* The torrent hash table uses linear probing over vector->space slots, a
+   power of two. The slots are followed by one control byte per slot,
+   holding 7 bits of the slot's hash or OT_TORRENT_SLOT_EMPTY, a copy of
+   the first OT_TORRENT_GROUP control bytes, so that a group of control
+   bytes can always be compared in one go, and the table's hash seed.
+   The seed is chosen randomly each time the table is rebuilt, so clients
+   can not line up info hashes on one probe sequence. Removal shifts back
+   the entries that follow, so that no tombstones are needed */
+#define OT_TORRENT_GROUP          16
+#define OT_TORRENT_SLOT_EMPTY     0x80
+#define OT_TORRENT_MIN_SLOTS      OT_TORRENT_GROUP
+#define OT_TORRENT_MAX_LOAD(s)    (((s)/4)*3)
+
+#define OT_TORRENT_CTRL( vector ) (((uint8_t*)(vector)->data) + (vector)->space * sizeof( ot_torrent ))
+#define OT_TORRENT_SEED( vector ) (*(uint64_t*)(OT_TORRENT_CTRL( vector ) + (vector)->space + OT_TORRENT_GROUP))
+#define OT_TORRENT_TAG( h )       ((uint8_t)((h) >> 57))
+
+static uint64_t vector_hash_torrent( const ot_hash hash, uint64_t seed ) {
+  uint64_t h = seed;
+  uint32_t word;
+  int      i;
+
+  for( i=0; i<(int)sizeof( ot_hash ); i+=4 ) {
+    memcpy( &word, hash + i, sizeof( word ) );
+    h  = ( h ^ word ) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+/* Returns a bit mask of those control bytes in the group at ctrl that equal tag */
+static unsigned int vector_match_group( const uint8_t *ctrl, uint8_t tag ) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128( (const __m128i*)ctrl );
+  return (unsigned int)_mm_movemask_epi8( _mm_cmpeq_epi8( group, _mm_set1_epi8( (char)tag ) ) );
+#else
+  unsigned int i, mask = 0;
+  for( i=0; i<OT_TORRENT_GROUP; ++i )
+    mask |= ( ctrl[i] == tag ) << i;
+  return mask;
+#endif
+}
+
+static void vector_set_ctrl( ot_vector *vector, size_t slot, uint8_t value ) {
+  uint8_t *ctrl = OT_TORRENT_CTRL( vector );
+  ctrl[slot] = value;
+  if( slot < OT_TORRENT_GROUP )
+    ctrl[vector->space + slot] = value;
+}
+
+static ot_torrent *vector_lookup_torrent( const ot_vector *vector, const ot_hash hash, uint64_t h ) {
+  const uint8_t *ctrl = OT_TORRENT_CTRL( vector );
+  ot_torrent    *torrents = (ot_torrent*)vector->data;
+  size_t         mask = vector->space - 1, pos = h & mask;
+
+  /* The table never fills up, so every probe ends at an empty slot */
+  while( 1 ) {
+    unsigned int match = vector_match_group( ctrl + pos, OT_TORRENT_TAG( h ) );
+    while( match ) {
+      ot_torrent *torrent = torrents + ( ( pos + __builtin_ctz( match ) ) & mask );
+      if( !memcmp( torrent->hash, hash, sizeof( ot_hash ) ) )
+        return torrent;
+      match &= match - 1;
+    }
+    if( vector_match_group( ctrl + pos, OT_TORRENT_SLOT_EMPTY ) )
+      return NULL;
+    pos = ( pos + OT_TORRENT_GROUP ) & mask;
+  }
+}
+
+/* Puts hash into the first empty slot of its probe sequence. Caller has
+   to make sure, the table has room */
+static ot_torrent *vector_place_torrent( ot_vector *vector, const ot_hash hash, uint64_t h ) {
+  const uint8_t *ctrl = OT_TORRENT_CTRL( vector );
+  size_t         mask = vector->space - 1, pos = h & mask, slot;
+  unsigned int   empty;
+
+  while( !( empty = vector_match_group( ctrl + pos, OT_TORRENT_SLOT_EMPTY ) ) )
+    pos = ( pos + OT_TORRENT_GROUP ) & mask;
+
+  slot = ( pos + __builtin_ctz( empty ) ) & mask;
+  vector_set_ctrl( vector, slot, OT_TORRENT_TAG( h ) );
+  memcpy( ((ot_torrent*)vector->data)[slot].hash, hash, sizeof( ot_hash ) );
+  vector->size++;
+  return ((ot_torrent*)vector->data) + slot;
+}
+
+/* Moves all torrents into a fresh table of new_space slots.
+   Returns -1 if memory was short, in that case the old table stays */
+static int vector_rehash_torrents( ot_vector *vector, size_t new_space ) {
+  ot_torrent *torrents = (ot_torrent*)vector->data;
+  uint8_t    *ctrl = OT_TORRENT_CTRL( vector );
+  ot_vector   new_vector;
+  uint64_t    seed;
+  size_t      slot;
+
+  new_vector.size  = 0;
+  new_vector.space = new_space;
+  new_vector.data  = calloc( 1, new_space * ( sizeof( ot_torrent ) + 1 ) + OT_TORRENT_GROUP + sizeof( uint64_t ) );
+  if( !new_vector.data ) return -1;
+
+  memset( OT_TORRENT_CTRL( &new_vector ), OT_TORRENT_SLOT_EMPTY, new_space + OT_TORRENT_GROUP );
+  seed = ( (uint64_t)random() << 32 ) ^ (uint64_t)random();
+  OT_TORRENT_SEED( &new_vector ) = seed;
+
+  for( slot=0; slot<vector->space; ++slot )
+    if( !( ctrl[slot] & OT_TORRENT_SLOT_EMPTY ) )
+      vector_place_torrent( &new_vector, torrents[slot].hash, vector_hash_torrent( torrents[slot].hash, seed ) )->peer_list = torrents[slot].peer_list;
+
+  free( vector->data );
+  *vector = new_vector;
+  return 0;
+}
+
+ot_torrent *vector_find_torrent( const ot_vector *vector, const ot_hash hash ) {
+  if( !vector->size )
+    return NULL;
+  return vector_lookup_torrent( vector, hash, vector_hash_torrent( hash, OT_TORRENT_SEED( vector ) ) );
+}
+
+ot_torrent *vector_find_or_insert_torrent( ot_vector *vector, const ot_hash hash, int *exactmatch ) {
+  ot_torrent *match = NULL;
+  uint64_t    h = 0;
+
+  if( vector->space ) {
+    h = vector_hash_torrent( hash, OT_TORRENT_SEED( vector ) );
+    match = vector_lookup_torrent( vector, hash, h );
+  }
+
+  if( ( *exactmatch = ( match != NULL ) ) )
+    return match;
+
+  if( vector->size + 1 > OT_TORRENT_MAX_LOAD( vector->space ) ) {
+    if( vector_rehash_torrents( vector, vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_TORRENT_MIN_SLOTS ) )
+      return NULL;
+    h = vector_hash_torrent( hash, OT_TORRENT_SEED( vector ) );
+  }
+
+  return vector_place_torrent( vector, hash, h );
+}
+
+/* Grows the table once, so that count more torrents fit.
+   Returns -1 if memory was short */
+int vector_reserve_torrents( ot_vector *vector, size_t count ) {
+  size_t new_space = vector->space ? vector->space : OT_TORRENT_MIN_SLOTS;
+
+  while( vector->size + count > OT_TORRENT_MAX_LOAD( new_space ) )
+    new_space *= OT_VECTOR_GROW_RATIO;
+  if( new_space == vector->space )
+    return 0;
+  return vector_rehash_torrents( vector, new_space );
+}
+
+/* Removing a torrent never moves the table, so it is safe while iterating
+   over the slots. The slot of the removed torrent may afterwards hold a
+   torrent from further down the probe sequence, so look at it again.
+   Call vector_fixup_torrents when done removing */
+void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
+  ot_torrent *torrents = (ot_torrent*)vector->data;
+  uint8_t    *ctrl = OT_TORRENT_CTRL( vector );
+  size_t      mask = vector->space - 1, hole = match - torrents, slot = hole;
+
+  if( !vector->size ) return;
+
+  /* If this is being called after a unsuccessful malloc() for peer_list
+     in add_peer_to_torrent, match->peer_list actually might be NULL */
+  if( match->peer_list) free_peerlist( match->peer_list );
+
+  /* Pull back each following entry, whose home slot does not lie between
+     the hole and itself, those would not be found anymore */
+  while( !( ctrl[ slot = ( slot + 1 ) & mask ] & OT_TORRENT_SLOT_EMPTY ) ) {
+    size_t home = vector_hash_torrent( torrents[slot].hash, OT_TORRENT_SEED( vector ) ) & mask;
+    if( ( ( slot - home ) & mask ) >= ( ( slot - hole ) & mask ) ) {
+      memcpy( torrents + hole, torrents + slot, sizeof( ot_torrent ) );
+      vector_set_ctrl( vector, hole, ctrl[slot] );
+      hole = slot;
+    }
+  }
+
+  vector_set_ctrl( vector, hole, OT_TORRENT_SLOT_EMPTY );
+  memset( torrents + hole, 0, sizeof( ot_torrent ) );
+  vector->size--;
+}
+
+/* Shrinks tables that vector_remove_torrent left sparse */
+void vector_fixup_torrents( ot_vector * vector ) {
+  size_t new_space = vector->space;
+
+  if( !vector->size ) {
+    free( vector->data );
+    vector->data = NULL;
+    vector->space = 0;
+    return;
+  }
+
+  while( ( new_space > OT_TORRENT_MIN_SLOTS ) && ( vector->size * OT_VECTOR_SHRINK_THRESH < new_space ) )
+    new_space /= OT_VECTOR_SHRINK_RATIO;
+
+  /* If memory is short, just keep the larger table */
+  if( new_space != vector->space )
+    vector_rehash_torrents( vector, new_space );
+}
+
+#endif
+
 void vector_clean_list( ot_vector * vector, int num_buckets ) {
   while( num_buckets-- )
     free( vector[num_buckets].data );
@@ -159,8 +509,10 @@ void vector_clean_list( ot_vector * vector, int num_buckets ) {
 }
 
 void vector_redistribute_buckets( ot_peerlist * peer_list ) {
-  int tmp, bucket, bucket_size_new, num_buckets_new, num_buckets_old = 1;
+  int bucket, num_buckets_new, num_buckets_old = 1;
   ot_vector * bucket_list_new, * bucket_list_old = &peer_list->peers;
+  size_t offsets[64+1], fill[64], peer_count = 0, i;
+  ot_peer * peers;
 
   if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
     num_buckets_old = peer_list->peers.size;
@@ -185,46 +537,53 @@ void vector_redistribute_buckets( ot_peerlist * peer_list ) {
   if( num_buckets_new == num_buckets_old )
     return;
 
-  /* Assume near perfect distribution */
+  for( bucket=0; bucket<num_buckets_old; ++bucket )
+    peer_count += bucket_list_old[bucket].size;
+  if( !peer_count )
+    return;
+
   bucket_list_new = malloc( num_buckets_new * sizeof( ot_vector ) );
-  if( !bucket_list_new) return;
+  peers = malloc( peer_count * sizeof( ot_peer ) );
+  if( !bucket_list_new || !peers ) {
+    free( bucket_list_new );
+    free( peers );
+    return;
+  }
   bzero( bucket_list_new, num_buckets_new * sizeof( ot_vector ) );
 
-  tmp = peer_list->peer_count / num_buckets_new;
-  bucket_size_new = OT_VECTOR_MIN_MEMBERS;
-  while( bucket_size_new < tmp)
-    bucket_size_new *= OT_VECTOR_GROW_RATIO;
-
-  /* preallocate vectors to hold all peers */
+  /* Count peers per new bucket, then unpack them into one array, grouped by bucket */
+  bzero( offsets, sizeof( offsets ) );
+  for( bucket=0; bucket<num_buckets_old; ++bucket )
+    for( i=0; i<bucket_list_old[bucket].size; ++i )
+      offsets[ 1 + vector_hash_peer( OT_VECTOR_PEER_ADDR( bucket_list_old + bucket, i ), num_buckets_new ) ]++;
   for( bucket=0; bucket<num_buckets_new; ++bucket ) {
-    bucket_list_new[bucket].space = bucket_size_new;
-    bucket_list_new[bucket].data  = malloc( bucket_size_new * sizeof(ot_peer) );
-    if( !bucket_list_new[bucket].data )
-      return vector_clean_list( bucket_list_new, num_buckets_new );
+    offsets[bucket+1] += offsets[bucket];
+    fill[bucket] = offsets[bucket];
   }
 
-  /* Now sort them into the correct bucket */
-  for( bucket=0; bucket<num_buckets_old; ++bucket ) {
-    ot_peer * peers_old = bucket_list_old[bucket].data, * peers_new;
-    int peer_count_old = bucket_list_old[bucket].size;
-    while( peer_count_old-- ) {
-      ot_vector * bucket_dest = bucket_list_new;
-      if( num_buckets_new > 1 )
-        bucket_dest += vector_hash_peer(peers_old, num_buckets_new);
-      if( bucket_dest->size + 1 > bucket_dest->space ) {
-        void * tmp = realloc( bucket_dest->data, sizeof(ot_peer) * OT_VECTOR_GROW_RATIO * bucket_dest->space );
-        if( !tmp ) return vector_clean_list( bucket_list_new, num_buckets_new );
-        bucket_dest->data   = tmp;
-        bucket_dest->space *= OT_VECTOR_GROW_RATIO;
-      }
-      peers_new = (ot_peer*)bucket_dest->data;
-      memcpy(peers_new + bucket_dest->size++, peers_old++, sizeof(ot_peer));
+  for( bucket=0; bucket<num_buckets_old; ++bucket )
+    for( i=0; i<bucket_list_old[bucket].size; ++i ) {
+      int dest = vector_hash_peer( OT_VECTOR_PEER_ADDR( bucket_list_old + bucket, i ), num_buckets_new );
+      vector_get_peer( bucket_list_old + bucket, i, peers + fill[dest]++ );
     }
-  }
 
-  /* Now sort each bucket to later allow bsearch */
-  for( bucket=0; bucket<num_buckets_new; ++bucket )
-    qsort( bucket_list_new[bucket].data, bucket_list_new[bucket].size, sizeof( ot_peer ), vector_compare_peer );
+  /* Now sort each bucket to later allow bsearch and pack it into its vector */
+  for( bucket=0; bucket<num_buckets_new; ++bucket ) {
+    size_t count = offsets[bucket+1] - offsets[bucket], space = OT_VECTOR_MIN_MEMBERS;
+    while( space < count )
+      space *= OT_VECTOR_GROW_RATIO;
+
+    if( !vector_resize_peers( bucket_list_new + bucket, space ) ) {
+      free( peers );
+      return vector_clean_list( bucket_list_new, num_buckets_new );
+    }
+
+    qsort( peers + offsets[bucket], count, sizeof( ot_peer ), vector_compare_peer );
+    for( i=0; i<count; ++i )
+      vector_set_peer( bucket_list_new + bucket, i, peers + offsets[bucket] + i );
+    bucket_list_new[bucket].size = count;
+  }
+  free( peers );
 
   /* Everything worked fine. Now link new bucket_list to peer_list */
   if( OT_PEERLIST_HASBUCKETS( peer_list) )
@@ -244,8 +603,38 @@ void vector_redistribute_buckets( ot_peerlist * peer_list ) {
   }
 }
 
+/* Fills an empty peer list with count peers in no particular order, peers
+   is sorted in place. Peers appearing twice are stored once.
+   Returns 0 if memory was short, in that case the peer list stays empty */
+int vector_fill_peers( ot_peerlist *peer_list, ot_peer *peers, size_t count ) {
+  ot_vector *vector = &peer_list->peers;
+  size_t     space = OT_VECTOR_MIN_MEMBERS, i;
+
+  if( !count )
+    return 1;
+  while( space < count )
+    space *= OT_VECTOR_GROW_RATIO;
+  if( !vector_resize_peers( vector, space ) )
+    return 0;
+
+  qsort( peers, count, sizeof( ot_peer ), vector_compare_peer );
+  for( i=0; i<count; ++i ) {
+    if( vector->size && !vector_compare_peer( peers + i, peers + i - 1 ) )
+      continue;
+    vector_set_peer( vector, vector->size++, peers + i );
+    if( OT_PEERFLAG( peers + i ) & PEER_FLAG_SEEDING )
+      peer_list->seed_count++;
+  }
+  peer_list->peer_count = vector->size;
+
+  /* Large swarms go to peer buckets right away */
+  if( peer_list->peer_count > OT_PEER_BUCKET_MINCOUNT )
+    vector_redistribute_buckets( peer_list );
+  return 1;
+}
+
 void vector_fixup_peers( ot_vector * vector ) {
-  int need_fix = 0;
+  size_t new_space = vector->space;
 
   if( !vector->size ) {
     free( vector->data );
@@ -254,13 +643,13 @@ void vector_fixup_peers( ot_vector * vector ) {
     return;
   }
 
-  while( ( vector->size * OT_VECTOR_SHRINK_THRESH < vector->space ) &&
-         ( vector->space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) ) {
-    vector->space /= OT_VECTOR_SHRINK_RATIO;
-    need_fix++;
-  }
-  if( need_fix )
-    vector->data = realloc( vector->data, vector->space * sizeof( ot_peer ) );
+  while( ( vector->size * OT_VECTOR_SHRINK_THRESH < new_space ) &&
+         ( new_space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) )
+    new_space /= OT_VECTOR_SHRINK_RATIO;
+
+  /* If memory is short, just keep the larger block */
+  if( new_space != vector->space )
+    vector_resize_peers( vector, new_space );
 }
 
 const char *g_version_vector_c = "$Source$: $Revision$\n";
@@ -21,14 +21,49 @@ typedef struct {
   size_t  space;
 } ot_vector;
 
+/* Peer vectors do not hold ot_peers, but keep the addresses and ports of
+   all peers contiguous, followed by the flags of all peers and then their
+   ages, each array sized for vector->space peers:
+     | addr[0] .. addr[space-1] | flag[0] .. flag[space-1] | time[0] .. |
+   Peers are sorted by their seeding flag first, then by address, so that
+   leechers and seeders each form one block of addresses */
+#define OT_PEER_STRIDE                   ((OT_PEER_COMPARE_SIZE)+2)
+#define OT_VECTOR_PEER_ADDR( vector, i ) (((uint8_t*)(vector)->data) + (i) * (OT_PEER_COMPARE_SIZE))
+#define OT_VECTOR_PEER_FLAGS( vector )   (((uint8_t*)(vector)->data) + (vector)->space * (OT_PEER_COMPARE_SIZE))
+#define OT_VECTOR_PEER_TIMES( vector )   (OT_VECTOR_PEER_FLAGS( vector ) + (vector)->space)
+
+/* Torrents in a bucket either live in a vector sorted by info hash or, with
+   WANT_TORRENT_HASHTABLE, in an open addressing hash table. In the latter
+   case data holds space slots, size of them in use, in no particular order.
+   Unused slots have a NULL peer_list. Iterate over torrents like this:
+     for( i=0; i<OT_TORRENT_SLOTS( vector ); ++i )
+       if( OT_TORRENT_SLOT_USED( (ot_torrent*)vector->data + i ) ) ...
+*/
+#ifdef WANT_TORRENT_HASHTABLE
+#define OT_TORRENT_SLOTS( vector )      ((vector)->space)
+#define OT_TORRENT_SLOT_USED( torrent ) ((torrent)->peer_list != NULL)
+#else
+#define OT_TORRENT_SLOTS( vector )      ((vector)->size)
+#define OT_TORRENT_SLOT_USED( torrent ) 1
+#endif
+
 void    *binary_search( const void * const key, const void * base, const size_t member_count, const size_t member_size,
                         size_t compare_size, int *exactmatch );
 void    *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, size_t compare_size, int *exactmatch );
-ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch );
 
-int      vector_remove_peer( ot_vector *vector, ot_peer *peer );
+ot_torrent *vector_find_torrent( const ot_vector *vector, const ot_hash hash );
+ot_torrent *vector_find_or_insert_torrent( ot_vector *vector, const ot_hash hash, int *exactmatch );
+
+int      vector_find_peer( ot_vector *vector, const ot_peer *peer, ot_peer *found );
+int      vector_store_peer( ot_vector *vector, const ot_peer *peer );
+int      vector_remove_peer( ot_vector *vector, const ot_peer *peer );
+void     vector_get_peer( const ot_vector *vector, size_t index, ot_peer *peer );
+size_t   vector_count_leechers( const ot_vector *vector );
 void     vector_remove_torrent( ot_vector *vector, ot_torrent *match );
+int      vector_reserve_torrents( ot_vector *vector, size_t count );
+void     vector_fixup_torrents( ot_vector * vector );
 void     vector_redistribute_buckets( ot_peerlist * peer_list );
 void     vector_fixup_peers( ot_vector * vector );
+int      vector_fill_peers( ot_peerlist *peer_list, ot_peer *peers, size_t count );
 
 #endif
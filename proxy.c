@@ -123,17 +123,16 @@ void livesync_bind_mcast( ot_ip6 ip, uint16_t port) {
 size_t add_peer_to_torrent_proxy( ot_hash hash, ot_peer *peer ) {
   int         exactmatch;
   ot_torrent *torrent;
-  ot_peer    *peer_dest;
   ot_vector  *torrents_list = mutex_bucket_lock_by_hash( hash );
 
-  torrent = vector_find_or_insert( torrents_list, (void*)hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
-  if( !torrent )
+  torrent = vector_find_or_insert_torrent( torrents_list, hash, &exactmatch );
+  if( !torrent ) {
+    mutex_bucket_unlock_by_hash( hash, 0 );
     return -1;
+  }
 
   if( !exactmatch ) {
     /* Create a new torrent entry, then */
-    memcpy( torrent->hash, hash, sizeof(ot_hash) );
-
     if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
       vector_remove_torrent( torrents_list, torrent );
       mutex_bucket_unlock_by_hash( hash, 0 );
@@ -143,32 +142,29 @@ size_t add_peer_to_torrent_proxy( ot_hash hash, ot_peer *peer ) {
     byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
   }
 
-  /* Check for peer in torrent */
-  peer_dest = vector_find_or_insert_peer( &(torrent->peer_list->peers), peer, &exactmatch );
-  if( !peer_dest ) {
-    mutex_bucket_unlock_by_hash( hash, 0 );
-    return -1;
-  }
   /* Tell peer that it's fresh */
   OT_PEERTIME( peer ) = 0;
 
-  /* If we hadn't had a match create peer there */
-  if( !exactmatch ) {
-    torrent->peer_list->peer_count++;
-    if( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING )
-      torrent->peer_list->seed_count++;
+  /* Store peer in torrent, if we hadn't had a match, count it */
+  switch( vector_store_peer( &(torrent->peer_list->peers), peer ) ) {
+    case 0:
+      mutex_bucket_unlock_by_hash( hash, 0 );
+      return -1;
+    case 1:
+      torrent->peer_list->peer_count++;
+      if( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING )
+        torrent->peer_list->seed_count++; /* Fall through intended */
+    default: break;
   }
-  memcpy( peer_dest, peer, sizeof(ot_peer) );
   mutex_bucket_unlock_by_hash( hash, 0 );
   return 0;
 }
 
 size_t remove_peer_from_torrent_proxy( ot_hash hash, ot_peer *peer ) {
-  int          exactmatch;
   ot_vector   *torrents_list = mutex_bucket_lock_by_hash( hash );
-  ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_torrent  *torrent = vector_find_torrent( torrents_list, hash );
 
-  if( exactmatch ) {
+  if( torrent ) {
     ot_peerlist *peer_list = torrent->peer_list;
     switch( vector_remove_peer( &peer_list->peers, peer ) ) {
       case 2:  peer_list->seed_count--; /* Fall throughs intended */
@@ -585,6 +581,7 @@ int main( int argc, char **argv ) {
 
   if( !lbound ) exerr( "No livesync port bound." );
   if( !g_connection_count && !sbound ) exerr( "No streamsync port bound." );
+  mutex_init( );
   pthread_create( &sync_in_thread_id, NULL, livesync_worker, NULL );
   pthread_create( &sync_out_thread_id, NULL, streamsync_worker, NULL );
 
@@ -607,9 +604,11 @@ static void * streamsync_worker( void * args ) {
       if( !torrents_list->size ) goto unlock_continue;
 
       /* For each torrent in this bucket.. */
-      for( tor_offset=0; tor_offset<torrents_list->size; ++tor_offset ) {
+      for( tor_offset=0; tor_offset<OT_TORRENT_SLOTS( torrents_list ); ++tor_offset ) {
         /* Address torrents members */
         ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[tor_offset] ).peer_list;
+        if( !OT_TORRENT_SLOT_USED( (ot_torrent*)(torrents_list->data) + tor_offset ) )
+          continue;
         switch( peer_list->peer_count ) {
           case 2:  count_two++; break;
           case 1:  count_one++; break;
@@ -659,13 +658,16 @@ static void * streamsync_worker( void * args ) {
       }
 
       /* For each torrent in this bucket.. */
-      for( tor_offset=0; tor_offset<torrents_list->size; ++tor_offset ) {
+      for( tor_offset=0; tor_offset<OT_TORRENT_SLOTS( torrents_list ); ++tor_offset ) {
         /* Address torrents members */
         ot_torrent *torrent = ((ot_torrent*)(torrents_list->data)) + tor_offset;
         ot_peerlist *peer_list = torrent->peer_list;
-        ot_peer *peers = (ot_peer*)(peer_list->peers.data);
+        size_t peer;
         uint8_t **dst;
 
+        if( !OT_TORRENT_SLOT_USED( torrent ) )
+          continue;
+
         /* Determine destination slot */
         count_peers = peer_list->peer_count;
         switch( count_peers ) {
@@ -689,10 +691,10 @@ static void * streamsync_worker( void * args ) {
             count_peers >>= 7;
           }
 
-        /* Copy peers */
-        count_peers = peer_list->peer_count;
-        while( count_peers-- ) {
-          memcpy( *dst, peers++, OT_IP_SIZE + 3 );
+        /* Copy peers, address, port and flags */
+        for( peer=0; peer<peer_list->peer_count; ++peer ) {
+          memcpy( *dst, OT_VECTOR_PEER_ADDR( &peer_list->peers, peer ), OT_PEER_COMPARE_SIZE );
+          (*dst)[OT_PEER_COMPARE_SIZE] = OT_VECTOR_PEER_FLAGS( &peer_list->peers )[peer];
           *dst += OT_IP_SIZE + 3;
         }
         free_peerlist(peer_list);
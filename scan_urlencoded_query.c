@@ -10,6 +10,7 @@
 #include "scan.h"
 
 /* System */
+#include <stdint.h>
 #include <string.h>
 
 /* Idea is to do a in place replacement or guarantee at least
@@ -140,4 +141,15 @@ ssize_t scan_fixed_int( char *data, size_t len, int *tmp ) {
   return len;
 }
 
+ssize_t scan_fixed_time( char *data, size_t len, time_t *tmp ) {
+  const uint64_t max = ( (uint64_t)1 << ( 8 * sizeof(time_t) - 1 ) ) - 1;
+  uint64_t value = 0;
+  while( (len > 0) && (*data >= '0') && (*data <= '9') ) {
+    if( value > ( max - ( *data - '0' ) ) / 10 ) break;
+    --len; value = 10*value + *data++-'0';
+  }
+  *tmp = (time_t)value;
+  return len;
+}
+
 const char *g_version_scan_urlencoded_query_c = "$Source$: $Revision$\n";
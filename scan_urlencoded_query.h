@@ -52,4 +52,8 @@ void scan_urlencoded_skipvalue( char **string );
  */
 ssize_t scan_fixed_int( char *data, size_t len, int *number );
 
+/* Like scan_fixed_int for non negative points in time, values that do
+   not fit into a time_t are not parsed */
+ssize_t scan_fixed_time( char *data, size_t len, time_t *number );
+
 #endif
@@ -0,0 +1,102 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Measures what inserting a new torrent costs under the bucket lock, for
+   several values of tracker.buckets. The buckets are filled up with a
+   population of torrents first, then BENCH_INSERTS fresh ones are timed.
+   Usage: tests/bench_buckets [torrents] */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Libowfat */
+#include "uint32.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_vector.h"
+
+#define BENCH_INSERTS 200000
+
+/* Only ot_vector.c is linked in, it references this when it shrinks
+   torrent vectors */
+void free_peerlist( ot_peerlist *peer_list ) { (void)peer_list; }
+
+/* The torrent hash table marks used slots by their peer list */
+static char g_peer_list;
+
+static uint64_t bench_random( uint64_t *state ) {
+  uint64_t z = ( *state += 0x9e3779b97f4a7c15ULL );
+  z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+  z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+  return z ^ ( z >> 31 );
+}
+
+static void bench_hash( uint64_t *state, ot_hash hash ) {
+  uint64_t r[3] = { bench_random( state ), bench_random( state ), bench_random( state ) };
+  memcpy( hash, r, sizeof(ot_hash) );
+}
+
+static double bench_nsec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_insert( ot_vector *buckets, int bits, uint64_t *state ) {
+  ot_hash     hash;
+  ot_torrent *torrent;
+  int         exactmatch;
+
+  bench_hash( state, hash );
+  torrent = vector_find_or_insert_torrent( buckets + ( uint32_read_big( (char*)hash ) >> ( 32 - bits ) ), hash, &exactmatch );
+  if( !torrent )
+    return -1;
+  if( !exactmatch )
+    torrent->peer_list = (ot_peerlist*)&g_peer_list;
+  return 0;
+}
+
+int main( int argc, char **argv ) {
+  size_t torrents = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 4000000;
+  int    bits;
+
+  printf( "Inserting %d torrents into %zu torrents spread over the buckets:\n", BENCH_INSERTS, torrents );
+  printf( "%10s %18s %14s\n", "buckets", "torrents/bucket", "ns/insert" );
+
+  for( bits=OT_BUCKET_COUNT_BITS_DEFAULT; bits<=18; bits+=2 ) {
+    ot_vector *buckets = calloc( (size_t)1 << bits, sizeof(ot_vector) );
+    uint64_t   state = 0x2342;
+    double     start;
+    size_t     i;
+
+    if( !buckets ) {
+      fprintf( stderr, "Out of memory.\n" );
+      return 1;
+    }
+
+    for( i=0; i<torrents; ++i )
+      if( bench_insert( buckets, bits, &state ) ) {
+        fprintf( stderr, "Out of memory.\n" );
+        return 1;
+      }
+
+    start = bench_nsec( );
+    for( i=0; i<BENCH_INSERTS; ++i )
+      if( bench_insert( buckets, bits, &state ) ) {
+        fprintf( stderr, "Out of memory.\n" );
+        return 1;
+      }
+    printf( "%10u %18zu %14.1f\n", 1u << bits, ( torrents + BENCH_INSERTS ) >> bits, ( bench_nsec( ) - start ) / BENCH_INSERTS );
+
+    for( i=0; i<( (size_t)1 << bits ); ++i )
+      free( buckets[i].data );
+    free( buckets );
+  }
+  return 0;
+}
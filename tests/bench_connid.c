@@ -0,0 +1,104 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Measures what deriving a udp connection id costs with the table driven
+   rijndael and with AES-NI, after checking that both encrypt every block
+   alike. Cycles are counted by the time stamp counter.
+   Usage: tests/bench_connid [rounds] */
+
+/* Opentracker, the module under test and what it needs to link. It comes
+   first, so that it defines _GNU_SOURCE before any system header */
+#include "ot_udp.c"
+#include "ot_rijndael.c"
+
+/* System */
+#include <time.h>
+
+#ifdef OT_UDP_AESNI
+#include <x86intrin.h>
+#endif
+
+#define BENCH_CHECKS 1000000
+
+time_t       g_now_seconds;
+volatile int g_opentracker_running = 1;
+
+void exerr( char * message ) { fprintf( stderr, "%s\n", message ); exit( 1 ); }
+void free_peerlist( ot_peerlist *peer_list ) { (void)peer_list; }
+void ot_random_seed( struct ot_workstruct *ws ) { (void)ws; }
+size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstruct *ws, size_t amount ) { (void)proto; (void)ws; (void)amount; return 0; }
+size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) { (void)proto; (void)ws; return 0; }
+size_t return_udp_scrape_for_torrent( ot_hash hash, char *reply ) { (void)hash; (void)reply; return 0; }
+void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event_data ) { (void)event; (void)proto; (void)event_data; }
+
+static double bench_nsec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t bench_cycles( void ) {
+#ifdef OT_UDP_AESNI
+  return __rdtsc( );
+#else
+  return 0;
+#endif
+}
+
+static void bench_run( const char *name, void (*encrypt)( const uint8_t plain[16], uint8_t crypt[16] ), unsigned long rounds ) {
+  uint32_t      connid[2], sink = 0;
+  ot_ip6        ip;
+  unsigned long i;
+  uint64_t      cycles;
+  double        start;
+
+  udp_encrypt = encrypt;
+  memset( ip, 0, sizeof(ip) );
+  start  = bench_nsec( );
+  cycles = bench_cycles( );
+  for( i=0; i<rounds; ++i ) {
+    /* A new address every round, as under a flood of connects */
+    memcpy( ip + 12, &i, 4 );
+    udp_make_connectionid( connid, ip, 0 );
+    sink += connid[0] ^ connid[1];
+  }
+  cycles = bench_cycles( ) - cycles;
+  printf( "%10s %14.1f %14.1f   (%08x)\n", name, (double)cycles / rounds, ( bench_nsec( ) - start ) / rounds, sink );
+}
+
+int main( int argc, char **argv ) {
+  unsigned long rounds = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 10000000;
+
+  g_now_seconds = time( NULL );
+  srandom( g_now_seconds );
+  udp_generate_rijndael_round_key( );
+
+#ifdef OT_UDP_AESNI
+  if( udp_encrypt == udp_encrypt_aesni ) {
+    uint8_t plain[16], crypt_table[16], crypt_aesni[16];
+    int     i, b;
+    for( i=0; i<BENCH_CHECKS; ++i ) {
+      for( b=0; b<16; ++b ) plain[b] = random( );
+      udp_encrypt_table( plain, crypt_table );
+      udp_encrypt_aesni( plain, crypt_aesni );
+      if( memcmp( crypt_table, crypt_aesni, sizeof(crypt_table) ) ) {
+        fprintf( stderr, "AES-NI and table rijndael differ on block %d.\n", i );
+        return 1;
+      }
+    }
+    printf( "AES-NI and table rijndael agree on %d random blocks.\n", BENCH_CHECKS );
+  } else
+    printf( "This cpu lacks AES-NI, only the table rijndael is measured.\n" );
+#endif
+
+  printf( "Deriving %lu connection ids:\n", rounds );
+  printf( "%10s %14s %14s\n", "rijndael", "cycles/connid", "ns/connid" );
+  bench_run( "table", udp_encrypt_table, rounds );
+#ifdef OT_UDP_AESNI
+  if( __builtin_cpu_supports( "aes" ) )
+    bench_run( "aes-ni", udp_encrypt_aesni, rounds );
+#endif
+  return 0;
+}
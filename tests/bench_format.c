@@ -0,0 +1,174 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Measures how many bytes per second of full scrape entries ot_format.c
+   renders, compared to the sprintf calls it replaced, and insists on
+   byte identical output. format_u64 is checked against sprintf first,
+   around every power of ten and for random values.
+   Usage: tests/bench_format [entries] */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+/* Opentracker, the module under test and what it needs to link */
+#include "trackerlogic.h"
+#include "ot_format.c"
+
+#define BENCH_PASSES 10
+#define BENCH_CHECKS 10000000
+
+/* Only ot_vector.c is linked in, it references this when it shrinks
+   torrent vectors */
+void free_peerlist( ot_peerlist *peer_list ) { (void)peer_list; }
+
+typedef struct {
+  ot_hash hash;
+  size_t  seeds, downloads, leechers;
+} bench_entry;
+
+typedef size_t (*bench_render)( char *r, const bench_entry *entries, size_t count );
+
+static uint64_t bench_random( uint64_t *state ) {
+  uint64_t z = ( *state += 0x9e3779b97f4a7c15ULL );
+  z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+  z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+  return z ^ ( z >> 31 );
+}
+
+/* Mostly small counts, like most torrents have, some large ones */
+static size_t bench_count( uint64_t *state ) {
+  uint64_t r = bench_random( state );
+  return (size_t)( ( r >> 8 ) >> ( 32 + ( r & 31 ) ) );
+}
+
+static double bench_nsec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The renderings below are TASK_FULLSCRAPE's and TASK_FULLSCRAPE_TPB_ASCII's,
+   before and after ot_format.c. The ascii one skips the hex hash, which
+   both share */
+static size_t bench_bencode_sprintf( char *r, const bench_entry *entries, size_t count ) {
+  char *start = r;
+  size_t i;
+  for( i=0; i<count; ++i ) {
+    *r++='2'; *r++='0'; *r++=':';
+    memcpy( r, entries[i].hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
+    r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee", entries[i].seeds, entries[i].downloads, entries[i].leechers );
+  }
+  return r - start;
+}
+
+static size_t bench_bencode_format( char *r, const bench_entry *entries, size_t count ) {
+  char *start = r;
+  size_t i;
+  for( i=0; i<count; ++i ) {
+    *r++='2'; *r++='0'; *r++=':';
+    memcpy( r, entries[i].hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
+    r += format_bencode_scrape( r, entries[i].seeds, entries[i].downloads, entries[i].leechers );
+  }
+  return r - start;
+}
+
+static size_t bench_ascii_sprintf( char *r, const bench_entry *entries, size_t count ) {
+  char *start = r;
+  size_t i;
+  for( i=0; i<count; ++i )
+    r += sprintf( r, ":%zd:%zd\n", entries[i].seeds, entries[i].leechers );
+  return r - start;
+}
+
+static size_t bench_ascii_format( char *r, const bench_entry *entries, size_t count ) {
+  char *start = r;
+  size_t i;
+  for( i=0; i<count; ++i )
+    r += format_ascii_pair( r, entries[i].seeds, entries[i].leechers );
+  return r - start;
+}
+
+static int bench_check_u64( uint64_t value ) {
+  char expected[OT_FORMAT_U64_MAXLEN + 1], got[OT_FORMAT_U64_MAXLEN];
+  size_t length = sprintf( expected, "%" PRIu64, value );
+  if( format_u64( got, value ) != length || format_u64_length( value ) != length || memcmp( got, expected, length ) ) {
+    printf( "%s: format_u64( %s ) is wrong\n", __FILE__, expected );
+    return 1;
+  }
+  return 0;
+}
+
+/* Returns bytes per second, the rendering is left in out */
+static double bench_run( bench_render render, char *out, const bench_entry *entries, size_t count, size_t *length ) {
+  double start = bench_nsec( );
+  int    pass;
+  for( pass=0; pass<BENCH_PASSES; ++pass )
+    *length = render( out, entries, count );
+  return (double)*length * BENCH_PASSES * 1e9 / ( bench_nsec( ) - start );
+}
+
+static int bench_compare( const char *name, bench_render before, bench_render after, const bench_entry *entries, size_t count, char *out_before, char *out_after ) {
+  size_t length_before, length_after;
+  double rate_before = bench_run( before, out_before, entries, count, &length_before );
+  double rate_after  = bench_run( after,  out_after,  entries, count, &length_after );
+
+  if( length_before != length_after || memcmp( out_before, out_after, length_before ) ) {
+    printf( "%s: %s renderings differ\n", __FILE__, name );
+    return 1;
+  }
+  printf( "%10s %16.0f %16.0f %8.2f\n", name, rate_before / 1e6, rate_after / 1e6, rate_after / rate_before );
+  return 0;
+}
+
+int main( int argc, char **argv ) {
+  size_t       count   = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 1000000, i;
+  bench_entry *entries = malloc( count * sizeof(bench_entry) );
+  char        *out_before = malloc( count * ( 3 + sizeof(ot_hash) + 124 ) );
+  char        *out_after  = malloc( count * ( 3 + sizeof(ot_hash) + 124 ) );
+  uint64_t     state = 0x2342, power;
+  int          bad = 0;
+
+  if( !count || !entries || !out_before || !out_after ) {
+    fprintf( stderr, "Out of memory.\n" );
+    return 1;
+  }
+
+  /* Every digit count, both of its ends and random values */
+  bad |= bench_check_u64( UINT64_MAX );
+  for( power=1; power && power<=UINT64_MAX/10; power*=10 ) {
+    bad |= bench_check_u64( power - 1 );
+    bad |= bench_check_u64( power );
+    bad |= bench_check_u64( power * 10 - 1 );
+  }
+  for( i=0; i<BENCH_CHECKS && !bad; ++i ) {
+    uint64_t r = bench_random( &state );
+    bad |= bench_check_u64( r >> ( r & 63 ) );
+  }
+  if( bad )
+    return 1;
+  printf( "format_u64 agrees with sprintf on %d random values and every power of ten.\n", BENCH_CHECKS );
+
+  for( i=0; i<count; ++i ) {
+    uint64_t r[3] = { bench_random( &state ), bench_random( &state ), bench_random( &state ) };
+    memcpy( entries[i].hash, r, sizeof(ot_hash) );
+    entries[i].seeds     = bench_count( &state );
+    entries[i].downloads = bench_count( &state ) * 16;
+    entries[i].leechers  = bench_count( &state );
+  }
+
+  printf( "Rendering %zu full scrape entries %d times, MB/s:\n", count, BENCH_PASSES );
+  printf( "%10s %16s %16s %8s\n", "format", "sprintf", "ot_format", "speedup" );
+  bad |= bench_compare( "bencode", bench_bencode_sprintf, bench_bencode_format, entries, count, out_before, out_after );
+  bad |= bench_compare( "ascii", bench_ascii_sprintf, bench_ascii_format, entries, count, out_before, out_after );
+
+  free( entries );
+  free( out_before );
+  free( out_after );
+  return bad;
+}
@@ -0,0 +1,135 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Measures how many 200 peer announce replies return_peers_for_torrent
+   compiles per second, with every thread drawing from its own generator
+   seeded by ot_random_seed. For comparison, it also times the same number
+   of draws from ot_random and from random(), which serialises all
+   threads on one lock.
+   Usage: tests/bench_peers [threads [peers]] */
+
+/* System */
+#include <pthread.h>
+#include <time.h>
+
+/* Opentracker, the module under test and what it needs to link */
+#include "trackerlogic.c"
+#include "ot_format.c"
+
+#define BENCH_AMOUNT  200
+#define BENCH_ROUNDS  200000
+#define BENCH_THREADS 64
+
+time_t        g_now_seconds;
+volatile int  g_opentracker_running = 1;
+uint32_t      g_tracker_id;
+int           g_bucket_count_bits = OT_BUCKET_COUNT_BITS_DEFAULT;
+char         *g_stats_path;
+ssize_t       g_stats_path_len;
+
+void mutex_init( ) {}
+void mutex_deinit( ) {}
+ot_vector *mutex_bucket_lock( int bucket ) { (void)bucket; return NULL; }
+ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) { (void)hash; return NULL; }
+const ot_vector *mutex_bucket_lock_shared( int bucket ) { (void)bucket; return NULL; }
+const ot_vector *mutex_bucket_lock_shared_by_hash( ot_hash hash ) { (void)hash; return NULL; }
+void mutex_bucket_unlock( int bucket, int delta_torrentcount ) { (void)bucket; (void)delta_torrentcount; }
+void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) { (void)hash; (void)delta_torrentcount; }
+void stats_init( ) {}
+void stats_deinit( ) {}
+void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event_data ) { (void)event; (void)proto; (void)event_data; }
+void clean_init( void ) {}
+void clean_deinit( void ) {}
+int  clean_single_torrent( ot_torrent *torrent ) { (void)torrent; return 0; }
+void journal_init( void ) {}
+void journal_deinit( void ) {}
+void journal_log( const ot_hash hash, size_t down_count, ot_time base ) { (void)hash; (void)down_count; (void)base; }
+void snapshot_init( void ) {}
+void snapshot_deinit( void ) {}
+
+typedef enum { BENCH_SELECTION, BENCH_OT_RANDOM, BENCH_RANDOM } bench_mode;
+
+static ot_torrent g_torrent;
+static bench_mode g_mode;
+static uint32_t   g_sink;
+
+static void * bench_worker( void * args ) {
+  struct ot_workstruct ws;
+  char    *reply = malloc( 12 + OT_PEER_COMPARE_SIZE * BENCH_AMOUNT );
+  uint32_t sink = 0;
+  int      round, i;
+
+  (void)args;
+  memset( &ws, 0, sizeof(ws) );
+  ot_random_seed( &ws );
+
+  for( round=0; round<BENCH_ROUNDS; ++round )
+    switch( g_mode ) {
+      case BENCH_SELECTION:
+        sink += return_peers_for_torrent( &ws, &g_torrent, BENCH_AMOUNT, reply, FLAG_UDP );
+        break;
+      /* One draw for the starting offset, one per peer */
+      case BENCH_OT_RANDOM:
+        for( i=0; i<=BENCH_AMOUNT; ++i ) sink += ot_random( &ws );
+        break;
+      case BENCH_RANDOM:
+        for( i=0; i<=BENCH_AMOUNT; ++i ) sink += random( );
+        break;
+    }
+
+  __sync_fetch_and_add( &g_sink, sink );
+  free( reply );
+  return NULL;
+}
+
+static double bench_run( bench_mode mode, int threads ) {
+  pthread_t       thread_ids[BENCH_THREADS];
+  struct timespec start, end;
+  int             i;
+
+  g_mode = mode;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  for( i=0; i<threads; ++i )
+    pthread_create( thread_ids + i, NULL, bench_worker, NULL );
+  for( i=0; i<threads; ++i )
+    pthread_join( thread_ids[i], NULL );
+  clock_gettime( CLOCK_MONOTONIC, &end );
+
+  return (double)threads * BENCH_ROUNDS / ( end.tv_sec - start.tv_sec + ( end.tv_nsec - start.tv_nsec ) / 1e9 );
+}
+
+int main( int argc, char **argv ) {
+  int          threads = argc > 1 ? atoi( argv[1] ) : 4;
+  size_t       peers   = argc > 2 ? strtoul( argv[2], NULL, 10 ) : 10000, i;
+  ot_peerlist *peer_list = calloc( 1, sizeof(ot_peerlist) );
+  ot_peer      peer;
+
+  if( threads < 1 || threads > BENCH_THREADS || peers <= BENCH_AMOUNT || !peer_list ) {
+    fprintf( stderr, "Usage: %s [threads (1..%d) [peers (> %d)]]\n", argv[0], BENCH_THREADS, BENCH_AMOUNT );
+    return 1;
+  }
+
+  /* Every third peer seeds, so replies are assembled from both ends */
+  g_torrent.peer_list = peer_list;
+  memset( &peer, 0, sizeof(peer) );
+  for( i=0; i<peers; ++i ) {
+    uint32_t address = htonl( 0x0a000000 + i );
+    memcpy( peer.data, &address, sizeof(address) );
+    OT_PEERFLAG( &peer ) = i % 3 ? PEER_FLAG_LEECHING : PEER_FLAG_SEEDING;
+    if( !vector_store_peer( &peer_list->peers, &peer ) ) {
+      fprintf( stderr, "Out of memory.\n" );
+      return 1;
+    }
+    peer_list->peer_count++;
+    if( !( i % 3 ) )
+      peer_list->seed_count++;
+  }
+
+  printf( "%d threads, %d peers out of %zu per reply:\n", threads, BENCH_AMOUNT, peers );
+  printf( "  selections/s:              %12.0f\n", bench_run( BENCH_SELECTION, threads ) );
+  printf( "  %3d draws/s from ot_random: %11.0f\n", BENCH_AMOUNT + 1, bench_run( BENCH_OT_RANDOM, threads ) );
+  printf( "  %3d draws/s from random():  %11.0f\n", BENCH_AMOUNT + 1, bench_run( BENCH_RANDOM, threads ) );
+  return 0;
+}
@@ -0,0 +1,95 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Loads a whitelist of random info_hashes, mixed case, with comments and
+   broken lines, and checks the sorted list against qsort and every
+   lookup against the expected answer. Usage:
+     tests/test_accesslist_load [hashes] */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Opentracker, the module under test and what it needs to link */
+#define WANT_ACCESSLIST_WHITE
+#include "ot_accesslist.c"
+
+ot_time g_now_seconds = 1700000000;
+
+void free_peerlist( ot_peerlist *peer_list ) { (void)peer_list; }
+
+static int test_compare_hashes( const void *a, const void *b ) {
+  return memcmp( a, b, sizeof(ot_hash) );
+}
+
+int main( int argc, char **argv ) {
+  size_t         count = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 300000, i, bad = 0;
+  ot_hash       *hashes = malloc( ( count + 1 ) * sizeof(ot_hash) ), probe;
+  ot_accesslist *accesslist;
+  char           filename[64], reply[512];
+  FILE          *file;
+  int            b;
+
+  snprintf( filename, sizeof(filename), "/tmp/test_accesslist.%d", (int)getpid( ) );
+  if( !hashes || !( file = fopen( filename, "w" ) ) ) {
+    fprintf( stderr, "Can't create %s.\n", filename );
+    return 1;
+  }
+
+  srandom( 1 );
+  for( i=0; i<count; ++i ) {
+    for( b=0; b<(int)sizeof(ot_hash); ++b ) hashes[i][b] = random();
+    for( b=0; b<(int)sizeof(ot_hash); ++b ) fprintf( file, i % 3 ? "%02x" : "%02X", hashes[i][b] );
+    fputs( i % 5 ? "\n" : " comment\n", file );
+  }
+
+  /* Too short, no hex at all and junk right after the hash: only the
+     last one still counts, like a trailing comment */
+  fputs( "0123456789abcdef0123456789abcdef0123456\nzz\n0123456789abcdef0123456789abcdef01234567x\n", file );
+  fclose( file );
+  for( b=0; b<(int)sizeof(ot_hash); ++b )
+    hashes[count][b] = "\x01\x23\x45\x67\x89\xab\xcd\xef"[b % 8];
+  ++count;
+
+  g_accesslist_filename = filename;
+  accesslist_readfile( );
+  accesslist = g_accesslist;
+
+  qsort( hashes, count, sizeof(ot_hash), test_compare_hashes );
+  if( !accesslist || accesslist->size != count || memcmp( hashes, accesslist->list, count * sizeof(ot_hash) ) ) {
+    printf( "%s: loaded %zu of %zu hashes, list differs from qsort\n", __FILE__, accesslist ? accesslist->size : 0, count );
+    unlink( filename );
+    return 1;
+  }
+
+  for( i=0; i<count; ++i ) {
+    if( !accesslist_hashisvalid( hashes[i] ) )
+      ++bad;
+    memcpy( probe, hashes[i], sizeof(ot_hash) );
+    probe[sizeof(ot_hash)-1] ^= 1;
+    if( !bsearch( probe, hashes, count, sizeof(ot_hash), test_compare_hashes ) && accesslist_hashisvalid( probe ) )
+      ++bad;
+  }
+  memset( probe, 0xff, sizeof(ot_hash) );
+  if( accesslist_hashisvalid( probe ) )
+    ++bad;
+
+  /* Loading again replaces the list, the old one goes after its grace */
+  accesslist_readfile( );
+  g_now_seconds += OT_ACCESSLIST_GRACE + 1;
+  accesslist_cleanup( );
+  if( g_accesslist->next || g_accesslist->size != count ) {
+    printf( "%s: reloaded list holds %zu hashes, %s\n", __FILE__, g_accesslist->size, g_accesslist->next ? "old list kept" : "old list freed" );
+    ++bad;
+  }
+
+  accesslist_stats( reply );
+  fputs( reply, stdout );
+  unlink( filename );
+  printf( "%s: %zu hashes, %zu wrong lookups, %s\n", __FILE__, count, bad, bad ? "FAILED" : "ok" );
+  return !!bad;
+}
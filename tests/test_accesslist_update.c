@@ -0,0 +1,141 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Runs batches of random adds and removes against a loaded and against
+   an empty whitelist, merging them along the way like the cleaner does,
+   and compares every lookup and the reported changes with the expected
+   set */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Opentracker, the module under test and what it needs to link */
+#define WANT_ACCESSLIST_WHITE
+#include "ot_accesslist.c"
+
+#define TEST_HASHES 20000
+#define TEST_ROUNDS 50
+
+ot_time g_now_seconds = 1700000000;
+
+void free_peerlist( ot_peerlist *peer_list ) { (void)peer_list; }
+
+static ot_hash g_hashes[TEST_HASHES];
+static int     g_listed[TEST_HASHES];
+
+static int test_check( const char *scenario, const char *step ) {
+  int i, bad = 0;
+  for( i=0; i<TEST_HASHES; ++i )
+    if( accesslist_hashisvalid( g_hashes[i] ) != g_listed[i] )
+      ++bad;
+  if( bad )
+    printf( "%s: %s, %s: %d of %d lookups wrong\n", __FILE__, scenario, step, bad, TEST_HASHES );
+  return bad;
+}
+
+static int test_run( const char *scenario, int load ) {
+  ot_accesslist *accesslist;
+  char           filename[64];
+  int            i, round, bad = 0;
+  size_t         listed = 0, j;
+
+  memset( g_listed, 0, sizeof(g_listed) );
+  if( load ) {
+    FILE *file;
+    int   b;
+    snprintf( filename, sizeof(filename), "/tmp/test_accesslist.%d", (int)getpid( ) );
+    if( !( file = fopen( filename, "w" ) ) ) {
+      fprintf( stderr, "Can't create %s.\n", filename );
+      exit( 1 );
+    }
+    for( i=0; i<TEST_HASHES / 2; ++i ) {
+      for( b=0; b<(int)sizeof(ot_hash); ++b ) fprintf( file, "%02x", g_hashes[i][b] );
+      fputs( "\n", file );
+      g_listed[i] = 1;
+    }
+    fclose( file );
+    g_accesslist_filename = filename;
+    accesslist_readfile( );
+    unlink( filename );
+  }
+  bad += test_check( scenario, "loaded" );
+
+  for( round=0; round<TEST_ROUNDS; ++round ) {
+    ot_hash hashes[OT_ACCESSLIST_UPDATE_MAX];
+    uint8_t remove[OT_ACCESSLIST_UPDATE_MAX];
+    size_t  removed, expected_removed = 0;
+    ssize_t changed, expected_changed = 0;
+    for( i=0; i<OT_ACCESSLIST_UPDATE_MAX; ++i ) {
+      int index = random() % TEST_HASHES;
+      memcpy( hashes[i], g_hashes[index], sizeof(ot_hash) );
+      remove[i] = random() & 1;
+      /* Only hashes not already where they are meant to be count */
+      if( g_listed[index] != !remove[i] ) {
+        ++expected_changed;
+        expected_removed += remove[i];
+      }
+      g_listed[index] = !remove[i];
+    }
+    if( ( changed = accesslist_update( (const ot_hash*)hashes, remove, OT_ACCESSLIST_UPDATE_MAX, &removed ) ) < 0 ) {
+      printf( "%s: %s, update failed\n", __FILE__, scenario );
+      return 1;
+    }
+    if( changed != expected_changed || removed != expected_removed ) {
+      printf( "%s: %s, update reports %zd changes, %zu removed, expected %zd and %zu\n", __FILE__, scenario,
+              changed, removed, expected_changed, expected_removed );
+      ++bad;
+    }
+    if( round % 10 == 9 ) {
+      g_now_seconds += OT_ACCESSLIST_GRACE + 1;
+      accesslist_cleanup( );
+    }
+  }
+  bad += test_check( scenario, "updated" );
+
+  g_now_seconds += OT_ACCESSLIST_GRACE + 1;
+  accesslist_cleanup( );
+  bad += test_check( scenario, "merged" );
+
+  /* The merged list must hold exactly the listed hashes, in order */
+  accesslist = g_accesslist;
+  for( i=0; i<TEST_HASHES; ++i )
+    listed += g_listed[i];
+  for( j=1; j<accesslist->size; ++j )
+    if( memcmp( accesslist->list[j-1], accesslist->list[j], sizeof(ot_hash) ) >= 0 )
+      ++bad;
+  if( accesslist->size != listed || accesslist->added_size || accesslist->removed_size ) {
+    printf( "%s: %s, merged list holds %zu of %zu hashes, %zu added and %zu removed pending\n", __FILE__, scenario,
+            accesslist->size, listed, accesslist->added_size, accesslist->removed_size );
+    ++bad;
+  }
+
+  /* Everything replaced is gone after the grace period */
+  g_now_seconds += OT_ACCESSLIST_GRACE + 1;
+  accesslist_cleanup( );
+  if( g_accesslist->next ) {
+    printf( "%s: %s, replaced lists survive their grace period\n", __FILE__, scenario );
+    ++bad;
+  }
+
+  printf( "%s: %s, %zu hashes listed, %s\n", __FILE__, scenario, listed, bad ? "FAILED" : "ok" );
+  return bad;
+}
+
+int main( void ) {
+  int i, b, bad = 0;
+
+  srandom( 2 );
+  for( i=0; i<TEST_HASHES; ++i )
+    for( b=0; b<(int)sizeof(ot_hash); ++b )
+      g_hashes[i][b] = random();
+
+  /* Updates before any file was loaded go on top of an empty list */
+  bad += test_run( "empty list", 0 );
+  bad += test_run( "loaded list", 1 );
+  return !!bad;
+}
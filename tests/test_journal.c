@@ -0,0 +1,187 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Logs completions from several threads and checks that replaying the
+   journal restores every download count: across a compaction, after a
+   torn record at the journal's end and after a failed write */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Opentracker, the module under test and what it needs to link */
+#include "ot_journal.c"
+#include "uint32.h"
+
+#define TEST_TORRENTS 1000
+#define TEST_THREADS  4
+#define TEST_ROUNDS   50000
+
+int    g_bucket_count_bits = OT_BUCKET_COUNT_BITS_MIN;
+time_t g_now_seconds = 1700000000;
+
+static ot_vector        g_buckets[1 << OT_BUCKET_COUNT_BITS_MIN];
+static pthread_rwlock_t g_locks[1 << OT_BUCKET_COUNT_BITS_MIN];
+static size_t           g_expected[TEST_TORRENTS];
+
+static int test_bucket( const ot_hash hash ) {
+  return uint32_read_big( (const char*)hash ) >> OT_BUCKET_COUNT_SHIFT;
+}
+
+ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) {
+  pthread_rwlock_wrlock( g_locks + test_bucket( hash ) );
+  return g_buckets + test_bucket( hash );
+}
+
+const ot_vector *mutex_bucket_lock_shared( int bucket ) {
+  pthread_rwlock_rdlock( g_locks + bucket );
+  return g_buckets + bucket;
+}
+
+void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
+  (void)delta_torrentcount;
+  pthread_rwlock_unlock( g_locks + bucket );
+}
+
+void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
+  mutex_bucket_unlock( test_bucket( hash ), delta_torrentcount );
+}
+
+void free_peerlist( ot_peerlist *peer_list ) {
+  free( peer_list );
+}
+
+static void test_hash( ot_hash hash, int torrent ) {
+  memset( hash, 0x23, sizeof(ot_hash) );
+  hash[0] = torrent;
+  hash[1] = torrent >> 8;
+}
+
+/* What an announce with event=completed does to the journal */
+static void * test_logger( void * args ) {
+  int id = (int)(intptr_t)args, round;
+
+  for( round=0; round<TEST_ROUNDS; ++round ) {
+    int         torrent_index = ( round * 7 + id ) % TEST_TORRENTS, exactmatch;
+    ot_hash     hash;
+    ot_vector  *torrents_list;
+    ot_torrent *torrent;
+
+    test_hash( hash, torrent_index );
+    torrents_list = mutex_bucket_lock_by_hash( hash );
+    torrent = vector_find_or_insert_torrent( torrents_list, hash, &exactmatch );
+    if( !exactmatch ) {
+      torrent->peer_list = calloc( 1, sizeof(ot_peerlist) );
+      torrent->peer_list->base = g_now_minutes;
+      journal_log( hash, 0, g_now_minutes );
+    }
+    g_expected[torrent_index] = ++torrent->peer_list->down_count;
+    journal_log( hash, torrent->peer_list->down_count, torrent->peer_list->base );
+    mutex_bucket_unlock_by_hash( hash, !exactmatch );
+  }
+  return NULL;
+}
+
+static void test_log( void ) {
+  pthread_t thread_ids[TEST_THREADS];
+  int       i;
+  for( i=0; i<TEST_THREADS; ++i )
+    pthread_create( thread_ids + i, NULL, test_logger, (void*)(intptr_t)i );
+  for( i=0; i<TEST_THREADS; ++i )
+    pthread_join( thread_ids[i], NULL );
+}
+
+static void test_clear( void ) {
+  size_t bucket, i;
+  for( bucket=0; bucket<sizeof(g_buckets) / sizeof(*g_buckets); ++bucket ) {
+    for( i=0; i<g_buckets[bucket].size; ++i )
+      free( ( (ot_torrent*)g_buckets[bucket].data )[i].peer_list );
+    free( g_buckets[bucket].data );
+    memset( g_buckets + bucket, 0, sizeof(ot_vector) );
+  }
+}
+
+/* Forgets all counts, replays the journal and compares */
+static int test_replay( const char *scenario ) {
+  int torrent_index, bad = 0;
+
+  test_clear( );
+  journal_replay( );
+  for( torrent_index=0; torrent_index<TEST_TORRENTS; ++torrent_index ) {
+    ot_hash     hash;
+    ot_torrent *torrent;
+    test_hash( hash, torrent_index );
+    torrent = vector_find_torrent( g_buckets + test_bucket( hash ), hash );
+    if( !torrent || torrent->peer_list->down_count != g_expected[torrent_index] )
+      ++bad;
+  }
+  printf( "%s: %s, %d of %d counts wrong\n", __FILE__, scenario, bad, TEST_TORRENTS );
+  return bad;
+}
+
+static void test_remove( const char *suffix ) {
+  char filename[512];
+  snprintf( filename, sizeof(filename), "%s%s", g_journal_filename, suffix );
+  unlink( filename );
+}
+
+int main( void ) {
+  char filename[64];
+  int  failed = 0, fd;
+  size_t i;
+
+  for( i=0; i<sizeof(g_locks) / sizeof(*g_locks); ++i )
+    pthread_rwlock_init( g_locks + i, NULL );
+  snprintf( filename, sizeof(filename), "/tmp/test_journal.%d", (int)getpid( ) );
+  g_journal_filename = filename;
+
+  /* The journal thread is not started, flushes happen right here */
+  journal_replayed = 1;
+  journal_fd = journal_open( g_journal_filename, O_APPEND, &journal_size );
+
+  test_log( );
+  journal_flush( );
+  journal_compact( );
+  test_log( );
+  journal_flush( );
+  failed |= test_replay( "compacted" );
+
+  /* Half a record, as a crash during write would leave it */
+  close( journal_fd );
+  fd = open( g_journal_filename, O_WRONLY | O_APPEND );
+  if( fd < 0 || write( fd, "torn", 4 ) != 4 ) {
+    fprintf( stderr, "Can't append to %s.\n", g_journal_filename );
+    return 1;
+  }
+  close( fd );
+  journal_fd = journal_open( g_journal_filename, O_APPEND, &journal_size );
+  test_log( );
+  journal_flush( );
+  failed |= test_replay( "torn tail" );
+
+  /* Writes fail on a read only descriptor, the records must stay queued
+     until the journal is reopened by the next flush. All torrents exist
+     after the replay, so only completions are logged */
+  close( journal_fd );
+  journal_fd = open( g_journal_filename, O_RDONLY );
+  test_log( );
+  journal_flush( );
+  if( journal_queue_fill != TEST_THREADS * TEST_ROUNDS ) {
+    printf( "%s: %zu records queued after a failed write\n", __FILE__, journal_queue_fill );
+    failed = 1;
+  }
+  journal_flush( );
+  failed |= test_replay( "failed write" );
+
+  journal_deinit( );
+  test_clear( );
+  test_remove( "" );
+  test_remove( ".1" );
+  test_remove( ".compact" );
+  printf( "%s: %s\n", __FILE__, failed ? "FAILED" : "ok" );
+  return !!failed;
+}
@@ -0,0 +1,133 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Blesses random, overlapping nets and adds proxies with the networks
+   they may speak for, then compares trie lookups for random addresses
+   against a linear address_in_net scan */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Opentracker, the module under test and what it needs to link */
+#define WANT_IP_FROM_PROXY
+#include "ot_accesslist.c"
+
+#define TEST_NETS           300
+#define TEST_PROXIES        40
+#define TEST_PROXY_NETWORKS 5
+#define TEST_LOOKUPS        200000
+
+ot_time g_now_seconds = 1700000000;
+
+void free_peerlist( ot_peerlist *peer_list ) { (void)peer_list; }
+
+/* Few distinct bytes, so that random nets overlap */
+static void test_address( ot_ip6 address ) {
+  int i;
+  for( i=0; i<(int)sizeof(ot_ip6); ++i )
+    address[i] = ( random() % 4 ) * 0x11 ^ ( random() & 1 ? 0x80 : 0 );
+}
+
+static int test_blessed( void ) {
+  ot_net nets[TEST_NETS];
+  int    permissions[TEST_NETS], i, lookup, bad = 0;
+
+  for( i=0; i<TEST_NETS; ++i ) {
+    test_address( nets[i].address );
+    nets[i].bits   = random() % 3 ? (int)( random() % 129 ) : 128;
+    permissions[i] = 1 << ( random() % 5 );
+    if( accesslist_blessnet( nets + i, permissions[i] ) ) {
+      printf( "%s: blessing net %d failed\n", __FILE__, i );
+      return 1;
+    }
+  }
+
+  for( lookup=0; lookup<TEST_LOOKUPS; ++lookup ) {
+    ot_ip6 address;
+    int    expected = 0, permission;
+
+    /* Every other address lies right next to a blessed one */
+    if( lookup & 1 ) {
+      memcpy( address, nets[random() % TEST_NETS].address, sizeof(ot_ip6) );
+      address[15] ^= random() % 3;
+    } else
+      test_address( address );
+
+    for( i=0; i<TEST_NETS; ++i )
+      if( address_in_net( address, nets + i ) )
+        expected |= permissions[i];
+    for( permission=1; permission<32; permission<<=1 )
+      if( !accesslist_isblessed( address, permission ) != !( expected & permission ) )
+        ++bad;
+  }
+
+  printf( "%s: %d blessed nets, %d wrong lookups\n", __FILE__, TEST_NETS, bad );
+  return bad;
+}
+
+static int test_proxies( void ) {
+  ot_net proxies[TEST_PROXIES], networks[TEST_PROXIES][TEST_PROXY_NETWORKS];
+  int    network_count[TEST_PROXIES], proxy_count = 0, i, k, q, lookup, bad = 0;
+
+  memset( network_count, 0, sizeof(network_count) );
+  for( i=0; i<TEST_PROXIES; ++i ) {
+    ot_net proxy;
+    memset( &proxy, 0, sizeof(proxy) );
+    test_address( proxy.address );
+    proxy.bits = 64 + random() % 65;
+
+    for( k=0; k<TEST_PROXY_NETWORKS; ++k ) {
+      ot_net network;
+      memset( &network, 0, sizeof(network) );
+      test_address( network.address );
+      network.bits = random() % 129;
+
+      /* Overlapping proxies and networks are refused */
+      if( !proxylist_add_network( &proxy, &network ) )
+        continue;
+      for( q=0; q<proxy_count && memcmp( proxies + q, &proxy, sizeof(ot_net) ); ++q );
+      if( q == proxy_count )
+        proxies[proxy_count++] = proxy;
+      networks[q][network_count[q]++] = network;
+    }
+  }
+
+  for( lookup=0; lookup<TEST_LOOKUPS / 2; ++lookup ) {
+    ot_ip6 proxy, address;
+    int    expected = 0, expected_proxy = 0;
+
+    test_address( proxy );
+    test_address( address );
+    if( lookup & 1 )
+      memcpy( proxy, proxies[random() % proxy_count].address, sizeof(ot_ip6) );
+
+    for( q=0; q<proxy_count; ++q )
+      if( address_in_net( proxy, proxies + q ) ) {
+        expected_proxy = 1;
+        for( k=0; k<network_count[q]; ++k )
+          if( address_in_net( address, networks[q] + k ) )
+            expected = 1;
+      }
+    if( proxylist_check_proxy( proxy, address ) != expected )
+      ++bad;
+    if( proxylist_check_proxy( proxy, NULL ) != expected_proxy )
+      ++bad;
+  }
+
+  printf( "%s: %d proxies, %d wrong lookups\n", __FILE__, proxy_count, bad );
+  return bad;
+}
+
+int main( void ) {
+  int bad;
+
+  srandom( 3 );
+  bad  = test_blessed( );
+  bad += test_proxies( );
+  printf( "%s: %s\n", __FILE__, bad ? "FAILED" : "ok" );
+  return !!bad;
+}
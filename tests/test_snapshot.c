@@ -0,0 +1,231 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Writes a snapshot of random torrents, a few of them with peers spread
+   over peer buckets, and checks that loading it with several bucket
+   counts restores the same torrents, counters and peers */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Opentracker, the module under test and what it needs to link */
+#include "ot_snapshot.c"
+
+#define TEST_TORRENTS 20000
+
+int          g_bucket_count_bits = OT_BUCKET_COUNT_BITS_DEFAULT;
+time_t       g_now_seconds = 1700000000;
+volatile int g_opentracker_running = 1;
+
+static void test_panic( const char *message ) {
+  fprintf( stderr, "%s\n", message );
+  exit( 1 );
+}
+
+static ot_vector        *g_buckets;
+static pthread_rwlock_t *g_locks;
+
+ot_vector *mutex_bucket_lock( int bucket ) {
+  pthread_rwlock_wrlock( g_locks + bucket );
+  return g_buckets + bucket;
+}
+
+const ot_vector *mutex_bucket_lock_shared( int bucket ) {
+  pthread_rwlock_rdlock( g_locks + bucket );
+  return g_buckets + bucket;
+}
+
+void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
+  (void)delta_torrentcount;
+  pthread_rwlock_unlock( g_locks + bucket );
+}
+
+void free_peerlist( ot_peerlist *peer_list ) {
+  if( peer_list->peers.data ) {
+    if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
+      ot_vector *bucket_list = (ot_vector*)peer_list->peers.data;
+      size_t     i;
+      for( i=0; i<peer_list->peers.size; ++i )
+        free( bucket_list[i].data );
+    }
+    free( peer_list->peers.data );
+  }
+  free( peer_list );
+}
+
+static void test_buckets_init( int bits ) {
+  int bucket;
+  g_bucket_count_bits = bits;
+  g_buckets = calloc( OT_BUCKET_COUNT, sizeof(ot_vector) );
+  g_locks   = malloc( OT_BUCKET_COUNT * sizeof(pthread_rwlock_t) );
+  if( !g_buckets || !g_locks )
+    test_panic( "Out of memory." );
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket )
+    pthread_rwlock_init( g_locks + bucket, NULL );
+}
+
+static void test_buckets_deinit( void ) {
+  int bucket;
+  size_t i;
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+    for( i=0; i<OT_TORRENT_SLOTS( g_buckets + bucket ); ++i ) {
+      ot_torrent *torrent = (ot_torrent*)g_buckets[bucket].data + i;
+      if( OT_TORRENT_SLOT_USED( torrent ) )
+        free_peerlist( torrent->peer_list );
+    }
+    free( g_buckets[bucket].data );
+    pthread_rwlock_destroy( g_locks + bucket );
+  }
+  free( g_buckets );
+  free( g_locks );
+}
+
+static int test_compare_peers( const void *a, const void *b ) {
+  return memcmp( a, b, sizeof(ot_peer) );
+}
+
+/* One digest per torrent, with a checksum over its peers in address order.
+   Sorted, so that bucket counts and orders do not matter */
+typedef struct {
+  ot_hash  hash;
+  ot_time  base;
+  size_t   down_count, peer_count, seed_count, peers_found;
+  uint64_t peers_checksum;
+} test_digest;
+
+static int test_compare_digests( const void *a, const void *b ) {
+  return memcmp( a, b, sizeof(ot_hash) );
+}
+
+static size_t test_digest_all( test_digest *digests ) {
+  size_t count = 0, i, j;
+  int    bucket;
+
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket )
+    for( i=0; i<OT_TORRENT_SLOTS( g_buckets + bucket ); ++i ) {
+      ot_torrent  *torrent = (ot_torrent*)g_buckets[bucket].data + i;
+      ot_peerlist *peer_list;
+      ot_vector   *bucket_list;
+      size_t       num_buckets = 1, found = 0;
+      ot_peer     *peers;
+      test_digest *digest;
+
+      if( !OT_TORRENT_SLOT_USED( torrent ) )
+        continue;
+      digest = digests + count++;
+      memset( digest, 0, sizeof(test_digest) );
+      peer_list   = torrent->peer_list;
+      bucket_list = &peer_list->peers;
+      if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
+        num_buckets = bucket_list->size;
+        bucket_list = (ot_vector*)bucket_list->data;
+      }
+
+      peers = malloc( ( peer_list->peer_count + 1 ) * sizeof(ot_peer) );
+      if( !peers )
+        test_panic( "Out of memory." );
+      while( num_buckets-- ) {
+        for( j=0; j<bucket_list->size && found <= peer_list->peer_count; ++j )
+          vector_get_peer( bucket_list, j, peers + found++ );
+        ++bucket_list;
+      }
+      qsort( peers, found, sizeof(ot_peer), test_compare_peers );
+
+      memcpy( digest->hash, torrent->hash, sizeof(ot_hash) );
+      digest->base           = peer_list->base;
+      digest->down_count     = peer_list->down_count;
+      digest->peer_count     = peer_list->peer_count;
+      digest->seed_count     = peer_list->seed_count;
+      digest->peers_found    = found;
+      for( j=0; j<found * sizeof(ot_peer); ++j )
+        digest->peers_checksum = digest->peers_checksum * 131 + ((uint8_t*)peers)[j];
+      free( peers );
+    }
+
+  qsort( digests, count, sizeof(test_digest), test_compare_digests );
+  return count;
+}
+
+static void test_fill( void ) {
+  int i, p;
+
+  srandom( 7 );
+  for( i=0; i<TEST_TORRENTS; ++i ) {
+    ot_hash     hash;
+    ot_vector  *torrents_list;
+    ot_torrent *torrent;
+    int         bucket, exactmatch, peers;
+
+    for( p=0; p<(int)sizeof(ot_hash); ++p ) hash[p] = random();
+    bucket = uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT;
+    torrents_list = mutex_bucket_lock( bucket );
+    torrent = vector_find_or_insert_torrent( torrents_list, hash, &exactmatch );
+    if( !torrent || !( torrent->peer_list = calloc( 1, sizeof(ot_peerlist) ) ) )
+      test_panic( "Out of memory." );
+    torrent->peer_list->base       = g_now_minutes - random() % 40;
+    torrent->peer_list->down_count = random() % 1000;
+
+    /* Every 1000th torrent is large enough to get peer buckets */
+    peers = i % 1000 ? random() % 30 : 2000 + random() % 8000;
+    for( p=0; p<peers; ++p ) {
+      ot_peer peer;
+      size_t  b;
+      for( b=0; b<sizeof(ot_peer); ++b ) peer.data[b] = random();
+      OT_PEERTIME( &peer ) %= 45;
+      OT_PEERFLAG( &peer ) &= PEER_FLAG_SEEDING;
+      if( vector_store_peer( &torrent->peer_list->peers, &peer ) == 1 ) {
+        torrent->peer_list->peer_count++;
+        if( OT_PEERFLAG( &peer ) )
+          torrent->peer_list->seed_count++;
+      }
+    }
+    if( torrent->peer_list->peer_count > OT_PEER_BUCKET_MINCOUNT )
+      vector_redistribute_buckets( torrent->peer_list );
+    mutex_bucket_unlock( bucket, 1 );
+  }
+}
+
+int main( void ) {
+  test_digest *written = malloc( TEST_TORRENTS * sizeof(test_digest) );
+  test_digest *loaded  = malloc( TEST_TORRENTS * sizeof(test_digest) );
+  char         filename[64];
+  size_t       written_count, loaded_count;
+  int          bits[] = { OT_BUCKET_COUNT_BITS_DEFAULT, OT_BUCKET_COUNT_BITS_MIN, 14 }, i, failed = 0;
+
+  if( !written || !loaded )
+    test_panic( "Out of memory." );
+  snprintf( filename, sizeof(filename), "/tmp/test_snapshot.%d", (int)getpid( ) );
+
+  test_buckets_init( OT_BUCKET_COUNT_BITS_DEFAULT );
+  test_fill( );
+  if( snapshot_write( filename ) ) {
+    fprintf( stderr, "Writing %s failed.\n", filename );
+    return 1;
+  }
+  written_count = test_digest_all( written );
+  test_buckets_deinit( );
+
+  for( i=0; i<(int)( sizeof(bits) / sizeof(*bits) ); ++i ) {
+    int result;
+    test_buckets_init( bits[i] );
+    result = snapshot_load( filename );
+    loaded_count = test_digest_all( loaded );
+    if( result || loaded_count != written_count || memcmp( written, loaded, written_count * sizeof(test_digest) ) ) {
+      fprintf( stderr, "Loading with %d buckets: result %d, %zu of %zu torrents, contents %s.\n", 1 << bits[i],
+               result, loaded_count, written_count, loaded_count == written_count ? "differ" : "incomplete" );
+      failed = 1;
+    }
+    test_buckets_deinit( );
+  }
+
+  unlink( filename );
+  free( written );
+  free( loaded );
+  printf( "%s: %zu torrents, %s\n", __FILE__, written_count, failed ? "FAILED" : "ok" );
+  return failed;
+}
@@ -27,9 +27,12 @@
 #include "ot_accesslist.h"
 #include "ot_fullscrape.h"
 #include "ot_livesync.h"
+#include "ot_format.h"
+#include "ot_snapshot.h"
+#include "ot_journal.h"
 
 /* Forward declaration */
-size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto );
+size_t return_peers_for_torrent( struct ot_workstruct *ws, ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto );
 
 void free_peerlist( ot_peerlist *peer_list ) {
   if( peer_list->peers.data ) {
@@ -52,13 +55,11 @@ void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count
   if( !accesslist_hashisvalid( hash ) )
     return mutex_bucket_unlock_by_hash( hash, 0 );
   
-  torrent = vector_find_or_insert( torrents_list, (void*)hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  torrent = vector_find_or_insert_torrent( torrents_list, hash, &exactmatch );
   if( !torrent || exactmatch )
     return mutex_bucket_unlock_by_hash( hash, 0 );
 
   /* Create a new torrent entry, then */
-  memcpy( torrent->hash, hash, sizeof(ot_hash) );
-    
   if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
     vector_remove_torrent( torrents_list, torrent );
     return mutex_bucket_unlock_by_hash( hash, 0 );
@@ -67,6 +68,7 @@ void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count
   byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
   torrent->peer_list->base = base;
   torrent->peer_list->down_count = down_count;
+  torrent->peer_list->changed    = g_now_seconds;
 
   return mutex_bucket_unlock_by_hash( hash, 1 );
 }
@@ -74,7 +76,7 @@ void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count
 size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstruct *ws, size_t amount ) {
   int         exactmatch, delta_torrentcount = 0;
   ot_torrent *torrent;
-  ot_peer    *peer_dest;
+  ot_peer     peer_old, peer_new;
   ot_vector  *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
 
   if( !accesslist_hashisvalid( *ws->hash ) ) {
@@ -87,7 +89,7 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     return 0;
   }
 
-  torrent = vector_find_or_insert( torrents_list, (void*)ws->hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  torrent = vector_find_or_insert_torrent( torrents_list, *ws->hash, &exactmatch );
   if( !torrent ) {
     mutex_bucket_unlock_by_hash( *ws->hash, 0 );
     return 0;
@@ -95,8 +97,6 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 
   if( !exactmatch ) {
     /* Create a new torrent entry, then */
-    memcpy( torrent->hash, *ws->hash, sizeof(ot_hash) );
-
     if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
       vector_remove_torrent( torrents_list, torrent );
       mutex_bucket_unlock_by_hash( *ws->hash, 0 );
@@ -105,17 +105,18 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 
     byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
     delta_torrentcount = 1;
+    journal_log( *ws->hash, 0, g_now_minutes );
   } else
     clean_single_torrent( torrent );
 
   torrent->peer_list->base = g_now_minutes;
 
+  /* A fresh peer may expire earlier than what the cleaner expects */
+  if( torrent->peer_list->next_clean > g_now_minutes + OT_PEER_TIMEOUT )
+    torrent->peer_list->next_clean = g_now_minutes + OT_PEER_TIMEOUT;
+
   /* Check for peer in torrent */
-  peer_dest = vector_find_or_insert_peer( &(torrent->peer_list->peers), &ws->peer, &exactmatch );
-  if( !peer_dest ) {
-    mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
-    return 0;
-  }
+  exactmatch = vector_find_peer( &(torrent->peer_list->peers), &ws->peer, &peer_old );
 
   /* Tell peer that it's fresh */
   OT_PEERTIME( &ws->peer ) = 0;
@@ -124,53 +125,70 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
   if( ( OT_PEERFLAG( &ws->peer ) & ( PEER_FLAG_COMPLETED | PEER_FLAG_SEEDING ) ) == PEER_FLAG_COMPLETED )
     OT_PEERFLAG( &ws->peer ) ^= PEER_FLAG_COMPLETED;
 
-  /* If we hadn't had a match create peer there */
+  /* The stored peer remembers a completed download and where it came from */
+  memcpy( &peer_new, &ws->peer, sizeof(ot_peer) );
+  if( exactmatch && ( OT_PEERFLAG( &peer_old ) & PEER_FLAG_COMPLETED ) )
+    OT_PEERFLAG( &peer_new ) |= PEER_FLAG_COMPLETED;
+#ifdef WANT_SYNC_LIVE
+  if( !exactmatch && proto == FLAG_MCA )
+    OT_PEERFLAG( &peer_new ) |= PEER_FLAG_FROM_SYNC;
+#endif
+
+  if( !vector_store_peer( &(torrent->peer_list->peers), &peer_new ) ) {
+    mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
+    return 0;
+  }
+
+  /* If we hadn't had a match, count the new peer */
   if( !exactmatch ) {
 
 #ifdef WANT_SYNC_LIVE
-    if( proto == FLAG_MCA )
-      OT_PEERFLAG( &ws->peer ) |= PEER_FLAG_FROM_SYNC;
-    else
+    if( proto != FLAG_MCA )
       livesync_tell( ws );
 #endif
 
     torrent->peer_list->peer_count++;
+    torrent->peer_list->changed = g_now_seconds;
     if( OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) {
       torrent->peer_list->down_count++;
+      journal_log( *ws->hash, torrent->peer_list->down_count, torrent->peer_list->base );
       stats_issue_event( EVENT_COMPLETED, 0, (uintptr_t)ws );
     }
     if( OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING )
       torrent->peer_list->seed_count++;
 
   } else {
-    stats_issue_event( EVENT_RENEW, 0, OT_PEERTIME( peer_dest ) );
+    stats_issue_event( EVENT_RENEW, 0, OT_PEERTIME( &peer_old ) );
 #ifdef WANT_SPOT_WOODPECKER
-    if( ( OT_PEERTIME(peer_dest) > 0 ) && ( OT_PEERTIME(peer_dest) < 20 ) )
+    if( ( OT_PEERTIME(&peer_old) > 0 ) && ( OT_PEERTIME(&peer_old) < 20 ) )
       stats_issue_event( EVENT_WOODPECKER, 0, (uintptr_t)&ws->peer );
 #endif
 #ifdef WANT_SYNC_LIVE
     /* Won't live sync peers that come back too fast. Only exception:
        fresh "completed" reports */
     if( proto != FLAG_MCA ) {
-      if( OT_PEERTIME( peer_dest ) > OT_CLIENT_SYNC_RENEW_BOUNDARY ||
-         ( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_COMPLETED ) && (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) )
+      if( OT_PEERTIME( &peer_old ) > OT_CLIENT_SYNC_RENEW_BOUNDARY ||
+         ( !(OT_PEERFLAG(&peer_old) & PEER_FLAG_COMPLETED ) && (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) )
         livesync_tell( ws );
     }
 #endif
 
-    if(  (OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   && !(OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
+    if(  (OT_PEERFLAG(&peer_old) & PEER_FLAG_SEEDING )   && !(OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) ) {
       torrent->peer_list->seed_count--;
-    if( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
+      torrent->peer_list->changed = g_now_seconds;
+    }
+    if( !(OT_PEERFLAG(&peer_old) & PEER_FLAG_SEEDING )   &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) ) {
       torrent->peer_list->seed_count++;
-    if( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_COMPLETED ) &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) {
+      torrent->peer_list->changed = g_now_seconds;
+    }
+    if( !(OT_PEERFLAG(&peer_old) & PEER_FLAG_COMPLETED ) &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) {
       torrent->peer_list->down_count++;
+      torrent->peer_list->changed = g_now_seconds;
+      journal_log( *ws->hash, torrent->peer_list->down_count, torrent->peer_list->base );
       stats_issue_event( EVENT_COMPLETED, 0, (uintptr_t)ws );
     }
-    if(   OT_PEERFLAG(peer_dest) & PEER_FLAG_COMPLETED )
-      OT_PEERFLAG( &ws->peer ) |= PEER_FLAG_COMPLETED;
   }
 
-  memcpy( peer_dest, &ws->peer, sizeof(ot_peer) );
 #ifdef WANT_SYNC
   if( proto == FLAG_MCA ) {
     mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
@@ -178,11 +196,13 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
   }
 #endif
 
-  ws->reply_size = return_peers_for_torrent( torrent, amount, ws->reply, proto );
+  ws->reply_size = return_peers_for_torrent( ws, torrent, amount, ws->reply, proto );
   mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
   return ws->reply_size;
 }
 
+/* Leechers and seeders each are one block of addresses in a peer vector, so
+   copy them in bulk. Leechers go to the front, seeders to the end of reply */
 static size_t return_peers_all( ot_peerlist *peer_list, char *reply ) {
   unsigned int bucket, num_buckets = 1;
   ot_vector  * bucket_list = &peer_list->peers;
@@ -195,22 +215,19 @@ static size_t return_peers_all( ot_peerlist *peer_list, char *reply ) {
   }
 
   for( bucket = 0; bucket<num_buckets; ++bucket ) {
-    ot_peer * peers = (ot_peer*)bucket_list[bucket].data;
-    size_t    peer_count = bucket_list[bucket].size;
-    while( peer_count-- ) {
-      if( OT_PEERFLAG(peers) & PEER_FLAG_SEEDING ) {
-        r_end-=OT_PEER_COMPARE_SIZE;
-        memcpy(r_end,peers++,OT_PEER_COMPARE_SIZE);      
-      } else {
-        memcpy(reply,peers++,OT_PEER_COMPARE_SIZE);
-        reply+=OT_PEER_COMPARE_SIZE;
-      }
-    }
+    ot_vector * peers = bucket_list + bucket;
+    size_t      leechers = vector_count_leechers( peers );
+    size_t      seeders = peers->size - leechers;
+
+    memcpy( reply, OT_VECTOR_PEER_ADDR( peers, 0 ), OT_PEER_COMPARE_SIZE * leechers );
+    reply += OT_PEER_COMPARE_SIZE * leechers;
+    r_end -= OT_PEER_COMPARE_SIZE * seeders;
+    memcpy( r_end, OT_VECTOR_PEER_ADDR( peers, leechers ), OT_PEER_COMPARE_SIZE * seeders );
   }
   return result;
 }
 
-static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, char *reply ) {
+static size_t return_peers_selection( struct ot_workstruct *ws, ot_peerlist *peer_list, size_t amount, char *reply ) {
   unsigned int bucket_offset, bucket_index = 0, num_buckets = 1;
   ot_vector  * bucket_list = &peer_list->peers;
   unsigned int shifted_pc = peer_list->peer_count;
@@ -232,26 +249,26 @@ static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, cha
 
   /* Initialize somewhere in the middle of peers so that
    fixpoint's aliasing doesn't alway miss the same peers */
-  bucket_offset = random() % peer_list->peer_count;
+  bucket_offset = ot_random( ws ) % peer_list->peer_count;
 
   while( amount-- ) {
-    ot_peer * peer;
+    ot_vector * peers;
 
     /* This is the aliased, non shifted range, next value may fall into */
     unsigned int diff = ( ( ( amount + 1 ) * shifted_step ) >> shift ) -
                         ( (   amount       * shifted_step ) >> shift );
-    bucket_offset += 1 + random() % diff;
+    bucket_offset += 1 + ot_random( ws ) % diff;
 
     while( bucket_offset >= bucket_list[bucket_index].size ) {
       bucket_offset -= bucket_list[bucket_index].size;
       bucket_index = ( bucket_index + 1 ) % num_buckets;
     }
-    peer = ((ot_peer*)bucket_list[bucket_index].data) + bucket_offset;
-    if( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING ) {
+    peers = bucket_list + bucket_index;
+    if( OT_VECTOR_PEER_FLAGS( peers )[bucket_offset] & PEER_FLAG_SEEDING ) {
       r_end-=OT_PEER_COMPARE_SIZE;
-      memcpy(r_end,peer,OT_PEER_COMPARE_SIZE);      
+      memcpy(r_end,OT_VECTOR_PEER_ADDR( peers, bucket_offset ),OT_PEER_COMPARE_SIZE);
     } else {
-      memcpy(reply,peer,OT_PEER_COMPARE_SIZE);
+      memcpy(reply,OT_VECTOR_PEER_ADDR( peers, bucket_offset ),OT_PEER_COMPARE_SIZE);
       reply+=OT_PEER_COMPARE_SIZE;
     }
   }
@@ -262,7 +279,7 @@ static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, cha
    * reply must have enough space to hold 92+6*amount bytes
    * does not yet check not to return self
 */
-size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto ) {
+size_t return_peers_for_torrent( struct ot_workstruct *ws, ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto ) {
   ot_peerlist *peer_list = torrent->peer_list;
   char        *r = reply;
 
@@ -270,10 +287,18 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
     amount = peer_list->peer_count;
 
   if( proto == FLAG_TCP ) {
-    int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM;
-    r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zde8:intervali%ie12:min intervali%ie" PEERS_BENCODED "%zd:", peer_list->seed_count, peer_list->down_count, peer_list->peer_count-peer_list->seed_count, erval, erval/2, OT_PEER_COMPARE_SIZE*amount );
+    int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws );
+    /* The scrape dictionary minus its closing 'e' opens the announce reply */
+    r += format_bencode_scrape( r, peer_list->seed_count, peer_list->down_count, peer_list->peer_count-peer_list->seed_count ) - 1;
+    r += FORMAT_LITERAL( r, "8:interval" );
+    r += format_bencode_int( r, erval );
+    r += FORMAT_LITERAL( r, "12:min interval" );
+    r += format_bencode_int( r, erval/2 );
+    r += FORMAT_LITERAL( r, PEERS_BENCODED );
+    r += format_u64( r, OT_PEER_COMPARE_SIZE*amount );
+    *r++ = ':';
   } else {
-    *(uint32_t*)(r+0) = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM );
+    *(uint32_t*)(r+0) = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws ) );
     *(uint32_t*)(r+4) = htonl( peer_list->peer_count - peer_list->seed_count );
     *(uint32_t*)(r+8) = htonl( peer_list->seed_count );
     r += 12;
@@ -283,7 +308,7 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
     if( amount == peer_list->peer_count )
       r += return_peers_all( peer_list, r );
     else
-      r += return_peers_selection( peer_list, amount, r );
+      r += return_peers_selection( ws, peer_list, amount, r );
   }
 
   if( proto == FLAG_TCP )
@@ -292,56 +317,64 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
   return r - reply;
 }
 
+/* Scrapes only hold the bucket's shared lock and thus must not clean the
+   torrent. Instead hide, what clean_single_torrent would remove: idled out
+   torrents do not exist and no peer survives OT_PEER_TIMEOUT minutes.
+   Returns 0 if the torrent would have been removed */
+static int scrape_single_torrent( const ot_torrent *torrent, size_t *seeds, size_t *downloads, size_t *leechers ) {
+  const ot_peerlist *peer_list = torrent->peer_list;
+  time_t timedout = (time_t)( g_now_minutes - peer_list->base );
+
+  if( timedout > OT_TORRENT_TIMEOUT )
+    return 0;
+
+  *downloads = peer_list->down_count;
+  if( timedout >= OT_PEER_TIMEOUT )
+    *seeds = *leechers = 0;
+  else {
+    *seeds     = peer_list->seed_count;
+    *leechers  = peer_list->peer_count - peer_list->seed_count;
+  }
+  return 1;
+}
+
 /* Fetches scrape info for a specific torrent */
 size_t return_udp_scrape_for_torrent( ot_hash hash, char *reply ) {
-  int          exactmatch, delta_torrentcount = 0;
-  ot_vector   *torrents_list = mutex_bucket_lock_by_hash( hash );
-  ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
-
-  if( !exactmatch ) {
+  const ot_vector *torrents_list = mutex_bucket_lock_shared_by_hash( hash );
+  ot_torrent      *torrent = vector_find_torrent( torrents_list, hash );
+  size_t           seeds, downloads, leechers;
+  uint32_t        *r = (uint32_t*) reply;
+
+  if( torrent && scrape_single_torrent( torrent, &seeds, &downloads, &leechers ) ) {
+    r[0] = htonl( seeds );
+    r[1] = htonl( downloads );
+    r[2] = htonl( leechers );
+  } else
     memset( reply, 0, 12);
-  } else {
-    uint32_t *r = (uint32_t*) reply;
 
-    if( clean_single_torrent( torrent ) ) {
-      vector_remove_torrent( torrents_list, torrent );
-      memset( reply, 0, 12);
-      delta_torrentcount = -1;
-    } else {
-      r[0] = htonl( torrent->peer_list->seed_count );
-      r[1] = htonl( torrent->peer_list->down_count );
-      r[2] = htonl( torrent->peer_list->peer_count-torrent->peer_list->seed_count );
-    }
-  }
-  mutex_bucket_unlock_by_hash( hash, delta_torrentcount );
+  mutex_bucket_unlock_by_hash( hash, 0 );
   return 12;
 }
 
 /* Fetches scrape info for a specific torrent */
 size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *reply ) {
   char *r = reply;
-  int   exactmatch, i;
+  int   i;
 
-  r += sprintf( r, "d5:filesd" );
+  r += FORMAT_LITERAL( r, "d5:filesd" );
 
   for( i=0; i<amount; ++i ) {
-    int          delta_torrentcount = 0;
-    ot_hash     *hash = hash_list + i;
-    ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *hash );
-    ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
-
-    if( exactmatch ) {
-      if( clean_single_torrent( torrent ) ) {
-        vector_remove_torrent( torrents_list, torrent );
-        delta_torrentcount = -1;
-      } else {
-        *r++='2';*r++='0';*r++=':';
-        memcpy( r, hash, sizeof(ot_hash) ); r+=sizeof(ot_hash);
-        r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee",
-          torrent->peer_list->seed_count, torrent->peer_list->down_count, torrent->peer_list->peer_count-torrent->peer_list->seed_count );
-      }
+    ot_hash         *hash = hash_list + i;
+    const ot_vector *torrents_list = mutex_bucket_lock_shared_by_hash( *hash );
+    ot_torrent      *torrent = vector_find_torrent( torrents_list, *hash );
+    size_t           seeds, downloads, leechers;
+
+    if( torrent && scrape_single_torrent( torrent, &seeds, &downloads, &leechers ) ) {
+      *r++='2';*r++='0';*r++=':';
+      memcpy( r, hash, sizeof(ot_hash) ); r+=sizeof(ot_hash);
+      r += format_bencode_scrape( r, seeds, downloads, leechers );
     }
-    mutex_bucket_unlock_by_hash( *hash, delta_torrentcount );
+    mutex_bucket_unlock_by_hash( *hash, 0 );
   }
 
   *r++ = 'e'; *r++ = 'e';
@@ -350,9 +383,8 @@ size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *repl
 
 static ot_peerlist dummy_list;
 size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
-  int          exactmatch;
   ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
-  ot_torrent  *torrent = binary_search( ws->hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_torrent  *torrent = vector_find_torrent( torrents_list, *ws->hash );
   ot_peerlist *peer_list = &dummy_list;
 
 #ifdef WANT_SYNC_LIVE
@@ -362,23 +394,34 @@ size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
   }
 #endif
 
-  if( exactmatch ) {
+  if( torrent ) {
     peer_list = torrent->peer_list;
     switch( vector_remove_peer( &peer_list->peers, &ws->peer ) ) {
       case 2:  peer_list->seed_count--; /* Fall throughs intended */
-      case 1:  peer_list->peer_count--; /* Fall throughs intended */
+      case 1:  peer_list->peer_count--;
+               peer_list->changed = g_now_seconds; /* Fall throughs intended */
       default: break;
     }
   }
 
   if( proto == FLAG_TCP ) {
-    int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM;
-    ws->reply_size = sprintf( ws->reply, "d8:completei%zde10:incompletei%zde8:intervali%ie12:min intervali%ie" PEERS_BENCODED "0:e", peer_list->seed_count, peer_list->peer_count - peer_list->seed_count, erval, erval / 2 );
+    int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws );
+    char *r = ws->reply;
+    r += FORMAT_LITERAL( r, "d8:complete" );
+    r += format_bencode_int( r, peer_list->seed_count );
+    r += FORMAT_LITERAL( r, "10:incomplete" );
+    r += format_bencode_int( r, peer_list->peer_count - peer_list->seed_count );
+    r += FORMAT_LITERAL( r, "8:interval" );
+    r += format_bencode_int( r, erval );
+    r += FORMAT_LITERAL( r, "12:min interval" );
+    r += format_bencode_int( r, erval / 2 );
+    r += FORMAT_LITERAL( r, PEERS_BENCODED "0:e" );
+    ws->reply_size = r - ws->reply;
   }
 
   /* Handle UDP reply */
   if( proto == FLAG_UDP ) {
-    ((uint32_t*)ws->reply)[2] = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM );
+    ((uint32_t*)ws->reply)[2] = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws ) );
     ((uint32_t*)ws->reply)[3] = htonl( peer_list->peer_count - peer_list->seed_count );
     ((uint32_t*)ws->reply)[4] = htonl( peer_list->seed_count);
     ws->reply_size = 20;
@@ -393,11 +436,11 @@ void iterate_all_torrents( int (*for_each)( ot_torrent* torrent, uintptr_t data
   size_t j;
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector  *torrents_list = mutex_bucket_lock( bucket );
+    const ot_vector *torrents_list = mutex_bucket_lock_shared( bucket );
     ot_torrent *torrents = (ot_torrent*)(torrents_list->data);
 
-    for( j=0; j<torrents_list->size; ++j )
-      if( for_each( torrents + j, data ) )
+    for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j )
+      if( OT_TORRENT_SLOT_USED( torrents + j ) && for_each( torrents + j, data ) )
         break;
 
     mutex_bucket_unlock( bucket, 0 );
@@ -405,6 +448,113 @@ void iterate_all_torrents( int (*for_each)( ot_torrent* torrent, uintptr_t data
   }
 }
 
+ssize_t snapshot_bucket( int bucket, ot_torrent_snapshot **torrents ) {
+  static __thread ot_torrent_snapshot *snapshot;
+  static __thread size_t               snapshot_space;
+  const ot_vector *torrents_list = mutex_bucket_lock_shared( bucket );
+  ot_torrent      *torrent = (ot_torrent*)(torrents_list->data);
+  size_t           j, count = 0;
+
+  if( torrents_list->size > snapshot_space ) {
+    ot_torrent_snapshot *new_snapshot = realloc( snapshot, torrents_list->size * sizeof(ot_torrent_snapshot) );
+    if( !new_snapshot ) {
+      mutex_bucket_unlock( bucket, 0 );
+      return -1;
+    }
+    snapshot       = new_snapshot;
+    snapshot_space = torrents_list->size;
+  }
+
+  for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j, ++torrent ) {
+    ot_torrent_snapshot *copy = snapshot + count;
+    if( !OT_TORRENT_SLOT_USED( torrent ) )
+      continue;
+    memcpy( copy->hash, torrent->hash, sizeof(ot_hash) );
+    copy->seed_count = torrent->peer_list->seed_count;
+    copy->peer_count = torrent->peer_list->peer_count;
+    copy->down_count = torrent->peer_list->down_count;
+    copy->base       = torrent->peer_list->base;
+    copy->changed    = torrent->peer_list->changed;
+    ++count;
+  }
+
+  mutex_bucket_unlock( bucket, 0 );
+  *torrents = snapshot;
+  return count;
+}
+
+ssize_t snapshot_bucket_peers( int bucket, uint8_t **peer_addresses ) {
+  static __thread uint8_t *snapshot;
+  static __thread size_t   snapshot_space;
+  const ot_vector *torrents_list = mutex_bucket_lock_shared( bucket );
+  ot_torrent      *torrent = (ot_torrent*)(torrents_list->data);
+  size_t           j, count = 0;
+
+  /* Peer addresses are contiguous in every peer vector */
+  for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j, ++torrent ) {
+    ot_vector *bucket_list;
+    int        num_buckets = 1;
+
+    if( !OT_TORRENT_SLOT_USED( torrent ) )
+      continue;
+
+    bucket_list = &torrent->peer_list->peers;
+    if( OT_PEERLIST_HASBUCKETS( torrent->peer_list ) ) {
+      num_buckets = bucket_list->size;
+      bucket_list = (ot_vector *)bucket_list->data;
+    }
+
+    while( num_buckets-- ) {
+      if( count + bucket_list->size > snapshot_space ) {
+        size_t   new_space = 2 * ( count + bucket_list->size );
+        uint8_t *new_snapshot = realloc( snapshot, new_space * OT_PEER_COMPARE_SIZE );
+        if( !new_snapshot ) {
+          mutex_bucket_unlock( bucket, 0 );
+          return -1;
+        }
+        snapshot       = new_snapshot;
+        snapshot_space = new_space;
+      }
+      memcpy( snapshot + count * OT_PEER_COMPARE_SIZE, OT_VECTOR_PEER_ADDR( bucket_list, 0 ), bucket_list->size * OT_PEER_COMPARE_SIZE );
+      count += bucket_list->size;
+      ++bucket_list;
+    }
+  }
+
+  mutex_bucket_unlock( bucket, 0 );
+  *peer_addresses = snapshot;
+  return count;
+}
+
+/* Seed from random(), which itself is seeded from /dev/random with
+   WANT_DEV_RANDOM, and tell threads seeding at the same time apart by
+   the address of their workstruct. splitmix64 spreads the bits */
+void ot_random_seed( struct ot_workstruct *ws ) {
+  uint64_t seed = ( (uint64_t)random() << 32 ) ^ (uint64_t)random() ^ (uintptr_t)ws;
+  int i;
+
+  for( i=0; i<4; ++i ) {
+    uint64_t z = ( seed += 0x9e3779b97f4a7c15ULL );
+    z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+    ws->random_state[i] = (uint32_t)( z ^ ( z >> 31 ) );
+  }
+}
+
+/* xoshiro128**, by David Blackman and Sebastiano Vigna */
+uint32_t ot_random( struct ot_workstruct *ws ) {
+  uint32_t *s = ws->random_state;
+  uint32_t  x = s[1] * 5, result = ( ( x << 7 ) | ( x >> 25 ) ) * 9, t = s[1] << 9;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3]  = ( s[3] << 11 ) | ( s[3] >> 21 );
+  return result;
+}
+
 void exerr( char * message ) {
   fprintf( stderr, "%s\n", message );
   exit( 111 );
@@ -423,6 +573,8 @@ void trackerlogic_init( ) {
   fullscrape_init( );
   accesslist_init( );
   livesync_init( );
+  snapshot_init( );
+  journal_init( );
   stats_init( );
 }
 
@@ -434,8 +586,10 @@ void trackerlogic_deinit( void ) {
   for(bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
     ot_vector *torrents_list = mutex_bucket_lock( bucket );
     if( torrents_list->size ) {
-      for( j=0; j<torrents_list->size; ++j ) {
+      for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j ) {
         ot_torrent *torrent = ((ot_torrent*)(torrents_list->data)) + j;
+        if( !OT_TORRENT_SLOT_USED( torrent ) )
+          continue;
         free_peerlist( torrent->peer_list );
         delta_torrentcount -= 1;
       }
@@ -446,6 +600,8 @@ void trackerlogic_deinit( void ) {
 
   /* Deinitialise background worker threads */
   stats_deinit( );
+  journal_deinit( );
+  snapshot_deinit( );
   livesync_deinit( );
   accesslist_deinit( );
   fullscrape_deinit( );
@@ -34,7 +34,7 @@ typedef struct { ot_ip6 address; int bits; }
 #define OT_TORRENT_TIMEOUT_HOURS 24
 #define OT_TORRENT_TIMEOUT      (60*OT_TORRENT_TIMEOUT_HOURS)
 
-#define OT_CLIENT_REQUEST_INTERVAL_RANDOM ( OT_CLIENT_REQUEST_INTERVAL - OT_CLIENT_REQUEST_VARIATION/2 + (int)( random( ) % OT_CLIENT_REQUEST_VARIATION ) )
+#define OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws ) ( OT_CLIENT_REQUEST_INTERVAL - OT_CLIENT_REQUEST_VARIATION/2 + (int)( ot_random( ws ) % OT_CLIENT_REQUEST_VARIATION ) )
 
 /* If WANT_MODEST_FULLSCRAPES is on, ip addresses may not
    fullscrape more frequently than this amount in seconds */
@@ -43,15 +43,18 @@ typedef struct { ot_ip6 address; int bits; }
 /* If peers come back before 10 minutes, don't live sync them */
 #define OT_CLIENT_SYNC_RENEW_BOUNDARY 10
 
-/* Number of tracker admin ip addresses allowed */
-#define OT_ADMINIP_MAX 64
-#define OT_MAX_THREADS 16
-
 #define OT_PEER_TIMEOUT 45
 
-/* We maintain a list of 1024 pointers to sorted list of ot_torrent structs
- Sort key is, of course, its hash */
-#define OT_BUCKET_COUNT_BITS 10
+/* We maintain a list of (by default 1024) pointers to sorted list of
+ ot_torrent structs. Sort key is, of course, its hash. Large trackers
+ want more buckets, so that inserts only move small vectors around, see
+ tracker.buckets. The count is fixed once mutex_init() ran */
+#define OT_BUCKET_COUNT_BITS_DEFAULT 10
+#define OT_BUCKET_COUNT_BITS_MIN      8
+#define OT_BUCKET_COUNT_BITS_MAX     20
+extern int g_bucket_count_bits;
+
+#define OT_BUCKET_COUNT_BITS g_bucket_count_bits
 
 #define OT_BUCKET_COUNT (1<<OT_BUCKET_COUNT_BITS)
 #define OT_BUCKET_COUNT_SHIFT (32-OT_BUCKET_COUNT_BITS)
@@ -99,6 +102,10 @@ struct ot_peerlist {
   size_t         seed_count;
   size_t         peer_count;
   size_t         down_count;
+/* last time in seconds any of the counters above changed, see delta scrapes */
+  ot_time        changed;
+/* minute in which the oldest peer reaches OT_PEER_TIMEOUT, see ot_clean.c */
+  ot_time        next_clean;
 /* normal peers vector or
    pointer to ot_vector[32] buckets if data != NULL and space == 0
 */
@@ -120,10 +127,16 @@ struct ot_workstruct {
   /* The peer currently in the working */
   ot_peer  peer;
 
+  /* Thread specific random number generator state, see ot_random() */
+  uint32_t random_state[4];
+
   /* Pointers into the request buffer */
   ot_hash *hash;
   char    *peer_id;
 
+  /* HTTP specific, set in tcp worker loops, see ot_tcp.c */
+  int      tcp_worker;
+
   /* HTTP specific, non static */
   int      keep_alive;
   char    *request;
@@ -155,6 +168,11 @@ void trackerlogic_init( );
 void trackerlogic_deinit( void );
 void exerr( char * message );
 
+/* Each worker thread seeds its own generator once, so that picking
+   random peers does not take the lock inside random() */
+void     ot_random_seed( struct ot_workstruct *ws );
+uint32_t ot_random( struct ot_workstruct *ws );
+
 /* add_peer_to_torrent does only release the torrent bucket if from_sync is set,
    otherwise it is released in return_peers_for_torrent */
 size_t  add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstruct *ws, size_t amount );
@@ -166,6 +184,23 @@ void    add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_co
 /* torrent iterator */
 void iterate_all_torrents( int (*for_each)( ot_torrent* torrent, uintptr_t data ), uintptr_t data );
 
+/* Bucket snapshots: copies taken under the bucket lock, so that callers
+   walking all torrents can format and compress them without holding it.
+   The arrays belong to the calling thread and stay valid until its next
+   call. Both return the number of entries or -1 when out of memory */
+typedef struct {
+  ot_hash hash;
+  size_t  seed_count;
+  size_t  peer_count;
+  size_t  down_count;
+  ot_time base;
+  ot_time changed;
+} ot_torrent_snapshot;
+
+ssize_t snapshot_bucket( int bucket, ot_torrent_snapshot **torrents );
+/* Addresses of all peers in the bucket, OT_PEER_COMPARE_SIZE bytes each */
+ssize_t snapshot_bucket_peers( int bucket, uint8_t **peer_addresses );
+
 /* Helper, before it moves to its own object */
 void free_peerlist( ot_peerlist *peer_list );
 